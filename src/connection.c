@@ -37,7 +37,9 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <pthread.h>
 #include <ffi.h>
 
 #include "wayland-util.h"
@@ -59,16 +61,80 @@ struct wl_ring_buffer {
 	size_t head, tail;
 	uint32_t size_bits;
 	uint32_t max_size_bits;  /* 0 for unlimited */
+	/* Number of references to consumed data, which then starts at pin
+	 * instead of tail and must neither be moved nor overwritten. */
+	uint32_t pinned;
+	size_t pin;
+	/* Mirrored buffers map the memfd mirror_fd twice back to back, so
+	 * that data wrapping around the end is still contiguous. */
+	bool mirrored;
+	int mirror_fd;
+	/* Most data held since the buffer was last drained, and number of
+	 * drains in a row that held no more than the default size. */
+	size_t peak;
+	uint32_t small_drains;
 };
 
+/* Buffers of at least this size are mirrored when possible */
+#define RING_BUFFER_MIRROR_MIN_BITS 16
+
+/* Buffers are only allocated once data is put in them, and then stay
+ * attached to their connection until it is destroyed. Those of the
+ * default size come from and go back to a process-wide pool, which is
+ * hence only used when a connection starts using a buffer and when it is
+ * destroyed. */
+#define BUFFER_POOL_MAX 64
+
+static struct {
+	pthread_mutex_t mutex;
+	void *free_list;
+	uint32_t count;
+} buffer_pool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+/* Peers receive at most MAX_FDS_OUT fds per recvmsg(), any more would be
+ * lost. Incoming messages may carry up to the kernel limit, SCM_MAX_FD. */
 #define MAX_FDS_OUT	28
+#define MAX_FDS_IN	253
 #define CLEN		(CMSG_LEN(MAX_FDS_OUT * sizeof(int32_t)))
+#define CLEN_IN		(CMSG_SPACE(MAX_FDS_IN * sizeof(int32_t)))
+
+/* Demarshalled closures are recycled through per-size-class free lists,
+ * covering sizes from 128 bytes up to 8 KiB. Bigger closures always go
+ * through the allocator. */
+#define CLOSURE_POOL_MIN_BITS	7
+#define CLOSURE_POOL_CLASSES	7
+#define CLOSURE_POOL_MAX_CACHED	32
+
+struct wl_closure_pool {
+	struct wl_list free_list[CLOSURE_POOL_CLASSES];
+	uint32_t free_count[CLOSURE_POOL_CLASSES];
+	/* Closures handed out and not yet destroyed */
+	uint32_t outstanding;
+	/* Set once the connection is gone, the pool then only waits for
+	 * its outstanding closures to be destroyed. */
+	bool orphaned;
+	struct wl_closure_pool_stats stats;
+};
 
 struct wl_connection {
 	struct wl_ring_buffer in, out;
 	struct wl_ring_buffer fds_in, fds_out;
+	/* For each fd in fds_out, the position in the output stream of the
+	 * message it belongs to, as a uint64_t. */
+	struct wl_ring_buffer fds_out_pos;
+	/* Bytes of the output stream sent so far */
+	uint64_t out_sent;
 	int fd;
 	int want_flush;
+	/* Queued output is flushed automatically once it exceeds
+	 * flush_threshold bytes, unless corked, or once the oldest of it,
+	 * queued at out_queued_at, is older than flush_deadline. Both times
+	 * are in nanoseconds, a flush_deadline of 0 means no deadline. */
+	size_t flush_threshold;
+	uint32_t corked;
+	uint64_t flush_deadline;
+	uint64_t out_queued_at;
+	struct wl_closure_pool *closure_pool;
 };
 
 static inline size_t
@@ -100,7 +166,7 @@ ring_buffer_put(struct wl_ring_buffer *b, const void *data, size_t count)
 		return 0;
 
 	head = ring_buffer_mask(b, b->head);
-	if (head + count <= ring_buffer_capacity(b)) {
+	if (b->mirrored || head + count <= ring_buffer_capacity(b)) {
 		memcpy(b->data + head, data, count);
 	} else {
 		size = ring_buffer_capacity(b) - head;
@@ -113,14 +179,36 @@ ring_buffer_put(struct wl_ring_buffer *b, const void *data, size_t count)
 	return 0;
 }
 
+/* Overwrites count bytes at offset from the tail of the buffer */
+static void
+ring_buffer_put_at(struct wl_ring_buffer *b, size_t offset,
+		   const void *data, size_t count)
+{
+	size_t start, size;
+
+	start = ring_buffer_mask(b, b->tail + offset);
+	if (b->mirrored || start + count <= ring_buffer_capacity(b)) {
+		memcpy(b->data + start, data, count);
+	} else {
+		size = ring_buffer_capacity(b) - start;
+		memcpy(b->data + start, data, size);
+		memcpy(b->data, (const char *) data + size, count - size);
+	}
+}
+
 static void
 ring_buffer_put_iov(struct wl_ring_buffer *b, struct iovec *iov, int *count)
 {
 	size_t head, tail;
 
 	head = ring_buffer_mask(b, b->head);
-	tail = ring_buffer_mask(b, b->tail);
-	if (head < tail) {
+	tail = ring_buffer_mask(b, b->pinned ? b->pin : b->tail);
+	if (b->mirrored) {
+		iov[0].iov_base = b->data + head;
+		iov[0].iov_len = ring_buffer_capacity(b) -
+			(b->head - (b->pinned ? b->pin : b->tail));
+		*count = 1;
+	} else if (head < tail) {
 		iov[0].iov_base = b->data + head;
 		iov[0].iov_len = tail - head;
 		*count = 1;
@@ -144,7 +232,11 @@ ring_buffer_get_iov(struct wl_ring_buffer *b, struct iovec *iov, int *count)
 
 	head = ring_buffer_mask(b, b->head);
 	tail = ring_buffer_mask(b, b->tail);
-	if (tail < head) {
+	if (b->mirrored) {
+		iov[0].iov_base = b->data + tail;
+		iov[0].iov_len = b->head - b->tail;
+		*count = 1;
+	} else if (tail < head) {
 		iov[0].iov_base = b->data + tail;
 		iov[0].iov_len = head - tail;
 		*count = 1;
@@ -162,15 +254,16 @@ ring_buffer_get_iov(struct wl_ring_buffer *b, struct iovec *iov, int *count)
 }
 
 static void
-ring_buffer_copy(struct wl_ring_buffer *b, void *data, size_t count)
+ring_buffer_copy_at(struct wl_ring_buffer *b, size_t offset,
+		    void *data, size_t count)
 {
 	size_t tail, size;
 
 	if (count == 0)
 		return;
 
-	tail = ring_buffer_mask(b, b->tail);
-	if (tail + count <= ring_buffer_capacity(b)) {
+	tail = ring_buffer_mask(b, b->tail + offset);
+	if (b->mirrored || tail + count <= ring_buffer_capacity(b)) {
 		memcpy(data, b->data + tail, count);
 	} else {
 		size = ring_buffer_capacity(b) - tail;
@@ -179,12 +272,42 @@ ring_buffer_copy(struct wl_ring_buffer *b, void *data, size_t count)
 	}
 }
 
+static void
+ring_buffer_copy(struct wl_ring_buffer *b, void *data, size_t count)
+{
+	ring_buffer_copy_at(b, 0, data, count);
+}
+
 static size_t
 ring_buffer_size(struct wl_ring_buffer *b)
 {
 	return b->head - b->tail;
 }
 
+/* Returns a pointer to count bytes of contiguous space at the head of the
+ * buffer, or NULL if that space would wrap around the end of the buffer.
+ * The caller must have ensured there is enough space and advances the head
+ * once the data has been written. */
+static void *
+ring_buffer_reserve(struct wl_ring_buffer *b, size_t count)
+{
+	size_t head;
+
+	head = ring_buffer_mask(b, b->head);
+	if (!b->mirrored && head + count > ring_buffer_capacity(b))
+		return NULL;
+
+	return b->data + head;
+}
+
+/* Whether the count bytes at the tail of the buffer are contiguous */
+static bool
+ring_buffer_is_contiguous(const struct wl_ring_buffer *b, size_t count)
+{
+	return b->mirrored ||
+		ring_buffer_mask(b, b->tail) + count <= ring_buffer_capacity(b);
+}
+
 static char *
 ring_buffer_tail(const struct wl_ring_buffer *b)
 {
@@ -206,25 +329,214 @@ get_max_size_bits_for_size(size_t buffer_size)
 	return max_size_bits;
 }
 
+/* Maps size bytes of fd twice back to back */
+static char *
+mirror_map(int fd, size_t size)
+{
+	char *data;
+
+	data = mmap(NULL, 2 * size, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	if (mmap(data, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(data + size, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(data, 2 * size);
+		return NULL;
+	}
+
+	return data;
+}
+
+static char *
+buffer_pool_get(void)
+{
+	void *data;
+
+	pthread_mutex_lock(&buffer_pool.mutex);
+	data = buffer_pool.free_list;
+	if (data) {
+		buffer_pool.free_list = *(void **) data;
+		buffer_pool.count--;
+	}
+	pthread_mutex_unlock(&buffer_pool.mutex);
+
+	if (data == NULL)
+		data = malloc(size_pot(WL_BUFFER_DEFAULT_SIZE_POT));
+
+	return data;
+}
+
+static void
+buffer_pool_put(char *data)
+{
+	pthread_mutex_lock(&buffer_pool.mutex);
+	if (buffer_pool.count < BUFFER_POOL_MAX) {
+		*(void **) data = buffer_pool.free_list;
+		buffer_pool.free_list = data;
+		buffer_pool.count++;
+		data = NULL;
+	}
+	pthread_mutex_unlock(&buffer_pool.mutex);
+
+	free(data);
+}
+
+static void
+ring_buffer_free(struct wl_ring_buffer *b)
+{
+	if (b->mirrored) {
+		munmap(b->data, 2 * ring_buffer_capacity(b));
+		close(b->mirror_fd);
+		b->mirrored = false;
+	} else {
+		free(b->data);
+	}
+	b->data = NULL;
+}
+
+/* Frees the buffer of a connection being destroyed */
+static void
+ring_buffer_release(struct wl_ring_buffer *b)
+{
+	if (b->data && !b->mirrored &&
+	    b->size_bits == WL_BUFFER_DEFAULT_SIZE_POT) {
+		buffer_pool_put(b->data);
+		b->data = NULL;
+	} else {
+		ring_buffer_free(b);
+	}
+}
+
+/* Grows a mirrored buffer by extending its memfd and mapping it again.
+ * The data stays where it is in the file, only the part that wrapped
+ * around the end of the old buffer is copied after it. */
+static int
+ring_buffer_grow_mirrored(struct wl_ring_buffer *b, size_t size_bits)
+{
+	size_t old_size = ring_buffer_capacity(b);
+	size_t size = size_pot(size_bits);
+	size_t tail = ring_buffer_mask(b, b->tail);
+	size_t used = ring_buffer_size(b);
+	char *data;
+
+	if (ftruncate(b->mirror_fd, size) < 0)
+		return -1;
+
+	data = mirror_map(b->mirror_fd, size);
+	if (data == NULL)
+		return -1;
+
+	if (tail + used > old_size)
+		memcpy(data + old_size, data, tail + used - old_size);
+
+	munmap(b->data, 2 * old_size);
+	b->data = data;
+	b->size_bits = size_bits;
+	b->tail = tail;
+	b->head = tail + used;
+
+	return 0;
+}
+
+static int
+ring_buffer_allocate_mirrored(struct wl_ring_buffer *b, size_t size_bits)
+{
+	size_t size = size_pot(size_bits);
+	size_t used = ring_buffer_size(b);
+	char *data;
+	int fd;
+
+	if (size % sysconf(_SC_PAGESIZE) != 0)
+		return -1;
+
+	if (b->mirrored && size_bits > b->size_bits)
+		return ring_buffer_grow_mirrored(b, size_bits);
+
+	fd = wl_os_memfd_create_cloexec("wayland-connection");
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	data = mirror_map(fd, size);
+	if (data == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	ring_buffer_copy(b, data, used);
+	ring_buffer_free(b);
+	b->data = data;
+	b->head = used;
+	b->tail = 0;
+	b->size_bits = size_bits;
+	b->mirrored = true;
+	b->mirror_fd = fd;
+
+	return 0;
+}
+
 static int
 ring_buffer_allocate(struct wl_ring_buffer *b, size_t size_bits)
 {
 	char *new_data;
+	size_t size;
+
+	/* Fall back to a heap allocated buffer if mirroring fails */
+	if (size_bits >= RING_BUFFER_MIRROR_MIN_BITS &&
+	    ring_buffer_allocate_mirrored(b, size_bits) == 0)
+		return 0;
 
-	new_data = calloc(size_pot(size_bits), 1);
+	if (b->data == NULL && size_bits == WL_BUFFER_DEFAULT_SIZE_POT)
+		new_data = buffer_pool_get();
+	else
+		new_data = malloc(size_pot(size_bits));
 	if (!new_data)
 		return -1;
 
-	ring_buffer_copy(b, new_data, ring_buffer_size(b));
-	free(b->data);
+	size = ring_buffer_size(b);
+	ring_buffer_copy(b, new_data, size);
+	ring_buffer_free(b);
 	b->data = new_data;
 	b->size_bits = size_bits;
-	b->head = ring_buffer_size(b);
+	b->head = size;
 	b->tail = 0;
 
 	return 0;
 }
 
+/* Called whenever data is taken from the buffer. Once drained, a buffer
+ * grown by bursts of data is shrunk back to the default size after
+ * WL_BUFFER_SHRINK_DRAINS drains in a row that did not need more. */
+static void
+ring_buffer_trim(struct wl_ring_buffer *b)
+{
+	size_t peak = b->peak;
+
+	if (b->data == NULL || b->head != b->tail || b->pinned)
+		return;
+
+	b->head = 0;
+	b->tail = 0;
+	b->peak = 0;
+	if (b->size_bits <= WL_BUFFER_DEFAULT_SIZE_POT)
+		return;
+
+	if (peak > WL_BUFFER_DEFAULT_MAX_SIZE) {
+		b->small_drains = 0;
+	} else if (++b->small_drains == WL_BUFFER_SHRINK_DRAINS) {
+		b->small_drains = 0;
+		ring_buffer_allocate(b, WL_BUFFER_DEFAULT_SIZE_POT);
+	}
+}
+
 static size_t
 ring_buffer_get_bits_for_size(struct wl_ring_buffer *b, size_t net_size)
 {
@@ -248,12 +560,31 @@ ring_buffer_is_max_size_reached(struct wl_ring_buffer *b)
 	return net_size >= size_pot(size_bits);
 }
 
+static bool
+ring_buffer_fits(struct wl_ring_buffer *b, size_t count)
+{
+	size_t net_size = ring_buffer_size(b) + count;
+	size_t size_bits = ring_buffer_get_bits_for_size(b, net_size);
+
+	return net_size <= size_pot(size_bits);
+}
+
 static int
 ring_buffer_ensure_space(struct wl_ring_buffer *b, size_t count)
 {
 	size_t net_size = ring_buffer_size(b) + count;
 	size_t size_bits = ring_buffer_get_bits_for_size(b, net_size);
 
+	/* Pinned data can't be moved, so only the space left in the buffer
+	 * can be used until it is unpinned. */
+	if (b->pinned) {
+		if (b->head - b->pin + count > ring_buffer_capacity(b)) {
+			errno = EAGAIN;
+			return -1;
+		}
+		return 0;
+	}
+
 	/* The 'size_bits' value represents the required size (in POT) to store
 	 * 'net_size', which depending whether the buffers are bounded or not
 	 * might not be sufficient (i.e. we might have reached the maximum size
@@ -266,10 +597,16 @@ ring_buffer_ensure_space(struct wl_ring_buffer *b, size_t count)
 		return -1;
 	}
 
-	/* The following test here is a short-cut to avoid reallocating a buffer
-	 * of the same size.
+	if (net_size > b->peak)
+		b->peak = net_size;
+
+	/* Buffers are only allocated once needed, and only grow here unless
+	 * their maximum size was lowered. Drained buffers are shrunk by
+	 * ring_buffer_trim().
 	 */
-	if (size_bits == b->size_bits)
+	if ((size_bits <= b->size_bits &&
+	     (b->max_size_bits == 0 || b->size_bits <= b->max_size_bits)) ||
+	    (b->data == NULL && count == 0))
 		return 0;
 
 	/* Otherwise, we (re)allocate the buffer to match the required size */
@@ -307,6 +644,11 @@ wl_connection_set_max_buffer_size(struct wl_connection *connection,
 	connection->fds_out.max_size_bits = max_size_bits;
 	ring_buffer_ensure_space(&connection->fds_out, 0);
 
+	/* Positions are twice the size of fds */
+	connection->fds_out_pos.max_size_bits =
+		max_size_bits ? max_size_bits + 1 : 0;
+	ring_buffer_ensure_space(&connection->fds_out_pos, 0);
+
 	connection->in.max_size_bits = max_size_bits;
 	ring_buffer_ensure_space(&connection->in, 0);
 
@@ -314,6 +656,138 @@ wl_connection_set_max_buffer_size(struct wl_connection *connection,
 	ring_buffer_ensure_space(&connection->out, 0);
 }
 
+static struct wl_closure_pool *
+closure_pool_create(void)
+{
+	struct wl_closure_pool *pool;
+	int i;
+
+	pool = zalloc(sizeof *pool);
+	if (pool == NULL)
+		return NULL;
+
+	for (i = 0; i < CLOSURE_POOL_CLASSES; i++)
+		wl_list_init(&pool->free_list[i]);
+
+	return pool;
+}
+
+static void
+closure_pool_destroy(struct wl_closure_pool *pool)
+{
+	struct wl_closure *closure, *next;
+	int i;
+
+	for (i = 0; i < CLOSURE_POOL_CLASSES; i++) {
+		wl_list_for_each_safe(closure, next, &pool->free_list[i], link)
+			free(closure);
+		wl_list_init(&pool->free_list[i]);
+		pool->free_count[i] = 0;
+	}
+	pool->stats.cached = 0;
+
+	/* Client side closures may be queued beyond the lifetime of the
+	 * connection, keep the pool around until the last one is gone. */
+	if (pool->outstanding == 0)
+		free(pool);
+	else
+		pool->orphaned = true;
+}
+
+static int
+closure_pool_size_class(size_t size)
+{
+	int size_class = 0;
+
+	while (size_class < CLOSURE_POOL_CLASSES &&
+	       size_pot(CLOSURE_POOL_MIN_BITS + size_class) < size)
+		size_class++;
+
+	return size_class < CLOSURE_POOL_CLASSES ? size_class : -1;
+}
+
+static struct wl_closure *
+closure_pool_alloc(struct wl_closure_pool *pool, size_t size)
+{
+	struct wl_closure *closure;
+	int size_class;
+
+	size_class = closure_pool_size_class(size);
+	if (size_class < 0) {
+		closure = malloc(size);
+	} else if (!wl_list_empty(&pool->free_list[size_class])) {
+		closure = wl_container_of(pool->free_list[size_class].next,
+					  closure, link);
+		wl_list_remove(&closure->link);
+		pool->free_count[size_class]--;
+		pool->stats.cached--;
+		pool->stats.recycled++;
+	} else {
+		closure = malloc(size_pot(CLOSURE_POOL_MIN_BITS + size_class));
+	}
+
+	if (closure == NULL)
+		return NULL;
+
+	closure->pool = pool;
+	closure->size_class = size_class;
+	pool->outstanding++;
+	pool->stats.allocated++;
+
+	return closure;
+}
+
+static void
+closure_pool_release(struct wl_closure_pool *pool, struct wl_closure *closure)
+{
+	int size_class = closure->size_class;
+
+	pool->outstanding--;
+
+	if (!pool->orphaned && size_class >= 0 &&
+	    pool->free_count[size_class] < CLOSURE_POOL_MAX_CACHED) {
+		wl_list_insert(&pool->free_list[size_class], &closure->link);
+		pool->free_count[size_class]++;
+		pool->stats.cached++;
+	} else {
+		free(closure);
+	}
+
+	if (pool->orphaned && pool->outstanding == 0)
+		free(pool);
+}
+
+static size_t
+ring_buffer_allocated(const struct wl_ring_buffer *b)
+{
+	return b->data ? ring_buffer_capacity(b) : 0;
+}
+
+/* Bytes of the output stream sent so far */
+uint64_t
+wl_connection_get_sent_bytes(struct wl_connection *connection)
+{
+	return connection->out_sent;
+}
+
+/* Memory held by the buffers of the connection, in bytes */
+size_t
+wl_connection_get_buffer_bytes(struct wl_connection *connection)
+{
+	return ring_buffer_allocated(&connection->in) +
+		ring_buffer_allocated(&connection->out) +
+		ring_buffer_allocated(&connection->fds_in) +
+		ring_buffer_allocated(&connection->fds_out) +
+		ring_buffer_allocated(&connection->fds_out_pos);
+}
+
+void
+wl_connection_get_closure_pool_stats(struct wl_connection *connection,
+				     struct wl_closure_pool_stats *stats)
+{
+	*stats = connection->closure_pool->stats;
+}
+
 struct wl_connection *
 wl_connection_create(int fd, size_t max_buffer_size)
 {
@@ -323,8 +797,15 @@ wl_connection_create(int fd, size_t max_buffer_size)
 	if (connection == NULL)
 		return NULL;
 
+	connection->closure_pool = closure_pool_create();
+	if (connection->closure_pool == NULL) {
+		free(connection);
+		return NULL;
+	}
+
 	wl_connection_set_max_buffer_size(connection, max_buffer_size);
 
+	connection->flush_threshold = WL_BUFFER_DEFAULT_MAX_SIZE;
 	connection->fd = fd;
 
 	return connection;
@@ -348,6 +829,7 @@ close_fds(struct wl_ring_buffer *buffer, int max)
 
 	size = count * sizeof(int32_t);
 	buffer->tail += size;
+	ring_buffer_trim(buffer);
 }
 
 void
@@ -362,13 +844,15 @@ wl_connection_destroy(struct wl_connection *connection)
 	int fd = connection->fd;
 
 	close_fds(&connection->fds_out, -1);
-	free(connection->fds_out.data);
-	free(connection->out.data);
+	ring_buffer_release(&connection->fds_out);
+	ring_buffer_release(&connection->fds_out_pos);
+	ring_buffer_release(&connection->out);
 
 	close_fds(&connection->fds_in, -1);
-	free(connection->fds_in.data);
-	free(connection->in.data);
+	ring_buffer_release(&connection->fds_in);
+	ring_buffer_release(&connection->in);
 
+	closure_pool_destroy(connection->closure_pool);
 	free(connection);
 
 	return fd;
@@ -384,10 +868,12 @@ void
 wl_connection_consume(struct wl_connection *connection, size_t size)
 {
 	connection->in.tail += size;
+	ring_buffer_trim(&connection->in);
 }
 
 static void
-build_cmsg(struct wl_ring_buffer *buffer, char *data, size_t *clen)
+build_cmsg(struct wl_ring_buffer *buffer, char *data, size_t *clen,
+	   int *count)
 {
 	struct cmsghdr *cmsg;
 	size_t size;
@@ -396,6 +882,7 @@ build_cmsg(struct wl_ring_buffer *buffer, char *data, size_t *clen)
 	if (size > MAX_FDS_OUT * sizeof(int32_t))
 		size = MAX_FDS_OUT * sizeof(int32_t);
 
+	*count = size / sizeof(int32_t);
 	if (size > 0) {
 		cmsg = (struct cmsghdr *) data;
 		cmsg->cmsg_level = SOL_SOCKET;
@@ -441,44 +928,56 @@ decode_cmsg(struct wl_ring_buffer *buffer, struct msghdr *msg)
 	return 0;
 }
 
+/* Truncates iov to at most limit bytes */
+static void
+iov_truncate(struct iovec *iov, int *count, size_t limit)
+{
+	int i;
+
+	for (i = 0; i < *count; i++) {
+		if (iov[i].iov_len >= limit) {
+			iov[i].iov_len = limit;
+			*count = i + 1;
+			return;
+		}
+		limit -= iov[i].iov_len;
+	}
+}
+
 int
 wl_connection_flush(struct wl_connection *connection)
 {
 	struct iovec iov[2];
 	struct msghdr msg = {0};
 	char cmsg[CLEN];
-	int len = 0, count;
+	int len = 0, count, fds;
 	size_t clen;
 	size_t tail;
+	uint64_t pos;
 
 	if (!connection->want_flush)
 		return 0;
 
 	tail = connection->out.tail;
 	while (ring_buffer_size(&connection->out) > 0) {
-		build_cmsg(&connection->fds_out, cmsg, &clen);
-
-		if (clen >= CLEN) {
-			/* UNIX domain sockets allows to send file descriptors
-			 * using ancillary data.
-			 *
-			 * As per the UNIX domain sockets man page (man 7 unix),
-			 * "at least one byte of real data should be sent when
-			 * sending ancillary data".
-			 *
-			 * This is why we send only a single byte here, to ensure
-			 * all file descriptors are sent before the bytes are
-			 * cleared out.
-			 *
-			 * Otherwise This can fail to clear the file descriptors
-			 * first if individual messages are allowed to have 224
-			 * (8 bytes * MAX_FDS_OUT = 224) file descriptors .
-			 */
-			iov[0].iov_base = ring_buffer_tail(&connection->out);
-			iov[0].iov_len = 1;
-			count = 1;
-		} else {
-			ring_buffer_get_iov(&connection->out, iov, &count);
+		build_cmsg(&connection->fds_out, cmsg, &clen, &fds);
+		ring_buffer_get_iov(&connection->out, iov, &count);
+
+		/* If not all pending fds fit in one message, send the data
+		 * up to the message of the first fd left out. Peers only
+		 * get to parse a message once all its fds arrived. */
+		if (ring_buffer_size(&connection->fds_out) >
+		    fds * sizeof(int32_t)) {
+			ring_buffer_copy_at(&connection->fds_out_pos,
+					    fds * sizeof pos,
+					    &pos, sizeof pos);
+
+			/* A message can't have more than MAX_FDS_OUT fds,
+			 * but still make progress if it does. */
+			if (pos <= connection->out_sent)
+				pos = connection->out_sent + 1;
+
+			iov_truncate(iov, &count, pos - connection->out_sent);
 		}
 
 		msg.msg_name = NULL;
@@ -489,21 +988,28 @@ wl_connection_flush(struct wl_connection *connection)
 		msg.msg_controllen = clen;
 
 		do {
-			len = sendmsg(connection->fd, &msg,
-				      MSG_NOSIGNAL | MSG_DONTWAIT);
+			len = wl_os_sendmsg(connection->fd, &msg,
+					    MSG_NOSIGNAL | MSG_DONTWAIT);
 		} while (len == -1 && errno == EINTR);
 
 		if (len == -1)
 			return -1;
 
-		close_fds(&connection->fds_out, MAX_FDS_OUT);
+		close_fds(&connection->fds_out, fds);
+		connection->fds_out_pos.tail += fds * sizeof pos;
 
 		connection->out.tail += len;
+		connection->out_sent += len;
 	}
 
 	connection->want_flush = 0;
+	len = connection->out.head - tail;
+
+	ring_buffer_trim(&connection->out);
+	ring_buffer_trim(&connection->fds_out);
+	ring_buffer_trim(&connection->fds_out_pos);
 
-	return connection->out.head - tail;
+	return len;
 }
 
 uint32_t
@@ -512,12 +1018,18 @@ wl_connection_pending_input(struct wl_connection *connection)
 	return ring_buffer_size(&connection->in);
 }
 
+uint32_t
+wl_connection_pending_output(struct wl_connection *connection)
+{
+	return ring_buffer_size(&connection->out);
+}
+
 int
 wl_connection_read(struct wl_connection *connection)
 {
 	struct iovec iov[2];
 	struct msghdr msg;
-	char cmsg[CLEN];
+	char cmsg[CLEN_IN];
 	int len, count, ret;
 
 	while (1) {
@@ -527,8 +1039,12 @@ wl_connection_read(struct wl_connection *connection)
 		if (ring_buffer_is_max_size_reached(&connection->in))
 			return data_size;
 
-		if (ring_buffer_ensure_space(&connection->in, 1) < 0)
+		if (ring_buffer_ensure_space(&connection->in, 1) < 0) {
+			/* The buffer is full of pinned data */
+			if (errno == EAGAIN && data_size > 0)
+				return data_size;
 			return -1;
+		}
 
 		ring_buffer_put_iov(&connection->in, iov, &count);
 
@@ -561,6 +1077,8 @@ wl_connection_read(struct wl_connection *connection)
 			return -1;
 
 		connection->in.head += len;
+		if (ring_buffer_size(&connection->in) > connection->in.peak)
+			connection->in.peak = ring_buffer_size(&connection->in);
 	}
 }
 
@@ -576,25 +1094,62 @@ wl_connection_write(struct wl_connection *connection,
 	return 0;
 }
 
-int
-wl_connection_queue(struct wl_connection *connection,
-		    const void *data, size_t count)
+static bool
+flush_deadline_expired(struct wl_connection *connection)
 {
-	/* We want to try to flush when the buffer reaches the default maximum
-	 * size even if the buffer has been previously expanded.
+	if (connection->flush_deadline == 0 ||
+	    ring_buffer_size(&connection->out) == 0)
+		return false;
+
+	return wl_monotonic_nsec() - connection->out_queued_at >=
+		connection->flush_deadline;
+}
+
+static int
+wl_connection_prepare_queue(struct wl_connection *connection, size_t count)
+{
+	struct wl_ring_buffer *out = &connection->out;
+	bool flush;
+
+	/* We want to try to flush when the buffer reaches the threshold
+	 * (by default the default maximum size) even if the buffer has been
+	 * previously expanded.
 	 *
 	 * Otherwise the larger buffer will cause us to flush less frequently,
 	 * which could increase lag.
 	 *
 	 * We'd like to flush often and get the buffer size back down if possible.
+	 * Corked connections hold their data back until it no longer fits
+	 * or the flush deadline expired.
 	 */
-	if (ring_buffer_size(&connection->out) + count > WL_BUFFER_DEFAULT_MAX_SIZE) {
+	if (!ring_buffer_fits(out, count))
+		flush = true;
+	else if (ring_buffer_size(out) + count > connection->flush_threshold)
+		flush = !connection->corked ||
+			flush_deadline_expired(connection);
+	else
+		flush = flush_deadline_expired(connection);
+
+	if (flush) {
 		connection->want_flush = 1;
 		if (wl_connection_flush(connection) < 0 && errno != EAGAIN)
 			return -1;
 	}
 
-	if (ring_buffer_ensure_space(&connection->out, count) < 0)
+	/* Data left over by a flush is only waiting for the socket, restart
+	 * its deadline rather than retrying for every message. */
+	if (connection->flush_deadline &&
+	    (flush || ring_buffer_size(out) == 0))
+		connection->out_queued_at = wl_monotonic_nsec();
+
+	return ring_buffer_ensure_space(out, count);
+}
+
+int
+wl_connection_queue(struct wl_connection *connection,
+		    const void *data, size_t count)
+{
+	if (wl_connection_prepare_queue(connection, count) < 0)
 		return -1;
 
 	return ring_buffer_put(&connection->out, data, count);
@@ -619,18 +1174,66 @@ wl_connection_get_fd(struct wl_connection *connection)
 	return connection->fd;
 }
 
+void
+wl_connection_cork(struct wl_connection *connection)
+{
+	connection->corked++;
+}
+
+uint32_t
+wl_connection_uncork(struct wl_connection *connection)
+{
+	if (connection->corked > 0)
+		connection->corked--;
+
+	return connection->corked;
+}
+
+bool
+wl_connection_is_corked(struct wl_connection *connection)
+{
+	return connection->corked > 0;
+}
+
+void
+wl_connection_set_flush_threshold(struct wl_connection *connection,
+				  size_t threshold)
+{
+	if (threshold == 0)
+		threshold = WL_BUFFER_DEFAULT_MAX_SIZE;
+
+	connection->flush_threshold = threshold;
+}
+
+void
+wl_connection_set_flush_deadline(struct wl_connection *connection,
+				 uint64_t deadline_nsec)
+{
+	if (deadline_nsec && !connection->flush_deadline)
+		connection->out_queued_at = wl_monotonic_nsec();
+
+	connection->flush_deadline = deadline_nsec;
+}
+
 static int
 wl_connection_put_fd(struct wl_connection *connection, int32_t fd)
 {
+	uint64_t pos;
+
 	if (ring_buffer_size(&connection->fds_out) >= MAX_FDS_OUT * sizeof fd) {
 		connection->want_flush = 1;
 		if (wl_connection_flush(connection) < 0 && errno != EAGAIN)
 			return -1;
 	}
 
-	if (ring_buffer_ensure_space(&connection->fds_out, sizeof fd) < 0)
+	if (ring_buffer_ensure_space(&connection->fds_out, sizeof fd) < 0 ||
+	    ring_buffer_ensure_space(&connection->fds_out_pos, sizeof pos) < 0)
 		return -1;
 
+	/* The message of the fd is queued right after its fds */
+	pos = connection->out_sent + ring_buffer_size(&connection->out);
+	ring_buffer_put(&connection->fds_out_pos, &pos, sizeof pos);
+
 	return ring_buffer_put(&connection->fds_out, &fd, sizeof fd);
 }
 
@@ -685,25 +1288,231 @@ wl_message_get_since(const struct wl_message *message)
 
 	since = atoi(message->signature);
 
-	if (since == 0)
-		since = 1;
+	if (since == 0)
+		since = 1;
+
+	return since;
+}
+
+/* Message descriptors are kept in a process wide open addressing table
+ * keyed by the signature string. A descriptor only depends on the
+ * signature, so all messages with the same signature share one, and the
+ * table is bounded by the number of distinct signatures no matter how
+ * protocol metadata is allocated and freed. Lookups don't take any lock:
+ * tables and descriptors are never freed or modified once published, and a
+ * table that outgrew its load factor is replaced by a bigger copy. Inserts
+ * are serialized by desc_cache.mutex. */
+#define DESC_CACHE_MIN_BITS 8
+
+struct desc_table {
+	struct desc_table *retired;
+	uint32_t mask;
+	uint32_t count;
+	const struct wl_message_desc *entries[];
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct desc_table *table;
+} desc_cache = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static inline uint32_t
+desc_table_hash(const char *signature)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*signature)
+		hash = (hash ^ (unsigned char) *signature++) * 16777619u;
+
+	return hash;
+}
+
+static const struct wl_message_desc *
+desc_table_lookup(struct desc_table *table, const char *signature,
+		  uint32_t hash)
+{
+	const struct wl_message_desc *desc;
+	uint32_t i;
+
+	for (i = hash & table->mask; ; i = (i + 1) & table->mask) {
+		desc = __atomic_load_n(&table->entries[i], __ATOMIC_ACQUIRE);
+		if (desc == NULL)
+			return NULL;
+
+		if (desc->hash == hash &&
+		    strcmp(desc->signature, signature) == 0)
+			return desc;
+	}
+}
+
+static void
+desc_table_insert(struct desc_table *table, const struct wl_message_desc *desc)
+{
+	uint32_t i;
+
+	for (i = desc->hash & table->mask;
+	     table->entries[i] != NULL; i = (i + 1) & table->mask)
+		;
+
+	__atomic_store_n(&table->entries[i], desc, __ATOMIC_RELEASE);
+	table->count++;
+}
+
+static struct desc_table *
+desc_table_create(uint32_t bits, struct desc_table *old)
+{
+	struct desc_table *table;
+	uint32_t i;
+
+	table = zalloc(sizeof *table + (sizeof table->entries[0] << bits));
+	if (table == NULL)
+		return NULL;
+
+	table->mask = (1u << bits) - 1;
+	if (old) {
+		for (i = 0; i <= old->mask; i++)
+			if (old->entries[i])
+				desc_table_insert(table, old->entries[i]);
+	}
+
+	/* Readers may still be walking the old table, keep it around. */
+	table->retired = old;
+
+	return table;
+}
+
+static struct wl_message_desc *
+message_desc_create(const struct wl_message *message, uint32_t hash)
+{
+	struct wl_message_desc *desc;
+	struct argument_details arg;
+	const char *signature;
+	size_t length;
+	int i, count, variable = 0;
+
+	count = arg_count_for_signature(message->signature);
+	length = strlen(message->signature) + 1;
+	desc = zalloc(sizeof *desc + count + length);
+	if (desc == NULL)
+		return NULL;
+
+	/* The signature is copied after the types, the descriptor outlives
+	 * the message it was created for. */
+	desc->signature = memcpy(desc->types + count, message->signature,
+				 length);
+	desc->hash = hash;
+	desc->count = count;
+	desc->since = wl_message_get_since(message);
+
+	signature = message->signature;
+	for (i = 0; i < count; i++) {
+		signature = get_next_argument(signature, &arg);
+		desc->types[i] = arg.type;
+		if (arg.nullable && i < 32)
+			desc->nullable |= 1u << i;
+
+		switch (arg.type) {
+		case WL_ARG_FD:
+			desc->num_fds++;
+			break;
+		case WL_ARG_ARRAY:
+			desc->num_arrays++;
+			variable = 1;
+			break;
+		case WL_ARG_STRING:
+			variable = 1;
+			break;
+		case WL_ARG_OBJECT:
+		case WL_ARG_NEW_ID:
+			desc->num_objects++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (!variable)
+		desc->fixed_size = (2 + count - desc->num_fds) * sizeof(uint32_t);
+
+	return desc;
+}
+
+/** Get the parsed signature of a message
+ *
+ * The descriptor is created the first time a signature is seen and cached
+ * for the lifetime of the process. Returns NULL if the descriptor could not
+ * be allocated.
+ */
+const struct wl_message_desc *
+wl_message_get_desc(const struct wl_message *message)
+{
+	const struct wl_message_desc *desc = NULL;
+	struct wl_message_desc *new_desc;
+	struct desc_table *table, *grown;
+	uint32_t hash;
+
+	hash = desc_table_hash(message->signature);
+	table = __atomic_load_n(&desc_cache.table, __ATOMIC_ACQUIRE);
+	if (table) {
+		desc = desc_table_lookup(table, message->signature, hash);
+		if (desc)
+			return desc;
+	}
+
+	pthread_mutex_lock(&desc_cache.mutex);
+
+	table = desc_cache.table;
+	if (table)
+		desc = desc_table_lookup(table, message->signature, hash);
+	if (desc)
+		goto out;
+
+	if (table == NULL || (table->count + 1) * 2 > table->mask + 1) {
+		grown = desc_table_create(table ?
+					  __builtin_ctz(table->mask + 1) + 1 :
+					  DESC_CACHE_MIN_BITS, table);
+		if (grown == NULL)
+			goto out;
+
+		__atomic_store_n(&desc_cache.table, grown, __ATOMIC_RELEASE);
+		table = grown;
+	}
+
+	new_desc = message_desc_create(message, hash);
+	if (new_desc == NULL)
+		goto out;
+
+	desc_table_insert(table, new_desc);
+	desc = new_desc;
+
+out:
+	pthread_mutex_unlock(&desc_cache.mutex);
+
+	if (desc == NULL) {
+		wl_log("could not allocate descriptor for %s (signature %s)\n",
+		       message->name, message->signature);
+		errno = ENOMEM;
+	}
 
-	return since;
+	return desc;
 }
 
-void
-wl_argument_from_va_list(const char *signature, union wl_argument *args,
-			 int count, va_list ap)
+int
+wl_argument_from_va_list(const struct wl_message *message,
+			 union wl_argument *args, int count, va_list ap)
 {
+	const struct wl_message_desc *desc;
 	int i;
-	const char *sig_iter;
-	struct argument_details arg;
 
-	sig_iter = signature;
-	for (i = 0; i < count; i++) {
-		sig_iter = get_next_argument(sig_iter, &arg);
+	desc = wl_message_get_desc(message);
+	if (desc == NULL)
+		return -1;
+
+	if (count > desc->count)
+		count = desc->count;
 
-		switch(arg.type) {
+	for (i = 0; i < count; i++) {
+		switch(desc->types[i]) {
 		case WL_ARG_INT:
 			args[i].i = va_arg(ap, int32_t);
 			break;
@@ -730,30 +1539,40 @@ wl_argument_from_va_list(const char *signature, union wl_argument *args,
 			break;
 		}
 	}
+
+	return 0;
 }
 
 static void
 wl_closure_clear_fds(struct wl_closure *closure)
 {
-	const char *signature = closure->message->signature;
-	struct argument_details arg;
+	const struct wl_message_desc *desc = closure->desc;
 	int i;
 
+	if (desc->num_fds == 0)
+		return;
+
 	for (i = 0; i < closure->count; i++) {
-		signature = get_next_argument(signature, &arg);
-		if (arg.type == WL_ARG_FD)
+		if (desc->types[i] == WL_ARG_FD)
 			closure->args[i].h = -1;
 	}
 }
 
 static struct wl_closure *
 wl_closure_init(const struct wl_message *message, uint32_t size,
-                int *num_arrays, union wl_argument *args)
+		int *num_arrays, union wl_argument *args,
+		struct wl_closure_pool *pool)
 {
+	const struct wl_message_desc *desc;
 	struct wl_closure *closure;
 	int count;
+	size_t header_size, size_to_allocate;
 
-	count = arg_count_for_signature(message->signature);
+	desc = wl_message_get_desc(message);
+	if (desc == NULL)
+		return NULL;
+
+	count = desc->count;
 	if (count > WL_CLOSURE_MAX_ARGS) {
 		wl_log("too many args (%d) for %s (signature %s)\n", count,
 		       message->name, message->signature);
@@ -761,30 +1580,48 @@ wl_closure_init(const struct wl_message *message, uint32_t size,
 		return NULL;
 	}
 
-	int size_to_allocate;
-
-	if (size) {
-		*num_arrays = wl_message_count_arrays(message);
-		size_to_allocate = sizeof *closure + size +
-				   *num_arrays * sizeof(struct wl_array);
-	} else {
-		size_to_allocate = sizeof *closure;
+	/* The closure is sized for the arguments of the message, followed by
+	 * the wl_array headers and the payload of demarshalled messages. */
+	header_size = sizeof *closure + count * sizeof *args;
+	if (num_arrays) {
+		*num_arrays = desc->num_arrays;
+		header_size += *num_arrays * sizeof(struct wl_array);
 	}
-	closure = zalloc(size_to_allocate);
+	size_to_allocate = header_size + size;
+
+	if (pool)
+		closure = closure_pool_alloc(pool, size_to_allocate);
+	else
+		closure = malloc(size_to_allocate);
 
 	if (!closure) {
-		wl_log("could not allocate closure of size (%d) for "
+		wl_log("could not allocate closure of size (%zu) for "
 		       "%s (signature %s)\n", size_to_allocate, message->name,
 		       message->signature);
 		errno = ENOMEM;
 		return NULL;
 	}
 
+	if (!pool) {
+		closure->pool = NULL;
+		closure->size_class = -1;
+	}
+
+	/* The payload is filled in by the caller, clear everything else. */
+	memset(closure->extra, 0, header_size - sizeof *closure);
+	wl_list_init(&closure->link);
+	closure->proxy = NULL;
+	closure->connection = NULL;
+	closure->args = closure->extra;
+
 	if (args)
 		memcpy(closure->args, args, count * sizeof *args);
 
 	closure->message = message;
+	closure->desc = desc;
 	closure->count = count;
+	closure->opcode = 0;
+	closure->sender_id = 0;
 
 	/* Set these all to -1 so we can close any that have been
 	 * set to a real value during wl_closure_destroy().
@@ -802,33 +1639,32 @@ wl_closure_marshal(struct wl_object *sender, uint32_t opcode,
 		   union wl_argument *args,
 		   const struct wl_message *message)
 {
+	const struct wl_message_desc *desc;
 	struct wl_closure *closure;
 	struct wl_object *object;
 	int i, count, fd, dup_fd;
-	const char *signature;
-	struct argument_details arg;
 
-	closure = wl_closure_init(message, 0, NULL, args);
+	closure = wl_closure_init(message, 0, NULL, args, NULL);
 	if (closure == NULL)
 		return NULL;
 
+	desc = closure->desc;
 	count = closure->count;
 
-	signature = message->signature;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-
-		switch (arg.type) {
+		switch (desc->types[i]) {
 		case WL_ARG_FIXED:
 		case WL_ARG_UINT:
 		case WL_ARG_INT:
 			break;
 		case WL_ARG_STRING:
-			if (!arg.nullable && args[i].s == NULL)
+			if (!wl_message_desc_arg_nullable(desc, i) &&
+			    args[i].s == NULL)
 				goto err_null;
 			break;
 		case WL_ARG_OBJECT:
-			if (!arg.nullable && args[i].o == NULL)
+			if (!wl_message_desc_arg_nullable(desc, i) &&
+			    args[i].o == NULL)
 				goto err_null;
 			break;
 		case WL_ARG_NEW_ID:
@@ -854,7 +1690,8 @@ wl_closure_marshal(struct wl_object *sender, uint32_t opcode,
 			closure->args[i].h = dup_fd;
 			break;
 		default:
-			wl_abort("unhandled format code: '%c'\n", arg.type);
+			wl_abort("unhandled format code: '%c'\n",
+				 desc->types[i]);
 			break;
 		}
 	}
@@ -879,26 +1716,26 @@ wl_closure_vmarshal(struct wl_object *sender, uint32_t opcode, va_list ap,
 {
 	union wl_argument args[WL_CLOSURE_MAX_ARGS];
 
-	wl_argument_from_va_list(message->signature, args,
-				 WL_CLOSURE_MAX_ARGS, ap);
+	if (wl_argument_from_va_list(message, args,
+				     WL_CLOSURE_MAX_ARGS, ap) < 0)
+		return NULL;
 
 	return wl_closure_marshal(sender, opcode, args, message);
 }
 
-struct wl_closure *
-wl_connection_demarshal(struct wl_connection *connection,
-			uint32_t size,
-			struct wl_map *objects,
-			const struct wl_message *message)
+static struct wl_closure *
+demarshal(struct wl_connection *connection, uint32_t size,
+	  struct wl_map *objects, const struct wl_message *message,
+	  bool in_place)
 {
 	uint32_t *p, *next, *end, length, length_in_u32, id;
 	int fd;
 	char *s;
 	int i, count, num_arrays;
-	const char *signature;
-	struct argument_details arg;
+	const struct wl_message_desc *desc;
 	struct wl_closure *closure;
 	struct wl_array *array_extra;
+	size_t tail;
 
 	/* Space for sender_id and opcode */
 	if (size < 2 * sizeof *p) {
@@ -908,27 +1745,37 @@ wl_connection_demarshal(struct wl_connection *connection,
 		return NULL;
 	}
 
-	closure = wl_closure_init(message, size, &num_arrays, NULL);
+	/* Messages that wrap around the end of the input buffer, or that
+	 * aren't aligned in it, are copied into the closure. */
+	tail = ring_buffer_mask(&connection->in, connection->in.tail);
+	if (!ring_buffer_is_contiguous(&connection->in, size) ||
+	    tail % sizeof *p != 0)
+		in_place = false;
+
+	closure = wl_closure_init(message, in_place ? 0 : size, &num_arrays,
+				  NULL, connection->closure_pool);
 	if (closure == NULL) {
 		wl_connection_consume(connection, size);
 		return NULL;
 	}
 
+	desc = closure->desc;
 	count = closure->count;
 
-	array_extra = closure->extra;
-	p = (uint32_t *)(closure->extra + num_arrays);
+	array_extra = (struct wl_array *) (closure->args + count);
+	if (in_place) {
+		p = (uint32_t *) ring_buffer_tail(&connection->in);
+	} else {
+		p = (uint32_t *)(array_extra + num_arrays);
+		wl_connection_copy(connection, p, size);
+	}
 	end = p + size / sizeof *p;
 
-	wl_connection_copy(connection, p, size);
 	closure->sender_id = *p++;
 	closure->opcode = *p++ & 0x0000ffff;
 
-	signature = message->signature;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-
-		if (arg.type != WL_ARG_FD && p + 1 > end) {
+		if (desc->types[i] != WL_ARG_FD && p + 1 > end) {
 			wl_log("message too short, "
 			       "object (%d), message %s(%s)\n",
 			       closure->sender_id, message->name,
@@ -937,7 +1784,7 @@ wl_connection_demarshal(struct wl_connection *connection,
 			goto err;
 		}
 
-		switch (arg.type) {
+		switch (desc->types[i]) {
 		case WL_ARG_UINT:
 			closure->args[i].u = *p++;
 			break;
@@ -950,7 +1797,8 @@ wl_connection_demarshal(struct wl_connection *connection,
 		case WL_ARG_STRING:
 			length = *p++;
 
-			if (length == 0 && !arg.nullable) {
+			if (length == 0 &&
+			    !wl_message_desc_arg_nullable(desc, i)) {
 				wl_log("NULL string received on non-nullable "
 				       "type, message %s(%s)\n", message->name,
 				       message->signature);
@@ -998,7 +1846,8 @@ wl_connection_demarshal(struct wl_connection *connection,
 			id = *p++;
 			closure->args[i].n = id;
 
-			if (id == 0 && !arg.nullable) {
+			if (id == 0 &&
+			    !wl_message_desc_arg_nullable(desc, i)) {
 				wl_log("NULL object received on non-nullable "
 				       "type, message %s(%s)\n", message->name,
 				       message->signature);
@@ -1062,6 +1911,7 @@ wl_connection_demarshal(struct wl_connection *connection,
 
 			ring_buffer_copy(&connection->fds_in, &fd, sizeof fd);
 			connection->fds_in.tail += sizeof fd;
+			ring_buffer_trim(&connection->fds_in);
 			closure->args[i].h = fd;
 			break;
 		default:
@@ -1070,6 +1920,12 @@ wl_connection_demarshal(struct wl_connection *connection,
 		}
 	}
 
+	if (in_place) {
+		if (connection->in.pinned++ == 0)
+			connection->in.pin = connection->in.tail;
+		closure->connection = connection;
+	}
+
 	wl_connection_consume(connection, size);
 
 	return closure;
@@ -1081,6 +1937,28 @@ wl_connection_demarshal(struct wl_connection *connection,
 	return NULL;
 }
 
+struct wl_closure *
+wl_connection_demarshal(struct wl_connection *connection,
+			uint32_t size,
+			struct wl_map *objects,
+			const struct wl_message *message)
+{
+	return demarshal(connection, size, objects, message, false);
+}
+
+/* Like wl_connection_demarshal(), but strings and arrays of the closure
+ * point straight into the input buffer when possible. The message is
+ * consumed, its data stays valid until the closure is destroyed, which
+ * must happen before the connection is destroyed. */
+struct wl_closure *
+wl_connection_demarshal_in_place(struct wl_connection *connection,
+				 uint32_t size,
+				 struct wl_map *objects,
+				 const struct wl_message *message)
+{
+	return demarshal(connection, size, objects, message, true);
+}
+
 bool
 wl_object_is_zombie(struct wl_map *map, uint32_t id)
 {
@@ -1103,17 +1981,18 @@ wl_closure_lookup_objects(struct wl_closure *closure, struct wl_map *objects)
 {
 	struct wl_object *object;
 	const struct wl_message *message;
-	const char *signature;
-	struct argument_details arg;
+	const struct wl_message_desc *desc;
 	int i, count;
 	uint32_t id;
 
 	message = closure->message;
-	signature = message->signature;
-	count = arg_count_for_signature(signature);
+	desc = closure->desc;
+	if (desc->num_objects == 0)
+		return 0;
+
+	count = closure->count;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		if (arg.type != WL_ARG_OBJECT)
+		if (desc->types[i] != WL_ARG_OBJECT)
 			continue;
 
 		id = closure->args[i].n;
@@ -1147,93 +2026,326 @@ wl_closure_lookup_objects(struct wl_closure *closure, struct wl_map *objects)
 	return 0;
 }
 
+static ffi_type *
+ffi_type_for_arg(char type, uint32_t flags)
+{
+	switch (type) {
+	case WL_ARG_INT:
+	case WL_ARG_FIXED:
+	case WL_ARG_FD:
+		return &ffi_type_sint32;
+	case WL_ARG_UINT:
+		return &ffi_type_uint32;
+	case WL_ARG_STRING:
+	case WL_ARG_OBJECT:
+	case WL_ARG_ARRAY:
+		return &ffi_type_pointer;
+	case WL_ARG_NEW_ID:
+		if (flags & WL_CLOSURE_INVOKE_CLIENT)
+			return &ffi_type_pointer;
+		else
+			return &ffi_type_uint32;
+	default:
+		wl_abort("unknown type\n");
+		return NULL;
+	}
+}
+
 static void
-convert_arguments_to_ffi(const char *signature, uint32_t flags,
+convert_arguments_to_ffi(const struct wl_message_desc *desc, uint32_t flags,
 			 union wl_argument *args,
 			 int count, ffi_type **ffi_types, void** ffi_args)
 {
 	int i;
-	const char *sig_iter;
-	struct argument_details arg;
 
-	sig_iter = signature;
+	/* All members of union wl_argument start at the same address, so
+	 * the argument itself can be handed to libffi for any type. */
 	for (i = 0; i < count; i++) {
-		sig_iter = get_next_argument(sig_iter, &arg);
+		ffi_types[i] = ffi_type_for_arg(desc->types[i], flags);
+		ffi_args[i] = &args[i];
+	}
+}
 
-		switch(arg.type) {
-		case WL_ARG_INT:
-			ffi_types[i] = &ffi_type_sint32;
-			ffi_args[i] = &args[i].i;
-			break;
+/* Implementations taking up to TRAMPOLINE_MAX_ARGS arguments are called
+ * directly through one of these instead of going through libffi. Each
+ * argument is passed with the type the implementation declares for it: an
+ * unsigned (U) or signed (S) 32 bit integer, the latter for int, fixed and
+ * fd arguments, or a pointer (P). Implementations only taking uint
+ * arguments are covered up to TRAMPOLINE_MAX_INT_ARGS arguments. */
+#define TRAMPOLINE_MAX_ARGS 4
+#define TRAMPOLINE_MAX_INT_ARGS 6
+
+typedef void (*wl_closure_trampoline_t)(void (*implementation)(void),
+					void *data, void *target,
+					union wl_argument *args);
+
+#define TRAMPOLINE_TYPE_U uint32_t
+#define TRAMPOLINE_TYPE_S int32_t
+#define TRAMPOLINE_TYPE_P void *
+#define TRAMPOLINE_ARG_U(n) args[n].u
+#define TRAMPOLINE_ARG_S(n) args[n].i
+#define TRAMPOLINE_ARG_P(n) ((void *) args[n].o)
+
+#define TRAMPOLINE(name, types, call_args)				\
+static void								\
+trampoline_##name(void (*implementation)(void), void *data,		\
+		  void *target, union wl_argument *args)		\
+{									\
+	((void (*) types) implementation) call_args;			\
+}
+
+#define TRAMPOLINE1(a)							\
+	TRAMPOLINE(a, (void *, void *, TRAMPOLINE_TYPE_##a),		\
+		   (data, target, TRAMPOLINE_ARG_##a(0)))
+#define TRAMPOLINE2(a, b)						\
+	TRAMPOLINE(a##b, (void *, void *, TRAMPOLINE_TYPE_##a,		\
+			  TRAMPOLINE_TYPE_##b),				\
+		   (data, target, TRAMPOLINE_ARG_##a(0),		\
+		    TRAMPOLINE_ARG_##b(1)))
+#define TRAMPOLINE3(a, b, c)						\
+	TRAMPOLINE(a##b##c, (void *, void *, TRAMPOLINE_TYPE_##a,	\
+			     TRAMPOLINE_TYPE_##b, TRAMPOLINE_TYPE_##c),	\
+		   (data, target, TRAMPOLINE_ARG_##a(0),		\
+		    TRAMPOLINE_ARG_##b(1), TRAMPOLINE_ARG_##c(2)))
+#define TRAMPOLINE4(a, b, c, d)						\
+	TRAMPOLINE(a##b##c##d, (void *, void *, TRAMPOLINE_TYPE_##a,	\
+				TRAMPOLINE_TYPE_##b,			\
+				TRAMPOLINE_TYPE_##c,			\
+				TRAMPOLINE_TYPE_##d),			\
+		   (data, target, TRAMPOLINE_ARG_##a(0),		\
+		    TRAMPOLINE_ARG_##b(1), TRAMPOLINE_ARG_##c(2),	\
+		    TRAMPOLINE_ARG_##d(3)))
+
+/* Expand a macro for every combination of argument types, the last
+ * argument varying fastest. */
+#define TRAMPOLINE_EACH1(m) m(U) m(S) m(P)
+#define TRAMPOLINE_EACH2_(m, a) m(a, U) m(a, S) m(a, P)
+#define TRAMPOLINE_EACH2(m)						\
+	TRAMPOLINE_EACH2_(m, U) TRAMPOLINE_EACH2_(m, S)			\
+	TRAMPOLINE_EACH2_(m, P)
+#define TRAMPOLINE_EACH3_(m, a, b) m(a, b, U) m(a, b, S) m(a, b, P)
+#define TRAMPOLINE_EACH3__(m, a)					\
+	TRAMPOLINE_EACH3_(m, a, U) TRAMPOLINE_EACH3_(m, a, S)		\
+	TRAMPOLINE_EACH3_(m, a, P)
+#define TRAMPOLINE_EACH3(m)						\
+	TRAMPOLINE_EACH3__(m, U) TRAMPOLINE_EACH3__(m, S)		\
+	TRAMPOLINE_EACH3__(m, P)
+#define TRAMPOLINE_EACH4_(m, a, b, c)					\
+	m(a, b, c, U) m(a, b, c, S) m(a, b, c, P)
+#define TRAMPOLINE_EACH4__(m, a, b)					\
+	TRAMPOLINE_EACH4_(m, a, b, U) TRAMPOLINE_EACH4_(m, a, b, S)	\
+	TRAMPOLINE_EACH4_(m, a, b, P)
+#define TRAMPOLINE_EACH4___(m, a)					\
+	TRAMPOLINE_EACH4__(m, a, U) TRAMPOLINE_EACH4__(m, a, S)		\
+	TRAMPOLINE_EACH4__(m, a, P)
+#define TRAMPOLINE_EACH4(m)						\
+	TRAMPOLINE_EACH4___(m, U) TRAMPOLINE_EACH4___(m, S)		\
+	TRAMPOLINE_EACH4___(m, P)
+
+#define TRAMPOLINE_NAME1(a) trampoline_##a,
+#define TRAMPOLINE_NAME2(a, b) trampoline_##a##b,
+#define TRAMPOLINE_NAME3(a, b, c) trampoline_##a##b##c,
+#define TRAMPOLINE_NAME4(a, b, c, d) trampoline_##a##b##c##d,
+
+TRAMPOLINE(none, (void *, void *), (data, target))
+TRAMPOLINE_EACH1(TRAMPOLINE1)
+TRAMPOLINE_EACH2(TRAMPOLINE2)
+TRAMPOLINE_EACH3(TRAMPOLINE3)
+TRAMPOLINE_EACH4(TRAMPOLINE4)
+TRAMPOLINE(UUUUU,
+	   (void *, void *, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t),
+	   (data, target, args[0].u, args[1].u, args[2].u, args[3].u,
+	    args[4].u))
+TRAMPOLINE(UUUUUU,
+	   (void *, void *, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t,
+	    uint32_t),
+	   (data, target, args[0].u, args[1].u, args[2].u, args[3].u,
+	    args[4].u, args[5].u))
+
+/* Indexed by argument count, then by the types of the arguments read as a
+ * base 3 number with the first argument as the most significant digit,
+ * and U, S and P as digits 0, 1 and 2. */
+static const wl_closure_trampoline_t *const trampolines[] = {
+	(const wl_closure_trampoline_t[]) { trampoline_none },
+	(const wl_closure_trampoline_t[]) {
+		TRAMPOLINE_EACH1(TRAMPOLINE_NAME1)
+	},
+	(const wl_closure_trampoline_t[]) {
+		TRAMPOLINE_EACH2(TRAMPOLINE_NAME2)
+	},
+	(const wl_closure_trampoline_t[]) {
+		TRAMPOLINE_EACH3(TRAMPOLINE_NAME3)
+	},
+	(const wl_closure_trampoline_t[]) {
+		TRAMPOLINE_EACH4(TRAMPOLINE_NAME4)
+	},
+	(const wl_closure_trampoline_t[]) { trampoline_UUUUU },
+	(const wl_closure_trampoline_t[]) { trampoline_UUUUUU },
+};
+
+static wl_closure_trampoline_t
+trampoline_for_message(const struct wl_message_desc *desc, uint32_t flags)
+{
+	unsigned int shape = 0;
+	int i, count = desc->count;
+
+	if (count > TRAMPOLINE_MAX_INT_ARGS)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		shape *= 3;
+		switch (desc->types[i]) {
 		case WL_ARG_UINT:
-			ffi_types[i] = &ffi_type_uint32;
-			ffi_args[i] = &args[i].u;
 			break;
+		case WL_ARG_INT:
 		case WL_ARG_FIXED:
-			ffi_types[i] = &ffi_type_sint32;
-			ffi_args[i] = &args[i].f;
-			break;
-		case WL_ARG_STRING:
-			ffi_types[i] = &ffi_type_pointer;
-			ffi_args[i] = &args[i].s;
-			break;
-		case WL_ARG_OBJECT:
-			ffi_types[i] = &ffi_type_pointer;
-			ffi_args[i] = &args[i].o;
+		case WL_ARG_FD:
+			shape += 1;
 			break;
 		case WL_ARG_NEW_ID:
-			if (flags & WL_CLOSURE_INVOKE_CLIENT) {
-				ffi_types[i] = &ffi_type_pointer;
-				ffi_args[i] = &args[i].o;
-			} else {
-				ffi_types[i] = &ffi_type_uint32;
-				ffi_args[i] = &args[i].n;
-			}
-			break;
-		case WL_ARG_ARRAY:
-			ffi_types[i] = &ffi_type_pointer;
-			ffi_args[i] = &args[i].a;
-			break;
-		case WL_ARG_FD:
-			ffi_types[i] = &ffi_type_sint32;
-			ffi_args[i] = &args[i].h;
+			if (flags & WL_CLOSURE_INVOKE_CLIENT)
+				shape += 2;
 			break;
 		default:
-			wl_abort("unknown type\n");
+			shape += 2;
 			break;
 		}
 	}
+
+	if (count > TRAMPOLINE_MAX_ARGS && shape != 0)
+		return NULL;
+
+	return trampolines[count][shape];
+}
+
+/* Calls into the implementation of a message for client and server side
+ * closures, which only differ in the type of new_id arguments. */
+struct wl_message_invoke {
+	struct {
+		ffi_cif cif;
+		wl_closure_trampoline_t trampoline;
+	} side[2];
+	ffi_type *ffi_types[];
+};
+
+static inline int
+invoke_side(uint32_t flags)
+{
+	return (flags & WL_CLOSURE_INVOKE_CLIENT) ? 0 : 1;
+}
+
+static struct wl_message_invoke *
+message_invoke_create(const struct wl_message_desc *desc)
+{
+	static const uint32_t side_flags[] = {
+		WL_CLOSURE_INVOKE_CLIENT, WL_CLOSURE_INVOKE_SERVER
+	};
+	struct wl_message_invoke *invoke;
+	ffi_type **ffi_types;
+	int i, j, count = desc->count;
+
+	invoke = zalloc(sizeof *invoke +
+			2 * (count + 2) * sizeof invoke->ffi_types[0]);
+	if (invoke == NULL)
+		return NULL;
+
+	for (i = 0; i < 2; i++) {
+		ffi_types = invoke->ffi_types + i * (count + 2);
+		ffi_types[0] = &ffi_type_pointer;
+		ffi_types[1] = &ffi_type_pointer;
+		for (j = 0; j < count; j++)
+			ffi_types[j + 2] = ffi_type_for_arg(desc->types[j],
+							    side_flags[i]);
+
+		if (ffi_prep_cif(&invoke->side[i].cif, FFI_DEFAULT_ABI,
+				 count + 2, &ffi_type_void,
+				 ffi_types) != FFI_OK) {
+			free(invoke);
+			return NULL;
+		}
+
+		invoke->side[i].trampoline =
+			trampoline_for_message(desc, side_flags[i]);
+	}
+
+	return invoke;
+}
+
+static const struct wl_message_invoke *
+message_desc_get_invoke(const struct wl_message_desc *desc)
+{
+	/* The invoke data is the only part of a descriptor set up after
+	 * it has been published, it is set at most once. */
+	struct wl_message_invoke **invoke_ptr =
+		&((struct wl_message_desc *) desc)->invoke;
+	struct wl_message_invoke *invoke;
+
+	invoke = __atomic_load_n(invoke_ptr, __ATOMIC_ACQUIRE);
+	if (invoke)
+		return invoke;
+
+	pthread_mutex_lock(&desc_cache.mutex);
+	invoke = *invoke_ptr;
+	if (invoke == NULL) {
+		invoke = message_invoke_create(desc);
+		if (invoke)
+			__atomic_store_n(invoke_ptr, invoke, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&desc_cache.mutex);
+
+	return invoke;
 }
 
 void
 wl_closure_invoke(struct wl_closure *closure, uint32_t flags,
 		  struct wl_object *target, uint32_t opcode, void *data)
 {
-	int count;
+	const struct wl_message_invoke *invoke;
+	int i, count, side;
 	ffi_cif cif;
 	ffi_type *ffi_types[WL_CLOSURE_MAX_ARGS + 2];
 	void * ffi_args[WL_CLOSURE_MAX_ARGS + 2];
 	void (* const *implementation)(void);
 
-	count = arg_count_for_signature(closure->message->signature);
+	count = closure->count;
+
+	implementation = target->implementation;
+	if (!implementation[opcode]) {
+		wl_abort("listener function for opcode %u of %s is NULL\n",
+			 opcode, target->interface->name);
+	}
 
-	ffi_types[0] = &ffi_type_pointer;
 	ffi_args[0] = &data;
-	ffi_types[1] = &ffi_type_pointer;
 	ffi_args[1] = &target;
 
-	convert_arguments_to_ffi(closure->message->signature, flags, closure->args,
-				 count, ffi_types + 2, ffi_args + 2);
+	invoke = message_desc_get_invoke(closure->desc);
+	if (invoke) {
+		side = invoke_side(flags);
+		if (invoke->side[side].trampoline) {
+			invoke->side[side].trampoline(implementation[opcode],
+						      data, target,
+						      closure->args);
+		} else {
+			for (i = 0; i < count; i++)
+				ffi_args[i + 2] = &closure->args[i];
+
+			ffi_call((ffi_cif *) &invoke->side[side].cif,
+				 implementation[opcode], NULL, ffi_args);
+		}
+	} else {
+		/* Could not set up the invoke data, prepare the call from
+		 * scratch. */
+		ffi_types[0] = &ffi_type_pointer;
+		ffi_types[1] = &ffi_type_pointer;
 
-	ffi_prep_cif(&cif, FFI_DEFAULT_ABI,
-		     count + 2, &ffi_type_void, ffi_types);
+		convert_arguments_to_ffi(closure->desc, flags, closure->args,
+					 count, ffi_types + 2, ffi_args + 2);
 
-	implementation = target->implementation;
-	if (!implementation[opcode]) {
-		wl_abort("listener function for opcode %u of %s is NULL\n",
-			 opcode, target->interface->name);
+		ffi_prep_cif(&cif, FFI_DEFAULT_ABI,
+			     count + 2, &ffi_type_void, ffi_types);
+
+		ffi_call(&cif, implementation[opcode], NULL, ffi_args);
 	}
-	ffi_call(&cif, implementation[opcode], NULL, ffi_args);
 
 	wl_closure_clear_fds(closure);
 }
@@ -1248,29 +2360,43 @@ wl_closure_dispatch(struct wl_closure *closure, wl_dispatcher_func_t dispatcher,
 	wl_closure_clear_fds(closure);
 }
 
+/* Hands the fds of the closure over to the connection, or copies of
+ * them if the closure is sent to other connections too. */
 static int
 copy_fds_to_connection(struct wl_closure *closure,
-		       struct wl_connection *connection)
+		       struct wl_connection *connection, bool dup)
 {
-	const struct wl_message *message = closure->message;
-	uint32_t i, count;
-	struct argument_details arg;
-	const char *signature = message->signature;
+	const struct wl_message_desc *desc = closure->desc;
+	int i, count;
 	int fd;
 
-	count = arg_count_for_signature(signature);
+	if (desc->num_fds == 0)
+		return 0;
+
+	count = closure->count;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		if (arg.type != WL_ARG_FD)
+		if (desc->types[i] != WL_ARG_FD)
 			continue;
 
 		fd = closure->args[i].h;
+		if (dup) {
+			fd = wl_os_dupfd_cloexec(fd, 0);
+			if (fd < 0) {
+				wl_log("request could not be marshaled: "
+				       "dup failed: %s\n", strerror(errno));
+				return -1;
+			}
+		}
+
 		if (wl_connection_put_fd(connection, fd)) {
 			wl_log("request could not be marshaled: "
 			       "can't send file descriptor\n");
+			if (dup)
+				close(fd);
 			return -1;
 		}
-		closure->args[i].h = -1;
+		if (!dup)
+			closure->args[i].h = -1;
 	}
 
 	return 0;
@@ -1280,18 +2406,16 @@ copy_fds_to_connection(struct wl_closure *closure,
 static uint32_t
 buffer_size_for_closure(struct wl_closure *closure)
 {
-	const struct wl_message *message = closure->message;
+	const struct wl_message_desc *desc = closure->desc;
 	int i, count;
-	struct argument_details arg;
-	const char *signature;
 	uint32_t size, buffer_size = 0;
 
-	signature = message->signature;
-	count = arg_count_for_signature(signature);
-	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
+	if (desc->fixed_size)
+		return desc->fixed_size / sizeof(uint32_t);
 
-		switch (arg.type) {
+	count = closure->count;
+	for (i = 0; i < count; i++) {
+		switch (desc->types[i]) {
 		case WL_ARG_FD:
 			break;
 		case WL_ARG_UINT:
@@ -1332,10 +2456,9 @@ serialize_closure(struct wl_closure *closure, uint32_t *buffer,
 		  size_t buffer_count)
 {
 	const struct wl_message *message = closure->message;
+	const struct wl_message_desc *desc = closure->desc;
 	unsigned int i, count, size;
 	uint32_t *p, *end;
-	struct argument_details arg;
-	const char *signature;
 
 	if (buffer_count < 2)
 		goto overflow;
@@ -1343,18 +2466,15 @@ serialize_closure(struct wl_closure *closure, uint32_t *buffer,
 	p = buffer + 2;
 	end = buffer + buffer_count;
 
-	signature = message->signature;
-	count = arg_count_for_signature(signature);
+	count = closure->count;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-
-		if (arg.type == WL_ARG_FD)
+		if (desc->types[i] == WL_ARG_FD)
 			continue;
 
 		if (p + 1 > end)
 			goto overflow;
 
-		switch (arg.type) {
+		switch (desc->types[i]) {
 		case WL_ARG_UINT:
 			*p++ = closure->args[i].u;
 			break;
@@ -1382,6 +2502,8 @@ serialize_closure(struct wl_closure *closure, uint32_t *buffer,
 			if (p + div_roundup(size, sizeof *p) > end)
 				goto overflow;
 
+			/* Clear the padding, the buffer may hold stale data */
+			p[div_roundup(size, sizeof *p) - 1] = 0;
 			memcpy(p, closure->args[i].s, size);
 			p += div_roundup(size, sizeof *p);
 			break;
@@ -1397,8 +2519,10 @@ serialize_closure(struct wl_closure *closure, uint32_t *buffer,
 			if (p + div_roundup(size, sizeof *p) > end)
 				goto overflow;
 
-			if (size != 0)
+			if (size != 0) {
+				p[div_roundup(size, sizeof *p) - 1] = 0;
 				memcpy(p, closure->args[i].a->data, size);
+			}
 			p += div_roundup(size, sizeof *p);
 			break;
 		case WL_ARG_FD:
@@ -1420,70 +2544,192 @@ overflow:
 	return -1;
 }
 
-int
-wl_closure_send(struct wl_closure *closure, struct wl_connection *connection)
+/* Messages that wrap around the end of the out buffer and are at most this
+ * large are serialized on the stack before being copied into the buffer. */
+#define WRAP_BUFFER_SIZE 256
+
+static int
+queue_closure(struct wl_closure *closure, struct wl_connection *connection)
 {
-	int size;
+	uint32_t wrap_buffer[WRAP_BUFFER_SIZE / sizeof(uint32_t)];
 	uint32_t buffer_size;
 	uint32_t *buffer;
-	int result;
+	size_t count;
+	int size;
 
-	if (copy_fds_to_connection(closure, connection))
+	if (copy_fds_to_connection(closure, connection, false))
 		return -1;
 
 	buffer_size = buffer_size_for_closure(closure);
-	buffer = zalloc(buffer_size * sizeof buffer[0]);
-	if (buffer == NULL) {
-		wl_log("wl_closure_send error: buffer allocation failure of "
-		       "size %d\n for %s (signature %s)",
-		       buffer_size * sizeof buffer[0], closure->message->name,
-		       closure->message->signature);
+	count = buffer_size * sizeof buffer[0];
+
+	if (wl_connection_prepare_queue(connection, count) < 0)
 		return -1;
+
+	/* Serialize straight into the out buffer whenever the message fits
+	 * in the contiguous space at its head. */
+	buffer = ring_buffer_reserve(&connection->out, count);
+	if (buffer != NULL) {
+		size = serialize_closure(closure, buffer, buffer_size);
+		if (size < 0)
+			return -1;
+
+		connection->out.head += size;
+		return 0;
+	}
+
+	if (count <= sizeof wrap_buffer) {
+		buffer = wrap_buffer;
+	} else {
+		buffer = malloc(count);
+		if (buffer == NULL) {
+			wl_log("queue_closure error: buffer allocation failure "
+			       "of size %zu for %s (signature %s)\n",
+			       count, closure->message->name,
+			       closure->message->signature);
+			return -1;
+		}
 	}
 
 	size = serialize_closure(closure, buffer, buffer_size);
-	if (size < 0) {
+	if (size >= 0)
+		ring_buffer_put(&connection->out, buffer, size);
+
+	if (buffer != wrap_buffer)
 		free(buffer);
+
+	return size < 0 ? -1 : 0;
+}
+
+int
+wl_closure_send(struct wl_closure *closure, struct wl_connection *connection)
+{
+	if (queue_closure(closure, connection) < 0)
 		return -1;
-	}
 
-	result = wl_connection_write(connection, buffer, size);
-	free(buffer);
+	connection->want_flush = 1;
 
-	return result;
+	return 0;
 }
 
 int
 wl_closure_queue(struct wl_closure *closure, struct wl_connection *connection)
 {
-	int size;
-	uint32_t buffer_size;
+	return queue_closure(closure, connection);
+}
+
+/* Queues the closure like wl_closure_queue(), unless the message of *size
+ * bytes at position *pos of the output stream was not sent yet and is as
+ * large as the closure, in which case the closure overwrites it. The
+ * closure must not carry fds.
+ *
+ * Returns 1 if the message was overwritten, 0 if the closure was queued,
+ * with *pos and *size then locating it, or -1 on failure. */
+int
+wl_closure_queue_coalesced(struct wl_closure *closure,
+			   struct wl_connection *connection,
+			   uint64_t *pos, size_t *size)
+{
+	uint32_t wrap_buffer[WRAP_BUFFER_SIZE / sizeof(uint32_t)];
+	struct wl_ring_buffer *out = &connection->out;
+	size_t count = wl_closure_get_size(closure);
 	uint32_t *buffer;
-	int result;
+	int ret;
 
-	if (copy_fds_to_connection(closure, connection))
-		return -1;
+	if (*size != count || *pos < connection->out_sent ||
+	    *pos + count > connection->out_sent + ring_buffer_size(out)) {
+		if (queue_closure(closure, connection) < 0)
+			return -1;
 
-	buffer_size = buffer_size_for_closure(closure);
-	buffer = malloc(buffer_size * sizeof buffer[0]);
-	if (buffer == NULL) {
-		wl_log("wl_closure_queue error: buffer allocation failure of "
-		       "size %d\n for %s (signature %s)",
-		       buffer_size * sizeof buffer[0], closure->message->name,
-		       closure->message->signature);
-		return -1;
+		*pos = connection->out_sent + ring_buffer_size(out) - count;
+		*size = count;
+		return 0;
 	}
 
-	size = serialize_closure(closure, buffer, buffer_size);
-	if (size < 0) {
+	if (count <= sizeof wrap_buffer) {
+		buffer = wrap_buffer;
+	} else {
+		buffer = malloc(count);
+		if (buffer == NULL)
+			return -1;
+	}
+
+	ret = serialize_closure(closure, buffer, count / sizeof buffer[0]);
+	if (ret >= 0)
+		ring_buffer_put_at(out, *pos - connection->out_sent,
+				   buffer, count);
+
+	if (buffer != wrap_buffer)
 		free(buffer);
+
+	return ret < 0 ? -1 : 1;
+}
+
+size_t
+wl_closure_get_size(struct wl_closure *closure)
+{
+	return buffer_size_for_closure(closure) * sizeof(uint32_t);
+}
+
+int
+wl_closure_serialize(struct wl_closure *closure, uint32_t *buffer,
+		     size_t size)
+{
+	return serialize_closure(closure, buffer, size / sizeof buffer[0]);
+}
+
+/* Sends the closure serialized with wl_closure_serialize() on behalf of
+ * another object. The fds of the closure are only handed over to the
+ * connection if give_fds is set, copies are sent otherwise. */
+int
+wl_closure_send_serialized(struct wl_closure *closure,
+			   struct wl_connection *connection,
+			   const uint32_t *message, size_t size,
+			   uint32_t sender_id, bool give_fds)
+{
+	struct wl_ring_buffer *out = &connection->out;
+
+	if (copy_fds_to_connection(closure, connection, !give_fds))
+		return -1;
+
+	if (wl_connection_prepare_queue(connection, size) < 0)
+		return -1;
+
+	ring_buffer_put(out, &sender_id, sizeof sender_id);
+	ring_buffer_put(out, message + 1, size - sizeof sender_id);
+	connection->want_flush = 1;
+
+	return 0;
+}
+
+/* Sends a message made of the two words of its header and of body_size
+ * bytes of arguments, written straight into the out buffer when it has
+ * the contiguous space. */
+int
+wl_connection_send_message(struct wl_connection *connection,
+			   const uint32_t header[2],
+			   const uint32_t *body, size_t body_size)
+{
+	struct wl_ring_buffer *out = &connection->out;
+	size_t size = 2 * sizeof header[0] + body_size;
+	uint32_t *buffer;
+
+	if (wl_connection_prepare_queue(connection, size) < 0)
 		return -1;
-	}
 
-	result = wl_connection_queue(connection, buffer, size);
-	free(buffer);
+	buffer = ring_buffer_reserve(out, size);
+	if (buffer != NULL) {
+		buffer[0] = header[0];
+		buffer[1] = header[1];
+		memcpy(buffer + 2, body, body_size);
+		out->head += size;
+	} else {
+		ring_buffer_put(out, header, 2 * sizeof header[0]);
+		ring_buffer_put(out, body, body_size);
+	}
+	connection->want_flush = 1;
 
-	return result;
+	return 0;
 }
 
 void
@@ -1492,8 +2738,7 @@ wl_closure_print(struct wl_closure *closure, struct wl_object *target,
 		 const char *queue_name)
 {
 	int i;
-	struct argument_details arg;
-	const char *signature = closure->message->signature;
+	const struct wl_message_desc *desc = closure->desc;
 	struct timespec tp;
 	unsigned int time;
 	uint32_t nval;
@@ -1520,11 +2765,10 @@ wl_closure_print(struct wl_closure *closure, struct wl_object *target,
 		closure->message->name);
 
 	for (i = 0; i < closure->count; i++) {
-		signature = get_next_argument(signature, &arg);
 		if (i > 0)
 			fprintf(f, ", ");
 
-		switch (arg.type) {
+		switch (desc->types[i]) {
 		case WL_ARG_UINT:
 			fprintf(f, "%u", closure->args[i].u);
 			break;
@@ -1593,13 +2837,14 @@ wl_closure_print(struct wl_closure *closure, struct wl_object *target,
 static int
 wl_closure_close_fds(struct wl_closure *closure)
 {
+	const struct wl_message_desc *desc = closure->desc;
 	int i;
-	struct argument_details arg;
-	const char *signature = closure->message->signature;
+
+	if (desc->num_fds == 0)
+		return 0;
 
 	for (i = 0; i < closure->count; i++) {
-		signature = get_next_argument(signature, &arg);
-		if (arg.type == WL_ARG_FD && closure->args[i].h != -1)
+		if (desc->types[i] == WL_ARG_FD && closure->args[i].h != -1)
 			close(closure->args[i].h);
 	}
 
@@ -1614,5 +2859,13 @@ wl_closure_destroy(struct wl_closure *closure)
 		return;
 
 	wl_closure_close_fds(closure);
-	free(closure);
+
+	if (closure->connection &&
+	    --closure->connection->in.pinned == 0)
+		ring_buffer_trim(&closure->connection->in);
+
+	if (closure->pool)
+		closure_pool_release(closure->pool, closure);
+	else
+		free(closure);
 }
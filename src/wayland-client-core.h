@@ -302,6 +302,18 @@ void
 wl_display_set_max_buffer_size(struct wl_display *display,
                                size_t max_buffer_size);
 
+void
+wl_display_cork(struct wl_display *display);
+
+int
+wl_display_uncork(struct wl_display *display);
+
+void
+wl_display_set_flush_threshold(struct wl_display *display, size_t threshold);
+
+void
+wl_display_set_flush_deadline(struct wl_display *display, int timeout_ms);
+
 #ifdef  __cplusplus
 }
 #endif
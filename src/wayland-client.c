@@ -250,16 +250,16 @@ wl_proxy_unref(struct wl_proxy *proxy)
 static void
 validate_closure_objects(struct wl_closure *closure)
 {
-	const char *signature;
-	struct argument_details arg;
+	const struct wl_message_desc *desc = closure->desc;
 	int i, count;
 	struct wl_proxy *proxy;
 
-	signature = closure->message->signature;
-	count = arg_count_for_signature(signature);
+	if (desc->num_objects == 0)
+		return;
+
+	count = closure->count;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		switch (arg.type) {
+		switch (desc->types[i]) {
 		case WL_ARG_NEW_ID:
 		case WL_ARG_OBJECT:
 			proxy = (struct wl_proxy *) closure->args[i].o;
@@ -278,16 +278,13 @@ validate_closure_objects(struct wl_closure *closure)
 static void
 destroy_queued_closure(struct wl_closure *closure)
 {
-	const char *signature;
-	struct argument_details arg;
+	const struct wl_message_desc *desc = closure->desc;
 	struct wl_proxy *proxy;
 	int i, count;
 
-	signature = closure->message->signature;
-	count = arg_count_for_signature(signature);
+	count = desc->num_objects ? closure->count : 0;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		switch (arg.type) {
+		switch (desc->types[i]) {
 		case WL_ARG_NEW_ID:
 		case WL_ARG_OBJECT:
 			proxy = (struct wl_proxy *) closure->args[i].o;
@@ -415,19 +412,13 @@ wl_display_create_queue_with_name(struct wl_display *display, const char *name)
 }
 
 static int
-message_count_fds(const char *signature)
+message_count_fds(const struct wl_message *message)
 {
-	unsigned int count, i, fds = 0;
-	struct argument_details arg;
+	const struct wl_message_desc *desc;
 
-	count = arg_count_for_signature(signature);
-	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		if (arg.type == WL_ARG_FD)
-			fds++;
-	}
+	desc = wl_message_get_desc(message);
 
-	return fds;
+	return desc ? desc->num_fds : 0;
 }
 
 static struct wl_zombie *
@@ -444,7 +435,7 @@ prepare_zombie(struct wl_proxy *proxy)
 	 * zombie objects created. */
 	for (i = 0; i < interface->event_count; i++) {
 		message = &interface->events[i];
-		count = message_count_fds(message->signature);
+		count = message_count_fds(message);
 
 		if (!count)
 			continue;
@@ -726,16 +717,16 @@ create_outgoing_proxy(struct wl_proxy *proxy, const struct wl_message *message,
 		      union wl_argument *args,
 		      const struct wl_interface *interface, uint32_t version)
 {
-	int i, count;
-	const char *signature;
-	struct argument_details arg;
+	const struct wl_message_desc *desc;
+	int i;
 	struct wl_proxy *new_proxy = NULL;
 
-	signature = message->signature;
-	count = arg_count_for_signature(signature);
-	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		if (arg.type != WL_ARG_NEW_ID)
+	desc = wl_message_get_desc(message);
+	if (desc == NULL)
+		return NULL;
+
+	for (i = 0; i < desc->count; i++) {
+		if (desc->types[i] != WL_ARG_NEW_ID)
 			continue;
 
 		new_proxy = proxy_create(proxy, interface, version);
@@ -816,6 +807,28 @@ wl_proxy_marshal_array_constructor_versioned(struct wl_proxy *proxy,
 	return wl_proxy_marshal_array_flags(proxy, opcode, interface, version, 0, args);
 }
 
+/* Fails a request whose arguments could not be read from the va_list. */
+static struct wl_proxy *
+proxy_marshal_failed(struct wl_proxy *proxy, uint32_t opcode, uint32_t flags)
+{
+	struct wl_display *disp = proxy->display;
+
+	pthread_mutex_lock(&disp->mutex);
+
+	wl_log("Error marshalling request for %s.%s: %s\n",
+	       proxy->object.interface->name,
+	       proxy->object.interface->methods[opcode].name,
+	       strerror(errno));
+	display_fatal_error(disp, errno);
+
+	if (flags & WL_MARSHAL_FLAG_DESTROY)
+		wl_proxy_destroy_caller_locks(proxy);
+
+	pthread_mutex_unlock(&disp->mutex);
+
+	return NULL;
+}
+
 /** Prepare a request to be sent to the compositor
  *
  * \param proxy The proxy object
@@ -852,8 +865,11 @@ wl_proxy_marshal_flags(struct wl_proxy *proxy, uint32_t opcode,
 	va_list ap;
 
 	va_start(ap, flags);
-	wl_argument_from_va_list(proxy->object.interface->methods[opcode].signature,
-				 args, WL_CLOSURE_MAX_ARGS, ap);
+	if (wl_argument_from_va_list(&proxy->object.interface->methods[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		return proxy_marshal_failed(proxy, opcode, flags);
+	}
 	va_end(ap);
 
 	return wl_proxy_marshal_array_flags(proxy, opcode, interface, version, flags, args);
@@ -976,8 +992,12 @@ wl_proxy_marshal(struct wl_proxy *proxy, uint32_t opcode, ...)
 	va_list ap;
 
 	va_start(ap, opcode);
-	wl_argument_from_va_list(proxy->object.interface->methods[opcode].signature,
-				 args, WL_CLOSURE_MAX_ARGS, ap);
+	if (wl_argument_from_va_list(&proxy->object.interface->methods[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		proxy_marshal_failed(proxy, opcode, 0);
+		return;
+	}
 	va_end(ap);
 
 	wl_proxy_marshal_array_constructor(proxy, opcode, args, NULL);
@@ -1013,8 +1033,11 @@ wl_proxy_marshal_constructor(struct wl_proxy *proxy, uint32_t opcode,
 	va_list ap;
 
 	va_start(ap, interface);
-	wl_argument_from_va_list(proxy->object.interface->methods[opcode].signature,
-				 args, WL_CLOSURE_MAX_ARGS, ap);
+	if (wl_argument_from_va_list(&proxy->object.interface->methods[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		return proxy_marshal_failed(proxy, opcode, 0);
+	}
 	va_end(ap);
 
 	return wl_proxy_marshal_array_constructor(proxy, opcode,
@@ -1052,8 +1075,11 @@ wl_proxy_marshal_constructor_versioned(struct wl_proxy *proxy, uint32_t opcode,
 	va_list ap;
 
 	va_start(ap, version);
-	wl_argument_from_va_list(proxy->object.interface->methods[opcode].signature,
-				 args, WL_CLOSURE_MAX_ARGS, ap);
+	if (wl_argument_from_va_list(&proxy->object.interface->methods[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		return proxy_marshal_failed(proxy, opcode, 0);
+	}
 	va_end(ap);
 
 	return wl_proxy_marshal_array_constructor_versioned(proxy, opcode,
@@ -1487,18 +1513,15 @@ wl_display_roundtrip(struct wl_display *display)
 static int
 create_proxies(struct wl_proxy *sender, struct wl_closure *closure)
 {
+	const struct wl_message_desc *desc = closure->desc;
 	struct wl_proxy *proxy;
-	const char *signature;
-	struct argument_details arg;
 	uint32_t id;
 	int i;
 	int count;
 
-	signature = closure->message->signature;
-	count = arg_count_for_signature(signature);
+	count = desc->num_objects ? closure->count : 0;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		if (arg.type != WL_ARG_NEW_ID)
+		if (desc->types[i] != WL_ARG_NEW_ID)
 			continue;
 
 		id = closure->args[i].n;
@@ -1519,16 +1542,13 @@ create_proxies(struct wl_proxy *sender, struct wl_closure *closure)
 static void
 increase_closure_args_refcount(struct wl_closure *closure)
 {
-	const char *signature;
-	struct argument_details arg;
+	const struct wl_message_desc *desc = closure->desc;
 	int i, count;
 	struct wl_proxy *proxy;
 
-	signature = closure->message->signature;
-	count = arg_count_for_signature(signature);
+	count = desc->num_objects ? closure->count : 0;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		switch (arg.type) {
+		switch (desc->types[i]) {
 		case WL_ARG_NEW_ID:
 		case WL_ARG_OBJECT:
 			proxy = (struct wl_proxy *) closure->args[i].o;
@@ -2273,6 +2293,102 @@ wl_display_set_max_buffer_size(struct wl_display *display,
 	wl_connection_set_max_buffer_size(display->connection, max_buffer_size);
 }
 
+/** Hold back requests to the compositor
+ *
+ * \param display The display context object
+ *
+ * While the display is corked, queued requests are not flushed
+ * automatically when they exceed the flush threshold, so that related
+ * requests can be sent out together. Requests are still flushed when
+ * the connection buffer is full, when the flush deadline expires, or
+ * when wl_display_flush() is called.
+ *
+ * Corks nest, the requests are flushed when the last one is removed with
+ * wl_display_uncork().
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_display_cork(struct wl_display *display)
+{
+	pthread_mutex_lock(&display->mutex);
+	wl_connection_cork(display->connection);
+	pthread_mutex_unlock(&display->mutex);
+}
+
+/** Release a cork on the display
+ *
+ * \param display The display context object
+ * \return The number of bytes sent on success or -1 on failure
+ *
+ * Removes a cork added with wl_display_cork(). Once the last one is
+ * removed, the requests held back are flushed as with wl_display_flush().
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT int
+wl_display_uncork(struct wl_display *display)
+{
+	uint32_t corked;
+
+	pthread_mutex_lock(&display->mutex);
+	corked = wl_connection_uncork(display->connection);
+	pthread_mutex_unlock(&display->mutex);
+
+	if (corked > 0)
+		return 0;
+
+	return wl_display_flush(display);
+}
+
+/** Set the amount of queued requests that triggers a flush
+ *
+ * \param display The display context object
+ * \param threshold The threshold in bytes, or 0 for the default
+ *
+ * Requests are flushed right away once they exceed \a threshold bytes,
+ * unless the display is corked. The default threshold is 4096 bytes.
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_display_set_flush_threshold(struct wl_display *display, size_t threshold)
+{
+	pthread_mutex_lock(&display->mutex);
+	wl_connection_set_flush_threshold(display->connection, threshold);
+	pthread_mutex_unlock(&display->mutex);
+}
+
+/** Bound the time requests stay queued
+ *
+ * \param display The display context object
+ * \param timeout_ms The deadline in milliseconds, or 0 for none
+ *
+ * Once queued requests are older than \a timeout_ms, the next request
+ * flushes them, even if the display is corked. There is no deadline by
+ * default.
+ *
+ * The display doesn't have a timer of its own, requests still have to
+ * be flushed with wl_display_flush() before waiting for events.
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_display_set_flush_deadline(struct wl_display *display, int timeout_ms)
+{
+	if (timeout_ms < 0)
+		timeout_ms = 0;
+
+	pthread_mutex_lock(&display->mutex);
+	wl_connection_set_flush_deadline(display->connection,
+					 (uint64_t) timeout_ms * 1000000);
+	pthread_mutex_unlock(&display->mutex);
+}
+
 /** Set the user data associated with a proxy
  *
  * \param proxy The proxy object
@@ -46,6 +46,7 @@
 int (*wl_fcntl)(int fildes, int cmd, ...) = fcntl;
 int (*wl_socket)(int domain, int type, int protocol) = socket;
 ssize_t (*wl_recvmsg)(int socket, struct msghdr *message, int flags) = recvmsg;
+ssize_t (*wl_sendmsg)(int socket, const struct msghdr *message, int flags) = sendmsg;
 int (*wl_epoll_create1)(int flags) = epoll_create1;
 
 static int
@@ -198,6 +199,12 @@ wl_os_recvmsg_cloexec(int sockfd, struct msghdr *msg, int flags)
 	return recvmsg_cloexec_fallback(sockfd, msg, flags);
 }
 
+ssize_t
+wl_os_sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+	return wl_sendmsg(sockfd, msg, flags);
+}
+
 int
 wl_os_epoll_create_cloexec(void)
 {
@@ -215,6 +222,17 @@ wl_os_epoll_create_cloexec(void)
 	return set_cloexec_or_close(fd);
 }
 
+int
+wl_os_memfd_create_cloexec(const char *name)
+{
+#ifdef HAVE_MEMFD_CREATE
+	return memfd_create(name, MFD_CLOEXEC);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 int
 wl_os_accept_cloexec(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
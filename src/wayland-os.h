@@ -41,9 +41,15 @@ wl_os_dupfd_cloexec(int fd, int minfd);
 ssize_t
 wl_os_recvmsg_cloexec(int sockfd, struct msghdr *msg, int flags);
 
+ssize_t
+wl_os_sendmsg(int sockfd, const struct msghdr *msg, int flags);
+
 int
 wl_os_epoll_create_cloexec(void);
 
+int
+wl_os_memfd_create_cloexec(const char *name);
+
 int
 wl_os_accept_cloexec(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
 #define WL_HIDE_DEPRECATED 1
 
@@ -49,6 +50,7 @@
 #define WL_CLOSURE_MAX_ARGS 20
 #define WL_BUFFER_DEFAULT_SIZE_POT 12
 #define WL_BUFFER_DEFAULT_MAX_SIZE (1 << WL_BUFFER_DEFAULT_SIZE_POT)
+#define WL_BUFFER_SHRINK_DRAINS 4
 
 /**
  * Argument types used in signatures.
@@ -121,6 +123,34 @@ wl_map_lookup_flags(struct wl_map *map, uint32_t i);
 void
 wl_map_for_each(struct wl_map *map, wl_iterator_func_t func, void *data);
 
+/* Allocator of fixed size objects, carved out of chunks which are only
+ * freed all at once by wl_slab_release(). */
+struct wl_slab_chunk;
+
+struct wl_slab {
+	size_t object_size;
+	struct wl_slab_chunk *chunks;
+	uint32_t chunk_objects;
+	void *free_list;
+	/* Unused space of the newest chunk */
+	char *next;
+	char *end;
+	/* Bytes allocated for the chunks */
+	size_t size;
+};
+
+void
+wl_slab_init(struct wl_slab *slab, size_t object_size);
+
+void *
+wl_slab_alloc(struct wl_slab *slab);
+
+void
+wl_slab_free(struct wl_slab *slab, void *object);
+
+void
+wl_slab_release(struct wl_slab *slab);
+
 struct wl_connection *
 wl_connection_create(int fd, size_t max_buffer_size);
 
@@ -139,6 +169,9 @@ wl_connection_flush(struct wl_connection *connection);
 uint32_t
 wl_connection_pending_input(struct wl_connection *connection);
 
+uint32_t
+wl_connection_pending_output(struct wl_connection *connection);
+
 int
 wl_connection_read(struct wl_connection *connection);
 
@@ -153,15 +186,74 @@ wl_connection_queue(struct wl_connection *connection,
 int
 wl_connection_get_fd(struct wl_connection *connection);
 
+void
+wl_connection_cork(struct wl_connection *connection);
+
+uint32_t
+wl_connection_uncork(struct wl_connection *connection);
+
+bool
+wl_connection_is_corked(struct wl_connection *connection);
+
+void
+wl_connection_set_flush_threshold(struct wl_connection *connection,
+				  size_t threshold);
+
+void
+wl_connection_set_flush_deadline(struct wl_connection *connection,
+				 uint64_t deadline_nsec);
+
+struct wl_closure_pool;
+struct wl_message_invoke;
+
+/* Parsed form of a wl_message signature, built once per signature and
+ * shared by every closure of the messages with that signature. */
+struct wl_message_desc {
+	/* Copy of the signature the descriptor was parsed from */
+	const char *signature;
+	uint32_t hash;
+	int count;
+	int since;
+	int num_fds;
+	int num_arrays;
+	/* Number of object and new_id arguments */
+	int num_objects;
+	/* Bit i is set if argument i is nullable */
+	uint32_t nullable;
+	/* Size of the message on the wire including its header, or 0 if
+	 * the message has string or array arguments. */
+	uint32_t fixed_size;
+	/* Prepared calls into implementations, set up on the first
+	 * wl_closure_invoke() of the message. */
+	struct wl_message_invoke *invoke;
+	/* enum wl_arg_type of each argument, followed by the signature */
+	char types[];
+};
+
 struct wl_closure {
 	int count;
 	const struct wl_message *message;
+	const struct wl_message_desc *desc;
 	uint32_t opcode;
 	uint32_t sender_id;
-	union wl_argument args[WL_CLOSURE_MAX_ARGS];
+	union wl_argument *args;
 	struct wl_list link;
 	struct wl_proxy *proxy;
-	struct wl_array extra[0];
+	/* Set if the closure references the input buffer of the connection */
+	struct wl_connection *connection;
+	struct wl_closure_pool *pool;
+	int size_class;
+	/* args, arrays and the message payload follow the closure */
+	union wl_argument extra[0];
+};
+
+struct wl_closure_pool_stats {
+	/* Closures handed out by the pool */
+	uint64_t allocated;
+	/* Closures handed out from a free list instead of the allocator */
+	uint64_t recycled;
+	/* Closures currently held in the free lists */
+	uint32_t cached;
 };
 
 struct argument_details {
@@ -181,9 +273,18 @@ wl_message_count_arrays(const struct wl_message *message);
 int
 wl_message_get_since(const struct wl_message *message);
 
-void
-wl_argument_from_va_list(const char *signature, union wl_argument *args,
-			 int count, va_list ap);
+const struct wl_message_desc *
+wl_message_get_desc(const struct wl_message *message);
+
+static inline bool
+wl_message_desc_arg_nullable(const struct wl_message_desc *desc, int i)
+{
+	return desc->nullable & (1u << i);
+}
+
+int
+wl_argument_from_va_list(const struct wl_message *message,
+			 union wl_argument *args, int count, va_list ap);
 
 struct wl_closure *
 wl_closure_marshal(struct wl_object *sender,
@@ -201,6 +302,12 @@ wl_connection_demarshal(struct wl_connection *connection,
 			struct wl_map *objects,
 			const struct wl_message *message);
 
+struct wl_closure *
+wl_connection_demarshal_in_place(struct wl_connection *connection,
+				 uint32_t size,
+				 struct wl_map *objects,
+				 const struct wl_message *message);
+
 bool
 wl_object_is_zombie(struct wl_map *map, uint32_t id);
 
@@ -226,6 +333,29 @@ wl_closure_send(struct wl_closure *closure, struct wl_connection *connection);
 int
 wl_closure_queue(struct wl_closure *closure, struct wl_connection *connection);
 
+size_t
+wl_closure_get_size(struct wl_closure *closure);
+
+int
+wl_closure_serialize(struct wl_closure *closure, uint32_t *buffer,
+		     size_t size);
+
+int
+wl_closure_queue_coalesced(struct wl_closure *closure,
+			   struct wl_connection *connection,
+			   uint64_t *pos, size_t *size);
+
+int
+wl_closure_send_serialized(struct wl_closure *closure,
+			   struct wl_connection *connection,
+			   const uint32_t *message, size_t size,
+			   uint32_t sender_id, bool give_fds);
+
+int
+wl_connection_send_message(struct wl_connection *connection,
+			   const uint32_t header[2],
+			   const uint32_t *body, size_t body_size);
+
 void
 wl_closure_print(struct wl_closure *closure,
 		 struct wl_object *target, int send, int discarded,
@@ -251,6 +381,16 @@ zalloc(size_t s)
 	return calloc(1, s);
 }
 
+static inline uint64_t
+wl_monotonic_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void
 wl_connection_close_fds_in(struct wl_connection *connection, int max);
 
@@ -258,4 +398,14 @@ void
 wl_connection_set_max_buffer_size(struct wl_connection *connection,
 				  size_t max_buffer_size);
 
+uint64_t
+wl_connection_get_sent_bytes(struct wl_connection *connection);
+
+size_t
+wl_connection_get_buffer_bytes(struct wl_connection *connection);
+
+void
+wl_connection_get_closure_pool_stats(struct wl_connection *connection,
+				     struct wl_closure_pool_stats *stats);
+
 #endif
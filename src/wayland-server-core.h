@@ -196,6 +196,10 @@ wl_display_destroy(struct wl_display *display);
 struct wl_event_loop *
 wl_display_get_event_loop(struct wl_display *display);
 
+int
+wl_display_add_client_loop(struct wl_display *display,
+			   struct wl_event_loop *loop);
+
 int
 wl_display_add_socket(struct wl_display *display, const char *name);
 
@@ -214,6 +218,40 @@ wl_display_run(struct wl_display *display);
 void
 wl_display_flush_clients(struct wl_display *display);
 
+struct wl_display_flush_stats {
+	uint64_t flushes;
+	uint64_t clients_flushed;
+};
+
+void
+wl_display_get_flush_stats(struct wl_display *display,
+			   struct wl_display_flush_stats *stats);
+
+int
+wl_display_set_flush_threads(struct wl_display *display, uint32_t threads);
+
+#define WL_REQUEST_PROFILE_BUCKETS 32
+
+struct wl_request_profile {
+	uint64_t count;
+	uint64_t total_nsec;
+	uint64_t max_nsec;
+	uint64_t buckets[WL_REQUEST_PROFILE_BUCKETS];
+};
+
+typedef void (*wl_display_request_profile_func_t)(const struct wl_interface *interface,
+						  uint32_t opcode,
+						  const struct wl_request_profile *profile,
+						  void *user_data);
+
+void
+wl_display_set_request_profiling(struct wl_display *display, bool enabled);
+
+void
+wl_display_for_each_request_profile(struct wl_display *display,
+				    wl_display_request_profile_func_t func,
+				    void *user_data);
+
 void
 wl_display_destroy_clients(struct wl_display *display);
 
@@ -221,6 +259,9 @@ void
 wl_display_set_default_max_buffer_size(struct wl_display *display,
 				       size_t max_buffer_size);
 
+void
+wl_display_set_accept_limit(struct wl_display *display, uint32_t limit);
+
 struct wl_client;
 
 typedef void (*wl_global_bind_func_t)(struct wl_client *client, void *data,
@@ -323,6 +364,94 @@ wl_client_destroy(struct wl_client *client);
 void
 wl_client_flush(struct wl_client *client);
 
+void
+wl_client_cork(struct wl_client *client);
+
+void
+wl_client_uncork(struct wl_client *client);
+
+void
+wl_client_set_flush_threshold(struct wl_client *client, size_t threshold);
+
+int
+wl_client_set_flush_deadline(struct wl_client *client, int timeout_ms);
+
+int
+wl_client_set_dispatch_quantum(struct wl_client *client,
+			       uint32_t max_requests, uint32_t max_bytes,
+			       uint32_t max_usec);
+
+struct wl_client_dispatch_stats {
+	uint64_t requests;
+	uint64_t preemptions;
+	uint64_t wait_total_nsec;
+	uint64_t wait_max_nsec;
+};
+
+void
+wl_client_get_dispatch_stats(struct wl_client *client,
+			     struct wl_client_dispatch_stats *stats);
+
+struct wl_client_stats {
+	size_t buffer_bytes;
+	size_t object_map_bytes;
+	size_t resource_bytes;
+	uint32_t resources;
+	uint32_t shm_pools;
+	size_t shm_pool_bytes;
+};
+
+void
+wl_client_get_stats(struct wl_client *client, struct wl_client_stats *stats);
+
+uint32_t
+wl_client_get_resource_count(struct wl_client *client,
+			     const struct wl_interface *interface);
+
+typedef enum wl_iterator_result (*wl_client_for_each_resource_count_iterator_func_t)(
+						const struct wl_interface *interface,
+						uint32_t count,
+						void *user_data);
+
+void
+wl_client_for_each_resource_count(struct wl_client *client,
+				  wl_client_for_each_resource_count_iterator_func_t iterator,
+				  void *user_data);
+
+enum wl_client_backpressure_policy {
+	WL_CLIENT_BACKPRESSURE_NOTIFY,
+	WL_CLIENT_BACKPRESSURE_DROP_COALESCED,
+	WL_CLIENT_BACKPRESSURE_PAUSE,
+	WL_CLIENT_BACKPRESSURE_DISCONNECT,
+};
+
+int
+wl_client_set_backpressure(struct wl_client *client,
+			   size_t high_watermark, size_t low_watermark,
+			   enum wl_client_backpressure_policy policy);
+
+bool
+wl_client_is_congested(struct wl_client *client);
+
+void
+wl_client_add_congestion_listener(struct wl_client *client,
+				  struct wl_listener *listener);
+
+struct wl_client_output_stats {
+	size_t queued_bytes;
+	uint64_t queued_nsec;
+	uint64_t congestions;
+	uint64_t dropped_events;
+};
+
+void
+wl_client_get_output_stats(struct wl_client *client,
+			   struct wl_client_output_stats *stats);
+
+void
+wl_client_get_request_profile(struct wl_client *client,
+			      struct wl_request_profile *profile);
+
 void
 wl_client_get_credentials(struct wl_client *client,
 			  pid_t *pid, uid_t *uid, gid_t *gid);
@@ -542,6 +671,14 @@ void
 wl_resource_post_event_array(struct wl_resource *resource,
 			     uint32_t opcode, union wl_argument *args);
 
+void
+wl_resource_broadcast_event(struct wl_list *resources,
+			    uint32_t opcode, ...);
+
+void
+wl_resource_broadcast_event_array(struct wl_list *resources,
+				  uint32_t opcode, union wl_argument *args);
+
 void
 wl_resource_queue_event(struct wl_resource *resource,
 			uint32_t opcode, ...);
@@ -550,6 +687,39 @@ void
 wl_resource_queue_event_array(struct wl_resource *resource,
 			      uint32_t opcode, union wl_argument *args);
 
+void
+wl_resource_queue_event_coalesced(struct wl_resource *resource,
+				  uint32_t opcode, const void *key, ...);
+
+void
+wl_resource_queue_event_coalesced_array(struct wl_resource *resource,
+					uint32_t opcode, const void *key,
+					union wl_argument *args);
+
+struct wl_prepared_event;
+
+struct wl_prepared_event *
+wl_resource_prepare_event(struct wl_resource *resource, uint32_t opcode);
+
+void
+wl_prepared_event_post(struct wl_prepared_event *event, ...);
+
+void
+wl_prepared_event_post_array(struct wl_prepared_event *event,
+			     union wl_argument *args);
+
+void
+wl_prepared_event_destroy(struct wl_prepared_event *event);
+
+int
+wl_resource_post_event_threadsafe(struct wl_resource *resource,
+				  uint32_t opcode, ...);
+
+int
+wl_resource_post_event_threadsafe_array(struct wl_resource *resource,
+					uint32_t opcode,
+					union wl_argument *args);
+
 void
 wl_resource_post_error_vargs(struct wl_resource *resource,
 			     uint32_t code, const char *msg, va_list argp);
@@ -564,6 +734,9 @@ wl_resource_post_no_memory(struct wl_resource *resource);
 struct wl_display *
 wl_client_get_display(struct wl_client *client);
 
+struct wl_event_loop *
+wl_client_get_event_loop(struct wl_client *client);
+
 struct wl_resource *
 wl_resource_create(struct wl_client *client,
 		   const struct wl_interface *interface,
@@ -28,6 +28,8 @@
 #ifndef WAYLAND_SERVER_PRIVATE_H
 #define WAYLAND_SERVER_PRIVATE_H
 
+#include <sys/types.h>
+
 #include "wayland-server-core.h"
 
 struct wl_priv_signal {
@@ -50,4 +52,8 @@ wl_priv_signal_emit(struct wl_priv_signal *signal, void *data);
 void
 wl_priv_signal_final_emit(struct wl_priv_signal *signal, void *data);
 
+void
+wl_client_account_shm_pool(struct wl_client *client,
+			   int32_t pools, ssize_t bytes);
+
 #endif
@@ -40,8 +40,10 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <sys/eventfd.h>
+#include <signal.h>
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "wayland-util.h"
 #include "wayland-private.h"
@@ -60,6 +62,9 @@
 #define LOCK_SUFFIX	".lock"
 #define LOCK_SUFFIXLEN	5
 
+/* Connections accepted per wakeup of a listening socket by default */
+#define DEFAULT_ACCEPT_LIMIT	16
+
 struct wl_socket {
 	int fd;
 	int fd_lock;
@@ -70,6 +75,52 @@ struct wl_socket {
 	char *display_name;
 };
 
+struct wl_shard;
+
+#define REQUEST_PROFILE_HASH_SIZE 64
+
+/* The profiles of the requests of an interface, indexed by opcode */
+struct request_profiles {
+	const struct wl_interface *interface;
+	struct request_profiles *next;
+	struct wl_request_profile requests[];
+};
+
+/* Work handed over to the thread of a shard */
+struct wl_shard_task {
+	struct wl_list link;
+	void (*run)(struct wl_shard_task *task);
+};
+
+/* An event loop dispatching a share of the clients. The display loop
+ * is the main shard, loops added with wl_display_add_client_loop()
+ * are worker shards. */
+struct wl_shard {
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct wl_list link;
+	/* wl_client::shard_link, only used from the loop thread */
+	struct wl_list clients;
+	/* wl_client::dirty_link, the clients with events to flush */
+	struct wl_list dirty;
+	struct wl_display_flush_stats flush_stats;
+	/* Protected by wl_display::mutex */
+	uint32_t client_count;
+
+	/* Clients preempted with requests left, served round-robin */
+	struct wl_list backlog;
+	struct wl_event_source *check_source;
+
+	pthread_mutex_t task_mutex;
+	struct wl_list tasks;
+	int task_fd;
+	struct wl_event_source *task_source;
+
+	/* Hash chains of struct request_profiles, only added to by the
+	 * loop thread and read by any */
+	struct request_profiles *request_profiles[REQUEST_PROFILE_HASH_SIZE];
+};
+
 struct wl_client {
 	struct wl_connection *connection;
 	struct wl_event_source *source;
@@ -77,6 +128,8 @@ struct wl_client {
 	struct wl_resource *display_resource;
 	struct wl_list link;
 	struct wl_map objects;
+	/* Backs the resources of the client */
+	struct wl_slab resource_slab;
 	struct wl_priv_signal destroy_signal;
 	struct wl_priv_signal destroy_late_signal;
 	pid_t pid;
@@ -86,6 +139,122 @@ struct wl_client {
 	struct wl_priv_signal resource_created_signal;
 	void *data;
 	wl_user_data_destroy_func_t data_dtor;
+	struct wl_event_source *flush_timer;
+	int flush_deadline;
+	bool flush_timer_armed;
+	struct wl_shard *shard;
+	struct wl_list shard_link;
+	struct wl_list dirty_link;
+	/* Adds the client to a worker shard, from its thread */
+	struct wl_shard_task start_task;
+	/* In wl_shard::backlog while requests are left over from its
+	 * last dispatch quantum, since backlogged_at */
+	struct wl_list backlog_link;
+	uint64_t backlogged_at;
+	uint32_t quantum_requests;
+	uint32_t quantum_bytes;
+	uint64_t quantum_nsec;
+	struct wl_client_dispatch_stats dispatch_stats;
+	/* Global filter results indexed by global name, valid while
+	 * visibility_generation matches wl_display::filter_generation */
+	struct wl_array visibility;
+	uint32_t visibility_generation;
+	/* Live resources, and their struct resource_count per interface */
+	uint32_t resource_count;
+	struct wl_array resource_counts;
+	/* Mapped by the wl_shm_pool objects of the client */
+	uint32_t shm_pools;
+	size_t shm_pool_bytes;
+	/* struct coalesce_entry of the coalescable events queued last */
+	struct wl_array coalesce;
+	/* struct wl_posted_event pushed by other threads, newest first */
+	struct wl_posted_event *posted;
+	/* The events taken from posted, in posting order, until spliced */
+	struct wl_posted_event *posted_pending;
+	struct wl_posted_event **posted_tail;
+	/* Splices the posted events, from the thread of the client */
+	struct wl_shard_task posted_task;
+	/* Output backpressure, see wl_client_set_backpressure() */
+	size_t high_watermark;
+	size_t low_watermark;
+	enum wl_client_backpressure_policy backpressure_policy;
+	bool congested;
+	/* Disconnected by the next flush for not reading its events */
+	bool evicted;
+	bool poll_writable;
+	struct wl_priv_signal congestion_signal;
+	/* Since when the output buffer holds events, 0 when empty */
+	uint64_t queued_since;
+	struct wl_client_output_stats output_stats;
+	/* Index of its struct flush_job in a parallel flush pass */
+	size_t flush_job;
+	struct wl_request_profile request_profile;
+};
+
+/* A connection flushed by a parallel flush pass, and the result */
+struct flush_job {
+	struct wl_connection *connection;
+	int ret;
+	int error;
+};
+
+/* Threads sharing the flush passes of wl_display_flush_clients() with
+ * the display thread. The connections of a pass are only written by
+ * the pool until the display thread has seen all threads finish it. */
+struct wl_flush_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	uint32_t thread_count;
+	/* Bumped to start a pass */
+	uint64_t pass;
+	/* Threads still working on the current pass */
+	uint32_t busy;
+	bool stop;
+	/* struct flush_job of the pass, and the next one to take */
+	struct wl_array jobs;
+	size_t next_job;
+};
+
+/* An event posted with wl_resource_post_event_threadsafe(), serialized
+ * by the posting thread. The object arguments of the closure are
+ * replaced by their ids until the event is spliced. The resource is
+ * cleared when it or one of the object arguments is destroyed. */
+struct wl_posted_event {
+	struct wl_posted_event *next;
+	struct wl_resource *resource;
+	uint32_t id;
+	struct wl_closure *closure;
+	size_t size;
+	uint32_t message[];
+};
+
+/* An event of a resource whose arguments are all words, see
+ * wl_resource_prepare_event(). The resource is cleared when it is
+ * destroyed. */
+struct wl_prepared_event {
+	struct wl_resource *resource;
+	struct wl_listener resource_destroy;
+	uint32_t opcode;
+	const struct wl_message_desc *desc;
+	/* The id of the resource, the size and the opcode */
+	uint32_t header[2];
+};
+
+/* Locates the event last queued for a coalescing key, which pending events
+ * with the same key replace. */
+struct coalesce_entry {
+	struct wl_resource *resource;
+	const void *key;
+	uint32_t opcode;
+	uint64_t pos;
+	size_t size;
+};
+
+struct resource_count {
+	const struct wl_interface *interface;
+	uint32_t count;
 };
 
 struct wl_display {
@@ -93,6 +262,8 @@ struct wl_display {
 	bool run;
 
 	uint32_t next_global_name;
+	/* The globals of global_list, indexed by name */
+	struct wl_array global_table;
 	uint32_t serial;
 
 	struct wl_list registry_resource_list;
@@ -108,11 +279,32 @@ struct wl_display {
 
 	wl_display_global_filter_func_t global_filter;
 	void *global_filter_data;
+	uint32_t filter_generation;
 
 	int terminate_efd;
 	struct wl_event_source *term_source;
 
 	size_t max_buffer_size;
+	/* Connections accepted per wakeup of a listening socket, 0 for no
+	 * limit */
+	uint32_t accept_limit;
+
+	/* Guards the client, global and registry lists and the global
+	 * names once clients are dispatched from several threads */
+	pthread_mutex_t mutex;
+	/* Signalled when the last bind of a global on a worker shard
+	 * returns */
+	pthread_cond_t bind_cond;
+	/* Bumped whenever a global is added or removed */
+	uint64_t global_seq;
+
+	struct wl_shard main_shard;
+	struct wl_list shards;
+
+	/* Set with wl_display_set_flush_threads() */
+	struct wl_flush_pool *flush_pool;
+
+	bool request_profiling;
 };
 
 struct wl_global {
@@ -124,6 +316,22 @@ struct wl_global {
 	wl_global_bind_func_t bind;
 	struct wl_list link;
 	bool removed;
+	/* wl_display::global_seq of the global's creation and removal */
+	uint64_t added_seq;
+	uint64_t removed_seq;
+	/* Binds in progress and registry updates queued for worker
+	 * shards, the global is freed after the last one */
+	uint32_t refs;
+	/* Binds in progress on worker shards, wl_global_destroy() waits
+	 * for them */
+	uint32_t worker_binds;
+	bool destroyed;
+};
+
+struct wl_registry_state {
+	struct wl_display *display;
+	/* wl_display::global_seq when the globals were announced */
+	uint64_t seq;
 };
 
 struct wl_resource {
@@ -140,6 +348,8 @@ struct wl_resource {
 	int version;
 	wl_dispatcher_func_t dispatcher;
 	struct wl_priv_signal destroy_signal;
+	/* Index of its interface in wl_client::resource_counts */
+	uint32_t count_slot;
 };
 
 struct wl_protocol_logger {
@@ -178,20 +388,35 @@ log_closure(struct wl_resource *resource,
 	}
 }
 
+static bool
+message_desc_has_new_id(const struct wl_message_desc *desc)
+{
+	int i;
+
+	for (i = 0; desc->num_objects && i < desc->count; i++) {
+		if (desc->types[i] == WL_ARG_NEW_ID)
+			return true;
+	}
+
+	return false;
+}
+
 static bool
 verify_objects(struct wl_resource *resource, uint32_t opcode,
 	       union wl_argument *args)
 {
 	struct wl_object *object = &resource->object;
-	const char *signature = object->interface->events[opcode].signature;
-	struct argument_details arg;
+	const struct wl_message_desc *desc;
 	struct wl_resource *res;
 	int count, i;
 
-	count = arg_count_for_signature(signature);
+	desc = wl_message_get_desc(&object->interface->events[opcode]);
+	if (desc == NULL)
+		return false;
+
+	count = desc->num_objects ? desc->count : 0;
 	for (i = 0; i < count; i++) {
-		signature = get_next_argument(signature, &arg);
-		switch (arg.type) {
+		switch (desc->types[i]) {
 		case WL_ARG_NEW_ID:
 		case WL_ARG_OBJECT:
 			res = (struct wl_resource *) (args[i].o);
@@ -211,19 +436,104 @@ verify_objects(struct wl_resource *resource, uint32_t opcode,
 }
 
 static void
-handle_array(struct wl_resource *resource, uint32_t opcode,
-	     union wl_argument *args,
-	     int (*send_func)(struct wl_closure *, struct wl_connection *))
+client_mark_dirty(struct wl_client *client)
+{
+	/* Clients handed over to a worker shard are marked once started */
+	if (wl_list_empty(&client->dirty_link) && client->source)
+		wl_list_insert(client->shard->dirty.prev, &client->dirty_link);
+}
+
+static void
+arm_flush_timer(struct wl_client *client)
+{
+	if (client->flush_deadline > 0 && client->flush_timer &&
+	    !client->flush_timer_armed) {
+		wl_event_source_timer_update(client->flush_timer,
+					     client->flush_deadline);
+		client->flush_timer_armed = true;
+	}
+}
+
+/* Updates the events polled on the client's fd. Requests are not read
+ * while the client is paused by its backpressure policy. */
+static void
+client_update_fd_mask(struct wl_client *client, bool writable)
+{
+	uint32_t mask = 0;
+
+	client->poll_writable = writable;
+	if (client->source == NULL)
+		return;
+
+	if (writable)
+		mask |= WL_EVENT_WRITABLE;
+	if (!client->congested ||
+	    client->backpressure_policy != WL_CLIENT_BACKPRESSURE_PAUSE)
+		mask |= WL_EVENT_READABLE;
+	wl_event_source_fd_update(client->source, mask);
+}
+
+static void
+client_set_congested(struct wl_client *client, bool congested)
+{
+	client->congested = congested;
+	if (congested)
+		client->output_stats.congestions++;
+
+	switch (client->backpressure_policy) {
+	case WL_CLIENT_BACKPRESSURE_PAUSE:
+		client_update_fd_mask(client, client->poll_writable);
+		break;
+	case WL_CLIENT_BACKPRESSURE_DISCONNECT:
+		/* The caller may still be using the client's resources, it
+		 * is destroyed by the next flush. */
+		if (congested) {
+			client->error = true;
+			client->evicted = true;
+			client_mark_dirty(client);
+		}
+		break;
+	default:
+		break;
+	}
+
+	wl_priv_signal_emit(&client->congestion_signal, client);
+}
+
+/* Checks the output buffer of the client against its watermarks once
+ * events were queued or flushed. */
+static void
+client_check_output(struct wl_client *client)
+{
+	size_t queued = wl_connection_pending_output(client->connection);
+
+	if (queued == 0)
+		client->queued_since = 0;
+	else if (client->queued_since == 0)
+		client->queued_since = wl_monotonic_nsec();
+
+	if (client->high_watermark == 0)
+		return;
+
+	if (!client->congested && queued >= client->high_watermark)
+		client_set_congested(client, true);
+	else if (client->congested && queued <= client->low_watermark)
+		client_set_congested(client, false);
+}
+
+static struct wl_closure *
+marshal_event(struct wl_resource *resource, uint32_t opcode,
+	      union wl_argument *args)
 {
 	struct wl_closure *closure;
 	struct wl_object *object = &resource->object;
 
 	if (resource->client->error)
-		return;
+		return NULL;
 
 	if (!verify_objects(resource, opcode, args)) {
 		resource->client->error = true;
-		return;
+		return NULL;
 	}
 
 	closure = wl_closure_marshal(object, opcode, args,
@@ -231,15 +541,159 @@ handle_array(struct wl_resource *resource, uint32_t opcode,
 
 	if (closure == NULL) {
 		resource->client->error = true;
-		return;
+		return NULL;
 	}
 
 	log_closure(resource, closure, true);
 
+	return closure;
+}
+
+/* Forgets the events queued for the resource, which must not be replaced
+ * by events of a resource later allocated at the same address, nor jump
+ * over the events sent since. */
+static void
+client_drop_coalesce_entries(struct wl_client *client,
+			     struct wl_resource *resource)
+{
+	struct coalesce_entry *entries = client->coalesce.data;
+	size_t i, n = client->coalesce.size / sizeof *entries;
+
+	for (i = 0; i < n; ) {
+		if (entries[i].resource == resource) {
+			entries[i] = entries[--n];
+			client->coalesce.size -= sizeof entries[i];
+		} else {
+			i++;
+		}
+	}
+}
+
+/* Called before any event is sent for the resource other than by
+ * wl_resource_queue_event_coalesced_array(). */
+static inline void
+resource_end_coalescing(struct wl_resource *resource)
+{
+	struct wl_client *client = resource->client;
+
+	if (client->coalesce.size > 0)
+		client_drop_coalesce_entries(client, resource);
+}
+
+static void
+handle_array(struct wl_resource *resource, uint32_t opcode,
+	     union wl_argument *args,
+	     int (*send_func)(struct wl_closure *, struct wl_connection *))
+{
+	struct wl_closure *closure;
+
+	closure = marshal_event(resource, opcode, args);
+	if (closure == NULL)
+		return;
+
+	resource_end_coalescing(resource);
 	if (send_func(closure, resource->client->connection))
 		resource->client->error = true;
+	else if (send_func == wl_closure_send)
+		client_mark_dirty(resource->client);
 
 	wl_closure_destroy(closure);
+
+	arm_flush_timer(resource->client);
+	client_check_output(resource->client);
+}
+
+/* Messages at most this large are serialized on the stack for a
+ * broadcast. */
+#define BROADCAST_BUFFER_SIZE 256
+
+typedef bool (*broadcast_filter_func_t)(struct wl_resource *resource,
+					void *data);
+
+static void
+broadcast_send(struct wl_resource *resource, struct wl_closure *closure,
+	       const uint32_t *message, size_t size, bool last)
+{
+	struct wl_client *client = resource->client;
+
+	if (client->error)
+		return;
+
+	log_closure(resource, closure, true);
+
+	resource_end_coalescing(resource);
+	if (wl_closure_send_serialized(closure, client->connection,
+				       message, size,
+				       resource->object.id, last))
+		client->error = true;
+	else
+		client_mark_dirty(client);
+
+	arm_flush_timer(client);
+	client_check_output(client);
+}
+
+/* Posts the event to the resources of the list accepted by the filter.
+ * Unless it carries object ids, which are per client, the event is
+ * serialized once and copied to each connection. */
+static void
+broadcast_event(struct wl_list *resources, uint32_t opcode,
+		union wl_argument *args,
+		broadcast_filter_func_t filter, void *data)
+{
+	uint32_t stack_buffer[BROADCAST_BUFFER_SIZE / sizeof(uint32_t)];
+	struct wl_resource *resource, *first = NULL, *pending = NULL;
+	const struct wl_message *message;
+	const struct wl_message_desc *desc;
+	struct wl_closure *closure = NULL;
+	uint32_t *buffer = stack_buffer;
+	size_t size;
+	int len = -1;
+
+	wl_list_for_each(resource, resources, link) {
+		if (filter == NULL || filter(resource, data)) {
+			first = resource;
+			break;
+		}
+	}
+	if (first == NULL)
+		return;
+
+	message = &first->object.interface->events[opcode];
+	desc = wl_message_get_desc(message);
+	if (desc && desc->num_objects == 0)
+		closure = wl_closure_marshal(&first->object, opcode, args,
+					     message);
+	if (closure) {
+		size = wl_closure_get_size(closure);
+		if (size > sizeof stack_buffer)
+			buffer = malloc(size);
+		if (buffer)
+			len = wl_closure_serialize(closure, buffer, size);
+	}
+
+	if (len < 0) {
+		wl_list_for_each(resource, resources, link)
+			if (filter == NULL || filter(resource, data))
+				handle_array(resource, opcode, args,
+					     wl_closure_send);
+	} else {
+		wl_list_for_each(resource, resources, link) {
+			if (filter && !filter(resource, data))
+				continue;
+			/* Copies of the fds for all but the last one */
+			if (pending)
+				broadcast_send(pending, closure, buffer, len,
+					       false);
+			pending = resource;
+		}
+		broadcast_send(pending, closure, buffer, len, true);
+	}
+
+	if (buffer != stack_buffer)
+		free(buffer);
+	if (closure)
+		wl_closure_destroy(closure);
 }
 
 WL_EXPORT void
@@ -257,14 +711,80 @@ wl_resource_post_event(struct wl_resource *resource, uint32_t opcode, ...)
 	va_list ap;
 
 	va_start(ap, opcode);
-	wl_argument_from_va_list(object->interface->events[opcode].signature,
-				 args, WL_CLOSURE_MAX_ARGS, ap);
+	if (wl_argument_from_va_list(&object->interface->events[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		resource->client->error = true;
+		return;
+	}
 	va_end(ap);
 
 	wl_resource_post_event_array(resource, opcode, args);
 }
 
 
+/** Post an event to a list of resources
+ *
+ * \param resources The list of resources, linked with
+ * wl_resource_get_link()
+ * \param opcode The event opcode
+ * \param args The event arguments
+ *
+ * Posts the event to each resource of \a resources like
+ * wl_resource_post_event_array(). The resources must all have the same
+ * interface.
+ *
+ * Unless the event has object or new_id arguments, it is marshalled
+ * and serialized once, and copied to the connection of each client
+ * with the id of its resource. File descriptors are duplicated for all
+ * but the last resource.
+ *
+ * \memberof wl_resource
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_resource_broadcast_event_array(struct wl_list *resources, uint32_t opcode,
+				  union wl_argument *args)
+{
+	broadcast_event(resources, opcode, args, NULL, NULL);
+}
+
+/** Post an event to a list of resources
+ *
+ * \param resources The list of resources, linked with
+ * wl_resource_get_link()
+ * \param opcode The event opcode
+ * \param ... The event arguments
+ *
+ * \sa wl_resource_broadcast_event_array()
+ *
+ * \memberof wl_resource
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_resource_broadcast_event(struct wl_list *resources, uint32_t opcode, ...)
+{
+	union wl_argument args[WL_CLOSURE_MAX_ARGS];
+	struct wl_resource *first, *resource;
+	va_list ap;
+
+	if (wl_list_empty(resources))
+		return;
+
+	first = wl_resource_from_link(resources->next);
+	va_start(ap, opcode);
+	if (wl_argument_from_va_list(&first->object.interface->events[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		wl_list_for_each(resource, resources, link)
+			resource->client->error = true;
+		return;
+	}
+	va_end(ap);
+
+	broadcast_event(resources, opcode, args, NULL, NULL);
+}
+
 WL_EXPORT void
 wl_resource_queue_event_array(struct wl_resource *resource, uint32_t opcode,
 			      union wl_argument *args)
@@ -280,238 +800,1860 @@ wl_resource_queue_event(struct wl_resource *resource, uint32_t opcode, ...)
 	va_list ap;
 
 	va_start(ap, opcode);
-	wl_argument_from_va_list(object->interface->events[opcode].signature,
-				 args, WL_CLOSURE_MAX_ARGS, ap);
+	if (wl_argument_from_va_list(&object->interface->events[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		resource->client->error = true;
+		return;
+	}
 	va_end(ap);
 
 	wl_resource_queue_event_array(resource, opcode, args);
 }
 
-/** Post a protocol error
+/* Finds the entry of the key, or adds an empty one. Entries of events
+ * already sent, even partly, can no longer be used and are dropped. A
+ * resource has a single entry, that of its last event: an entry for
+ * another key is reset, as its event now precedes the new one. */
+static struct coalesce_entry *
+client_get_coalesce_entry(struct wl_client *client,
+			  struct wl_resource *resource,
+			  uint32_t opcode, const void *key)
+{
+	uint64_t sent = wl_connection_get_sent_bytes(client->connection);
+	struct coalesce_entry *entries = client->coalesce.data;
+	struct coalesce_entry *entry;
+	size_t i, n = client->coalesce.size / sizeof *entries;
+
+	for (i = 0; i < n; ) {
+		entry = &entries[i];
+		if (entry->pos < sent) {
+			*entry = entries[--n];
+			client->coalesce.size -= sizeof *entry;
+			continue;
+		}
+
+		if (entry->resource == resource)
+			break;
+		i++;
+	}
+
+	if (i < n) {
+		if (entry->key == key &&
+		    (key != NULL || entry->opcode == opcode))
+			return entry;
+	} else {
+		entry = wl_array_add(&client->coalesce, sizeof *entry);
+		if (entry == NULL)
+			return NULL;
+	}
+
+	entry->resource = resource;
+	entry->key = key;
+	entry->opcode = opcode;
+	entry->pos = 0;
+	entry->size = 0;
+
+	return entry;
+}
+
+/** Queue an event replacing the pending one with the same key
  *
  * \param resource The resource object
- * \param code The error code
- * \param msg The error message format string
- * \param argp The format string argument list
+ * \param opcode The event opcode
+ * \param key The coalescing key, or NULL to use the opcode
+ * \param args The event arguments
+ *
+ * Queues the event like wl_resource_queue_event_array(), unless the last
+ * event queued with this function for \a resource and \a key has not
+ * been sent to the client yet and is serialized to the same size. That
+ * pending event is then overwritten in place, which keeps clients that
+ * are slow to read from accumulating redundant state updates such as
+ * pointer motion.
+ *
+ * With a NULL \a key, events replace the pending events with the same
+ * opcode. Any other pointer lets several events of the resource replace
+ * each other, whatever their opcode.
+ *
+ * Only the last event of the resource can be replaced: any other event
+ * sent or queued for \a resource since, coalesced with another key or
+ * not, ends the replacement. A replacing event hence never jumps over
+ * other events of the resource. Events carrying file descriptors or
+ * creating objects are never coalesced.
+ *
+ * \sa wl_resource_queue_event_coalesced()
  *
  * \memberof wl_resource
+ * \since 1.23.90
  */
 WL_EXPORT void
-wl_resource_post_error_vargs(struct wl_resource *resource,
-			     uint32_t code, const char *msg, va_list argp)
+wl_resource_queue_event_coalesced_array(struct wl_resource *resource,
+					uint32_t opcode, const void *key,
+					union wl_argument *args)
 {
+	const struct wl_message *message =
+		&resource->object.interface->events[opcode];
+	const struct wl_message_desc *desc;
 	struct wl_client *client = resource->client;
-	char buffer[128];
+	struct coalesce_entry *entry;
+	struct wl_closure *closure;
 
-	vsnprintf(buffer, sizeof buffer, msg, argp);
+	desc = wl_message_get_desc(message);
+	if (desc == NULL || desc->num_fds ||
+	    message_desc_has_new_id(desc)) {
+		handle_array(resource, opcode, args, wl_closure_queue);
+		return;
+	}
+
+	entry = client_get_coalesce_entry(client, resource, opcode, key);
+	if (client->congested && client->backpressure_policy ==
+	    WL_CLIENT_BACKPRESSURE_DROP_COALESCED &&
+	    (entry == NULL || entry->size == 0)) {
+		/* Only pending events are still replaced */
+		if (entry)
+			client_drop_coalesce_entries(client, resource);
+		client->output_stats.dropped_events++;
+		return;
+	}
+
+	closure = marshal_event(resource, opcode, args);
+	if (closure == NULL)
+		return;
+
+	if (entry == NULL) {
+		if (wl_closure_queue(closure, client->connection))
+			client->error = true;
+	} else if (wl_closure_queue_coalesced(closure, client->connection,
+					      &entry->pos,
+					      &entry->size) < 0) {
+		client->error = true;
+	}
+
+	wl_closure_destroy(closure);
+
+	arm_flush_timer(client);
+	client_check_output(client);
+}
+
+/** Queue an event replacing the pending one with the same key
+ *
+ * \param resource The resource object
+ * \param opcode The event opcode
+ * \param key The coalescing key, or NULL to use the opcode
+ * \param ... The event arguments
+ *
+ * \sa wl_resource_queue_event_coalesced_array()
+ *
+ * \memberof wl_resource
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_resource_queue_event_coalesced(struct wl_resource *resource,
+				  uint32_t opcode, const void *key, ...)
+{
+	union wl_argument args[WL_CLOSURE_MAX_ARGS];
+	struct wl_object *object = &resource->object;
+	va_list ap;
+
+	va_start(ap, key);
+	if (wl_argument_from_va_list(&object->interface->events[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		resource->client->error = true;
+		return;
+	}
+	va_end(ap);
+
+	wl_resource_queue_event_coalesced_array(resource, opcode, key, args);
+}
+
+static void
+prepared_event_resource_destroyed(struct wl_listener *listener, void *data)
+{
+	struct wl_prepared_event *event =
+		wl_container_of(listener, event, resource_destroy);
+
+	event->resource = NULL;
+}
+
+/** Prepare an event to be posted repeatedly
+ *
+ * \param resource The resource object
+ * \param opcode The event opcode
+ * \return The prepared event, or NULL on failure with errno set
+ *
+ * Events that only carry uint, int and fixed arguments, such as
+ * wl_callback.done or wl_pointer.motion, always have the same header for
+ * a given resource. The prepared event keeps the header serialized, so
+ * that wl_prepared_event_post() only has to append it to the connection
+ * along with the argument values, without marshalling a closure. Events
+ * with other argument types fail with EINVAL.
+ *
+ * The prepared event stays valid after \a resource is destroyed, but
+ * posting it then does nothing. It must be freed with
+ * wl_prepared_event_destroy().
+ *
+ * \memberof wl_resource
+ * \since 1.23.90
+ */
+WL_EXPORT struct wl_prepared_event *
+wl_resource_prepare_event(struct wl_resource *resource, uint32_t opcode)
+{
+	const struct wl_interface *interface = resource->object.interface;
+	const struct wl_message_desc *desc;
+	struct wl_prepared_event *event;
+	int i;
+
+	if (opcode >= (uint32_t) interface->event_count) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	desc = wl_message_get_desc(&interface->events[opcode]);
+	if (desc == NULL)
+		return NULL;
+
+	for (i = 0; i < desc->count; i++) {
+		if (desc->types[i] != WL_ARG_UINT &&
+		    desc->types[i] != WL_ARG_INT &&
+		    desc->types[i] != WL_ARG_FIXED) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	event = zalloc(sizeof *event);
+	if (event == NULL)
+		return NULL;
+
+	event->resource = resource;
+	event->opcode = opcode;
+	event->desc = desc;
+	event->header[0] = resource->object.id;
+	event->header[1] = ((2 + desc->count) * sizeof(uint32_t)) << 16 |
+		opcode;
+	event->resource_destroy.notify = prepared_event_resource_destroyed;
+	wl_resource_add_destroy_listener(resource, &event->resource_destroy);
+
+	return event;
+}
+
+/** Post a prepared event
+ *
+ * \param event The prepared event
+ * \param args The event arguments
+ *
+ * Posts the event like wl_resource_post_event_array(). The event goes
+ * through the usual path while the protocol is being logged.
+ *
+ * \sa wl_resource_prepare_event()
+ *
+ * \memberof wl_prepared_event
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_prepared_event_post_array(struct wl_prepared_event *event,
+			     union wl_argument *args)
+{
+	struct wl_resource *resource = event->resource;
+	uint32_t body[WL_CLOSURE_MAX_ARGS];
+	struct wl_client *client;
+	int i;
+
+	if (resource == NULL)
+		return;
+
+	client = resource->client;
+	if (debug_server || !wl_list_empty(&client->display->protocol_loggers)) {
+		handle_array(resource, event->opcode, args, wl_closure_send);
+		return;
+	}
+
+	if (client->error)
+		return;
+
+	for (i = 0; i < event->desc->count; i++)
+		body[i] = args[i].u;
+
+	resource_end_coalescing(resource);
+	if (wl_connection_send_message(client->connection, event->header,
+				       body, i * sizeof body[0]))
+		client->error = true;
+	else
+		client_mark_dirty(client);
+
+	arm_flush_timer(client);
+	client_check_output(client);
+}
+
+/** Post a prepared event
+ *
+ * \param event The prepared event
+ * \param ... The event arguments
+ *
+ * \sa wl_prepared_event_post_array()
+ *
+ * \memberof wl_prepared_event
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_prepared_event_post(struct wl_prepared_event *event, ...)
+{
+	union wl_argument args[WL_CLOSURE_MAX_ARGS];
+	const struct wl_message_desc *desc = event->desc;
+	va_list ap;
+	int i;
+
+	va_start(ap, event);
+	for (i = 0; i < desc->count; i++) {
+		switch (desc->types[i]) {
+		case WL_ARG_UINT:
+			args[i].u = va_arg(ap, uint32_t);
+			break;
+		case WL_ARG_INT:
+			args[i].i = va_arg(ap, int32_t);
+			break;
+		default:
+			args[i].f = va_arg(ap, wl_fixed_t);
+			break;
+		}
+	}
+	va_end(ap);
+
+	wl_prepared_event_post_array(event, args);
+}
+
+/** Destroy a prepared event
+ *
+ * \param event The prepared event
+ *
+ * \memberof wl_prepared_event
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_prepared_event_destroy(struct wl_prepared_event *event)
+{
+	if (event->resource)
+		wl_list_remove(&event->resource_destroy.link);
+	free(event);
+}
+
+/** Post a protocol error
+ *
+ * \param resource The resource object
+ * \param code The error code
+ * \param msg The error message format string
+ * \param argp The format string argument list
+ *
+ * \memberof wl_resource
+ */
+WL_EXPORT void
+wl_resource_post_error_vargs(struct wl_resource *resource,
+			     uint32_t code, const char *msg, va_list argp)
+{
+	struct wl_client *client = resource->client;
+	char buffer[128];
+
+	vsnprintf(buffer, sizeof buffer, msg, argp);
+
+	/*
+	 * When a client aborts, its resources are destroyed in id order,
+	 * which means the display resource is destroyed first. If destruction
+	 * of any later resources results in a protocol error, we end up here
+	 * with a NULL display_resource. Do not try to send errors to an
+	 * already dead client.
+	 */
+	if (client->error || !client->display_resource)
+		return;
+
+	wl_resource_post_event(client->display_resource,
+			       WL_DISPLAY_ERROR, resource, code, buffer);
+	client->error = true;
+}
+
+/** Post a protocol error
+ *
+ * \param resource The resource object
+ * \param code The error code
+ * \param msg The error message format string
+ * \param ... The format string arguments
+ *
+ * \memberof wl_resource
+ */
+WL_EXPORT void
+wl_resource_post_error(struct wl_resource *resource,
+		       uint32_t code, const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	wl_resource_post_error_vargs(resource, code, msg, ap);
+	va_end(ap);
+}
+
+/* Counts a request taking nsec in the profile. Profiles have a single
+ * writer, readers may run concurrently. */
+static void
+request_profile_add(struct wl_request_profile *profile, uint64_t nsec)
+{
+	int bucket = 0;
+
+	while (bucket < WL_REQUEST_PROFILE_BUCKETS - 1 && nsec >> bucket)
+		bucket++;
+
+	__atomic_store_n(&profile->count, profile->count + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&profile->total_nsec, profile->total_nsec + nsec,
+			 __ATOMIC_RELAXED);
+	if (nsec > profile->max_nsec)
+		__atomic_store_n(&profile->max_nsec, nsec, __ATOMIC_RELAXED);
+	__atomic_store_n(&profile->buckets[bucket],
+			 profile->buckets[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+static void
+request_profile_merge(struct wl_request_profile *profile,
+		      const struct wl_request_profile *other)
+{
+	uint64_t max;
+	int i;
+
+	profile->count += __atomic_load_n(&other->count, __ATOMIC_RELAXED);
+	profile->total_nsec += __atomic_load_n(&other->total_nsec,
+					       __ATOMIC_RELAXED);
+	max = __atomic_load_n(&other->max_nsec, __ATOMIC_RELAXED);
+	if (max > profile->max_nsec)
+		profile->max_nsec = max;
+	for (i = 0; i < WL_REQUEST_PROFILE_BUCKETS; i++)
+		profile->buckets[i] += __atomic_load_n(&other->buckets[i],
+						       __ATOMIC_RELAXED);
+}
+
+static struct request_profiles **
+request_profiles_chain(struct wl_shard *shard,
+		       const struct wl_interface *interface)
+{
+	uintptr_t hash = (uintptr_t) interface;
+
+	hash ^= hash >> 12;
+	return &shard->request_profiles[hash % REQUEST_PROFILE_HASH_SIZE];
+}
+
+static void
+profile_request(struct wl_client *client,
+		const struct wl_interface *interface, uint32_t opcode,
+		uint64_t nsec)
+{
+	struct request_profiles **chain, *profiles;
+
+	request_profile_add(&client->request_profile, nsec);
+
+	chain = request_profiles_chain(client->shard, interface);
+	for (profiles = *chain; profiles; profiles = profiles->next) {
+		if (profiles->interface == interface)
+			break;
+	}
+
+	if (profiles == NULL) {
+		profiles = zalloc(sizeof *profiles + interface->method_count *
+				  sizeof profiles->requests[0]);
+		if (profiles == NULL)
+			return;
+
+		profiles->interface = interface;
+		profiles->next = *chain;
+		__atomic_store_n(chain, profiles, __ATOMIC_RELEASE);
+	}
+
+	request_profile_add(&profiles->requests[opcode], nsec);
+}
+
+static void
+shard_release_request_profiles(struct wl_shard *shard)
+{
+	struct request_profiles *profiles, *next;
+	int i;
+
+	for (i = 0; i < REQUEST_PROFILE_HASH_SIZE; i++) {
+		for (profiles = shard->request_profiles[i]; profiles;
+		     profiles = next) {
+			next = profiles->next;
+			free(profiles);
+		}
+		shard->request_profiles[i] = NULL;
+	}
+}
+
+static void
+destroy_client_with_error(struct wl_client *client, const char *reason)
+{
+	wl_log("%s (pid %u)\n", reason, client->pid);
+	wl_client_destroy(client);
+}
+
+static bool
+dispatch_quantum_expired(struct wl_client *client,
+			 uint32_t requests, uint32_t bytes, uint64_t start)
+{
+	if (client->quantum_requests && requests >= client->quantum_requests)
+		return true;
+	if (client->quantum_bytes && bytes >= client->quantum_bytes)
+		return true;
+	if (client->quantum_nsec && requests > 0 &&
+	    wl_monotonic_nsec() - start >= client->quantum_nsec)
+		return true;
+
+	return false;
+}
+
+static int
+wl_client_connection_data(int fd, uint32_t mask, void *data)
+{
+	struct wl_client *client = data;
+	struct wl_connection *connection = client->connection;
+	struct wl_resource *resource;
+	struct wl_object *object;
+	struct wl_closure *closure;
+	const struct wl_message *message;
+	const struct wl_message_desc *desc;
+	uint32_t p[2];
+	uint32_t resource_flags;
+	int opcode, size, since;
+	int len;
+	uint32_t requests = 0, bytes = 0;
+	uint64_t start = 0, wait, handler_start = 0;
+	const struct wl_interface *interface;
+	bool profiling;
+
+	if (!wl_list_empty(&client->backlog_link)) {
+		wait = wl_monotonic_nsec() - client->backlogged_at;
+		client->dispatch_stats.wait_total_nsec += wait;
+		if (wait > client->dispatch_stats.wait_max_nsec)
+			client->dispatch_stats.wait_max_nsec = wait;
+
+		wl_list_remove(&client->backlog_link);
+		wl_list_init(&client->backlog_link);
+	}
+
+	if (mask & WL_EVENT_HANGUP) {
+		wl_client_destroy(client);
+		return 1;
+	}
+
+	if (mask & WL_EVENT_ERROR) {
+		destroy_client_with_error(client, "socket error");
+		return 1;
+	}
+
+	if (mask & WL_EVENT_WRITABLE) {
+		len = wl_connection_flush(connection);
+		if (len < 0 && errno != EAGAIN) {
+			destroy_client_with_error(
+			    client, "failed to flush client connection");
+			return 1;
+		} else if (len >= 0) {
+			client_update_fd_mask(client, false);
+		}
+		client_check_output(client);
+	}
+
+	/* Requests may be left over from the last quantum */
+	len = wl_connection_pending_input(connection);
+	if (mask & WL_EVENT_READABLE) {
+		len = wl_connection_read(connection);
+		if (len == 0 || (len < 0 && errno != EAGAIN)) {
+			destroy_client_with_error(
+			    client, "failed to read client connection");
+			return 1;
+		}
+	}
+
+	if (client->quantum_nsec)
+		start = wl_monotonic_nsec();
+
+	profiling = __atomic_load_n(&client->display->request_profiling,
+				    __ATOMIC_RELAXED);
+
+	while (len >= 0 && (size_t) len >= sizeof p) {
+		if (dispatch_quantum_expired(client, requests, bytes, start)) {
+			client->backlogged_at = wl_monotonic_nsec();
+			client->dispatch_stats.preemptions++;
+			wl_list_insert(client->shard->backlog.prev,
+				       &client->backlog_link);
+			break;
+		}
+
+		wl_connection_copy(connection, p, sizeof p);
+		opcode = p[1] & 0xffff;
+		size = p[1] >> 16;
+		if (len < size)
+			break;
+
+		resource = wl_map_lookup(&client->objects, p[0]);
+		resource_flags = wl_map_lookup_flags(&client->objects, p[0]);
+		if (resource == NULL) {
+			wl_resource_post_error(client->display_resource,
+					       WL_DISPLAY_ERROR_INVALID_OBJECT,
+					       "invalid object %u", p[0]);
+			break;
+		}
+
+		object = &resource->object;
+		if (opcode >= object->interface->method_count) {
+			wl_resource_post_error(client->display_resource,
+					       WL_DISPLAY_ERROR_INVALID_METHOD,
+					       "invalid method %d, object %s#%u",
+					       opcode,
+					       object->interface->name,
+					       object->id);
+			break;
+		}
+
+		message = &object->interface->methods[opcode];
+		desc = wl_message_get_desc(message);
+		if (desc == NULL) {
+			wl_resource_post_no_memory(resource);
+			break;
+		}
+
+		since = desc->since;
+		if (!(resource_flags & WL_MAP_ENTRY_LEGACY) &&
+		    resource->version > 0 && resource->version < since) {
+			wl_resource_post_error(client->display_resource,
+					       WL_DISPLAY_ERROR_INVALID_METHOD,
+					       "invalid method %d (since %d < %d)"
+					       ", object %s#%u",
+					       opcode, resource->version, since,
+					       object->interface->name,
+					       object->id);
+			break;
+		}
+
+
+		closure = wl_connection_demarshal_in_place(client->connection,
+							   size,
+							   &client->objects,
+							   message);
+
+		if (closure == NULL && errno == ENOMEM) {
+			wl_resource_post_no_memory(resource);
+			break;
+		} else if (closure == NULL ||
+			   wl_closure_lookup_objects(closure, &client->objects) < 0) {
+			wl_resource_post_error(client->display_resource,
+					       WL_DISPLAY_ERROR_INVALID_METHOD,
+					       "invalid arguments for %s#%u.%s",
+					       object->interface->name,
+					       object->id,
+					       message->name);
+			wl_closure_destroy(closure);
+			break;
+		}
+
+		log_closure(resource, closure, false);
+
+		/* The handler may destroy the resource */
+		interface = object->interface;
+		if (profiling)
+			handler_start = wl_monotonic_nsec();
+
+		if ((resource_flags & WL_MAP_ENTRY_LEGACY) ||
+		    resource->dispatcher == NULL) {
+			wl_closure_invoke(closure, WL_CLOSURE_INVOKE_SERVER,
+					  object, opcode, client);
+		} else {
+			wl_closure_dispatch(closure, resource->dispatcher,
+					    object, opcode);
+		}
+
+		if (profiling)
+			profile_request(client, interface, opcode,
+					wl_monotonic_nsec() - handler_start);
+
+		wl_closure_destroy(closure);
+
+		requests++;
+		bytes += size;
+		client->dispatch_stats.requests++;
+
+		if (client->error)
+			break;
+
+		len = wl_connection_pending_input(connection);
+	}
+
+	if (client->error) {
+		destroy_client_with_error(client, client->evicted ?
+					  "client is not reading its events" :
+					  "error in client communication");
+	}
+
+	return 1;
+}
+
+/** Flush pending events to the client
+ *
+ * \param client The client object
+ *
+ * Events sent to clients are queued in a buffer and written to the
+ * socket later - typically when the compositor has handled all
+ * requests and goes back to block in the event loop.  This function
+ * flushes all queued up events for a client immediately.
+ *
+ * \memberof wl_client
+ */
+WL_EXPORT void
+wl_client_flush(struct wl_client *client)
+{
+	if (wl_connection_flush(client->connection) >= 0) {
+		wl_list_remove(&client->dirty_link);
+		wl_list_init(&client->dirty_link);
+	}
+	client_check_output(client);
+}
+
+/* Flush on behalf of the client, leaving the rest of the data to the
+ * event loop if the socket is full. */
+static void
+flush_client_pending(struct wl_client *client)
+{
+	if (wl_connection_flush(client->connection) < 0 && errno == EAGAIN)
+		client_update_fd_mask(client, true);
+	client_check_output(client);
+}
+
+/** Hold back events for the client
+ *
+ * \param client The client object
+ *
+ * While a client is corked, wl_display_flush_clients() skips it and
+ * queued events are not flushed automatically when they exceed the
+ * flush threshold, so that related events can be sent out together.
+ * Events are still flushed when the connection buffer is full, when the
+ * flush deadline expires, or when wl_client_flush() is called.
+ *
+ * Corks nest, the events are flushed when the last one is removed with
+ * wl_client_uncork().
+ *
+ * \sa wl_client_set_flush_deadline()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_cork(struct wl_client *client)
+{
+	wl_connection_cork(client->connection);
+}
+
+/** Release a cork on the client
+ *
+ * \param client The client object
+ *
+ * Removes a cork added with wl_client_cork(). Once the last one is
+ * removed, the events held back are flushed.
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_uncork(struct wl_client *client)
+{
+	if (wl_connection_uncork(client->connection) == 0)
+		flush_client_pending(client);
+}
+
+/** Set the amount of queued events that triggers a flush
+ *
+ * \param client The client object
+ * \param threshold The threshold in bytes, or 0 for the default
+ *
+ * Events queued for a client are flushed right away once they exceed
+ * \a threshold bytes, unless the client is corked. A lower threshold
+ * bounds the lag of clients receiving many events, a higher one sends
+ * them with fewer system calls.
+ *
+ * The default threshold is 4096 bytes. Events are always flushed when
+ * the connection buffer is full, whatever the threshold.
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_set_flush_threshold(struct wl_client *client, size_t threshold)
+{
+	wl_connection_set_flush_threshold(client->connection, threshold);
+}
+
+static int
+flush_timer_func(void *data)
+{
+	struct wl_client *client = data;
+
+	client->flush_timer_armed = false;
+	flush_client_pending(client);
+
+	return 0;
+}
+
+/** Bound the time events for the client stay queued
+ *
+ * \param client The client object
+ * \param timeout_ms The deadline in milliseconds, or 0 for none
+ * \return 0 on success, -1 on failure
+ *
+ * Events queued for a client are flushed at the latest \a timeout_ms
+ * after being queued, even if the client is corked or the compositor
+ * doesn't get to call wl_display_flush_clients() in the meantime.
+ *
+ * Clients have no flush deadline by default.
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT int
+wl_client_set_flush_deadline(struct wl_client *client, int timeout_ms)
+{
+	if (timeout_ms < 0)
+		timeout_ms = 0;
+
+	/* Clients handed over to a worker shard get their timer once
+	 * started, from the shard's thread. */
+	if (timeout_ms > 0 && client->flush_timer == NULL && client->source) {
+		client->flush_timer =
+			wl_event_loop_add_timer(client->shard->loop,
+						flush_timer_func, client);
+		if (client->flush_timer == NULL)
+			return -1;
+	}
+
+	if (client->flush_timer_armed) {
+		wl_event_source_timer_update(client->flush_timer, 0);
+		client->flush_timer_armed = false;
+	}
+
+	client->flush_deadline = timeout_ms;
+	wl_connection_set_flush_deadline(client->connection,
+					 (uint64_t) timeout_ms * 1000000);
+
+	return 0;
+}
+
+/* Gives one more quantum to each client of the shard preempted since
+ * the last round. */
+static void
+dispatch_backlog(struct wl_shard *shard)
+{
+	struct wl_list round;
+	struct wl_client *client;
+
+	/* Dispatching a client removes it from the round, and puts it back
+	 * in the backlog if preempted again. */
+	wl_list_init(&round);
+	wl_list_insert_list(&round, &shard->backlog);
+	wl_list_init(&shard->backlog);
+
+	while (!wl_list_empty(&round)) {
+		client = wl_container_of(round.next, client, backlog_link);
+		wl_client_connection_data(wl_connection_get_fd(client->connection),
+					  0, client);
+	}
+}
+
+/* Passes with fewer clients to flush don't wake up the flush pool */
+#define FLUSH_POOL_MIN_JOBS 16
+
+static void
+flush_pool_run_jobs(struct wl_flush_pool *pool)
+{
+	struct flush_job *jobs = pool->jobs.data;
+	size_t count = pool->jobs.size / sizeof *jobs, i;
+
+	while ((i = __atomic_fetch_add(&pool->next_job, 1,
+				       __ATOMIC_RELAXED)) < count) {
+		jobs[i].ret = wl_connection_flush(jobs[i].connection);
+		jobs[i].error = errno;
+	}
+}
+
+static void *
+flush_pool_thread(void *data)
+{
+	struct wl_flush_pool *pool = data;
+	uint64_t pass = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		while (!pool->stop && pool->pass == pass)
+			pthread_cond_wait(&pool->start_cond, &pool->mutex);
+		if (pool->stop)
+			break;
+		pass = pool->pass;
+		pthread_mutex_unlock(&pool->mutex);
+
+		flush_pool_run_jobs(pool);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/* Flushes the connections of the jobs with the help of the pool, and
+ * returns once none of its threads uses them anymore. */
+static void
+flush_pool_run(struct wl_flush_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->next_job = 0;
+	pool->busy = pool->thread_count;
+	pool->pass++;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	flush_pool_run_jobs(pool);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+flush_pool_destroy(struct wl_flush_pool *pool, uint32_t started)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < started; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	wl_array_release(&pool->jobs);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct wl_flush_pool *
+flush_pool_create(uint32_t thread_count)
+{
+	struct wl_flush_pool *pool;
+	sigset_t all, saved;
+	uint32_t i;
+
+	pool = zalloc(sizeof *pool);
+	if (pool == NULL)
+		return NULL;
+
+	pool->threads = calloc(thread_count, sizeof pool->threads[0]);
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->thread_count = thread_count;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	wl_array_init(&pool->jobs);
+
+	/* Signals are left to the compositor's threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	for (i = 0; i < thread_count; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   flush_pool_thread, pool) != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (i < thread_count) {
+		flush_pool_destroy(pool, i);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/* Hands the connections of the clients over to the pool for flushing,
+ * if there are enough of them. */
+static bool
+flush_pool_flush_clients(struct wl_flush_pool *pool, struct wl_list *clients,
+			 uint64_t count)
+{
+	struct wl_client *client;
+	struct flush_job *job;
+
+	if (pool == NULL || count < FLUSH_POOL_MIN_JOBS)
+		return false;
+
+	pool->jobs.size = 0;
+	if (!wl_array_add(&pool->jobs, count * sizeof *job))
+		return false;
+
+	job = pool->jobs.data;
+	wl_list_for_each(client, clients, dirty_link) {
+		client->flush_job = job - (struct flush_job *) pool->jobs.data;
+		job->connection = client->connection;
+		job++;
+	}
+
+	flush_pool_run(pool);
+
+	return true;
+}
+
+/* Flushes the clients events were sent to since the last call. Clients
+ * left with data are flushed when their socket gets writable, corked
+ * ones when uncorked. The display loop may have the flushes done in
+ * parallel by its flush pool, the results are then applied here. */
+static void
+flush_shard_clients(struct wl_shard *shard)
+{
+	struct wl_flush_pool *pool = NULL;
+	struct wl_list dirty, pending;
+	struct wl_client *client;
+	struct flush_job *job;
+	uint64_t flushed = 0;
+	bool parallel;
+	int ret;
+
+	if (shard == &shard->display->main_shard)
+		pool = shard->display->flush_pool;
+
+	/* Destroying a client may destroy others */
+	wl_list_init(&dirty);
+	wl_list_insert_list(&dirty, &shard->dirty);
+	wl_list_init(&shard->dirty);
+	wl_list_init(&pending);
+
+	while (!wl_list_empty(&dirty)) {
+		client = wl_container_of(dirty.next, client, dirty_link);
+		wl_list_remove(&client->dirty_link);
+		wl_list_init(&client->dirty_link);
+
+		if (client->evicted) {
+			destroy_client_with_error(client,
+						  "client is not reading its "
+						  "events");
+			continue;
+		}
+
+		if (wl_connection_is_corked(client->connection))
+			continue;
+
+		wl_list_insert(pending.prev, &client->dirty_link);
+		flushed++;
+	}
+
+	parallel = flush_pool_flush_clients(pool, &pending, flushed);
+
+	while (!wl_list_empty(&pending)) {
+		client = wl_container_of(pending.next, client, dirty_link);
+		wl_list_remove(&client->dirty_link);
+		wl_list_init(&client->dirty_link);
+
+		if (parallel) {
+			job = (struct flush_job *) pool->jobs.data +
+				client->flush_job;
+			ret = job->ret;
+			errno = job->error;
+			/* Events posted by the listeners of the clients
+			 * handled before, after the flush */
+			if (ret >= 0 &&
+			    wl_connection_pending_output(client->connection))
+				client_mark_dirty(client);
+		} else {
+			ret = wl_connection_flush(client->connection);
+		}
+
+		if (ret < 0 && errno != EAGAIN) {
+			wl_client_destroy(client);
+			continue;
+		}
+
+		if (ret < 0)
+			client_update_fd_mask(client, true);
+		client_check_output(client);
+	}
+
+	__atomic_fetch_add(&shard->flush_stats.flushes, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->flush_stats.clients_flushed, flushed,
+			   __ATOMIC_RELAXED);
+}
+
+/* Runs after the sources ready in an event loop iteration have been
+ * dispatched, until no client is left in the backlog. Worker shards
+ * also flush their clients there, as nobody calls
+ * wl_display_flush_clients() for them. */
+static int
+shard_post_dispatch(void *data)
+{
+	struct wl_shard *shard = data;
+
+	dispatch_backlog(shard);
+	if (shard != &shard->display->main_shard)
+		flush_shard_clients(shard);
+
+	return !wl_list_empty(&shard->backlog);
+}
+
+/** Bound the work done for the client in one go
+ *
+ * \param client The client object
+ * \param max_requests The number of requests, or 0 for no limit
+ * \param max_bytes The size of the requests in bytes, or 0 for no limit
+ * \param max_usec The time spent in microseconds, or 0 for no limit
+ * \return 0 on success, -1 on failure
+ *
+ * By default, all the requests buffered for a client are dispatched as
+ * soon as its connection is readable, so a client flooding the compositor
+ * with requests delays all the others. Once any of the given limits is
+ * reached, the client is preempted and its remaining requests are
+ * dispatched after the other ready clients had their turn, within the
+ * same wl_event_loop_dispatch() call. Preempted clients are served
+ * round-robin.
+ *
+ * At least one request is dispatched per quantum.
+ *
+ * \sa wl_client_get_dispatch_stats()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT int
+wl_client_set_dispatch_quantum(struct wl_client *client,
+			       uint32_t max_requests, uint32_t max_bytes,
+			       uint32_t max_usec)
+{
+	struct wl_shard *shard = client->shard;
+
+	/* The backlog is served from a timer source that is never armed,
+	 * only checked after each dispatch. Worker shards always have one. */
+	if ((max_requests || max_bytes || max_usec) &&
+	    shard->check_source == NULL) {
+		shard->check_source =
+			wl_event_loop_add_timer(shard->loop,
+						shard_post_dispatch, shard);
+		if (shard->check_source == NULL)
+			return -1;
+
+		wl_event_source_check(shard->check_source);
+	}
+
+	client->quantum_requests = max_requests;
+	client->quantum_bytes = max_bytes;
+	client->quantum_nsec = (uint64_t) max_usec * 1000;
+
+	return 0;
+}
+
+/** Get dispatch statistics for the client
+ *
+ * \param client The client object
+ * \param stats Returns the statistics
+ *
+ * Reports the number of requests dispatched, how many times the client
+ * was preempted at the end of its quantum, and the total and longest
+ * time it then waited for its next quantum, in nanoseconds. The
+ * statistics cover the lifetime of the client.
+ *
+ * \sa wl_client_set_dispatch_quantum()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_get_dispatch_stats(struct wl_client *client,
+			     struct wl_client_dispatch_stats *stats)
+{
+	*stats = client->dispatch_stats;
+}
+
+/** Get memory and object statistics for the client
+ *
+ * \param client The client object
+ * \param stats Returns the statistics
+ *
+ * Reports the memory currently held on behalf of the client: the buffers
+ * of its connection, the entries of its object map, the storage of its
+ * resources and the shm pools it has mapped, along with its number of
+ * live resources. The numbers are kept up to date as the client goes, so
+ * this is cheap enough to call on every client to pick which ones to
+ * disconnect under memory pressure.
+ *
+ * Shm pools are accounted until their wl_shm_pool object is destroyed,
+ * even if the compositor keeps them mapped longer through its own
+ * references.
+ *
+ * \sa wl_client_get_resource_count()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_get_stats(struct wl_client *client, struct wl_client_stats *stats)
+{
+	stats->buffer_bytes =
+		wl_connection_get_buffer_bytes(client->connection);
+	stats->object_map_bytes = client->objects.client_entries.alloc +
+		client->objects.server_entries.alloc;
+	stats->resource_bytes = client->resource_slab.size;
+	stats->resources = client->resource_count;
+	stats->shm_pools = client->shm_pools;
+	stats->shm_pool_bytes = client->shm_pool_bytes;
+}
+
+/** Get the number of resources of the client with the given interface
+ *
+ * \param client The client object
+ * \param interface The interface of the resources
+ * \return The number of live resources created with \a interface
+ *
+ * Only resources created with wl_resource_create() are counted.
+ *
+ * \sa wl_client_for_each_resource_count()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT uint32_t
+wl_client_get_resource_count(struct wl_client *client,
+			     const struct wl_interface *interface)
+{
+	struct resource_count *count;
+
+	wl_array_for_each(count, &client->resource_counts) {
+		if (count->interface == interface)
+			return count->count;
+	}
+
+	return 0;
+}
+
+/** Iterate over the number of resources of the client per interface
+ *
+ * \param client The client object
+ * \param iterator The iterator function
+ * \param user_data The user data pointer
+ *
+ * The function pointed by \a iterator is called with each interface the
+ * client has live resources of, along with their number. If it returns
+ * \a WL_ITERATOR_STOP the iteration stops.
+ *
+ * \sa wl_client_get_resource_count()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_for_each_resource_count(struct wl_client *client,
+				  wl_client_for_each_resource_count_iterator_func_t iterator,
+				  void *user_data)
+{
+	struct resource_count *count;
+
+	wl_array_for_each(count, &client->resource_counts) {
+		if (count->count == 0)
+			continue;
+		if (iterator(count->interface, count->count,
+			     user_data) == WL_ITERATOR_STOP)
+			break;
+	}
+}
+
+/** Limit the events queued for a client that doesn't read them
+ *
+ * \param client The client object
+ * \param high_watermark The size of the queued events in bytes at which
+ * the client is congested, or 0 to disable
+ * \param low_watermark The size below which it no longer is
+ * \param policy What to do with a congested client
+ * \return 0 on success, -1 on failure
+ *
+ * Events that can't be written to the socket of a client pile up in its
+ * connection buffer, until the client is disconnected once the buffer
+ * reaches its maximum size, see wl_client_set_max_buffer_size(). With
+ * backpressure enabled, the client becomes congested as soon as its
+ * queued events reach \a high_watermark bytes, and stops being congested
+ * once they are flushed down to \a low_watermark bytes or less. The
+ * listeners added with wl_client_add_congestion_listener() are notified
+ * of both changes, and \a policy is applied in between:
+ *
+ * - WL_CLIENT_BACKPRESSURE_NOTIFY: nothing more.
+ * - WL_CLIENT_BACKPRESSURE_DROP_COALESCED: events queued with
+ *   wl_resource_queue_event_coalesced() are dropped, unless they replace
+ *   a pending one.
+ * - WL_CLIENT_BACKPRESSURE_PAUSE: the requests of the client are no
+ *   longer read, so that it can't cause more events to be sent.
+ * - WL_CLIENT_BACKPRESSURE_DISCONNECT: the client is disconnected by the
+ *   next flush, and no more events are queued in the meantime.
+ *
+ * The high watermark should be well below the maximum buffer size for
+ * the policy to apply first. Watermarks are checked as events are
+ * queued and flushed, and the listeners are called from there: they may
+ * post events but must not destroy the client.
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT int
+wl_client_set_backpressure(struct wl_client *client,
+			   size_t high_watermark, size_t low_watermark,
+			   enum wl_client_backpressure_policy policy)
+{
+	if ((high_watermark > 0 && low_watermark >= high_watermark) ||
+	    policy > WL_CLIENT_BACKPRESSURE_DISCONNECT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (client->congested)
+		client_set_congested(client, false);
+
+	client->high_watermark = high_watermark;
+	client->low_watermark = low_watermark;
+	client->backpressure_policy = policy;
+	client_check_output(client);
+
+	return 0;
+}
+
+/** Check whether the client is congested
+ *
+ * \param client The client object
+ * \return Whether its queued events are above its watermarks
+ *
+ * \sa wl_client_set_backpressure()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT bool
+wl_client_is_congested(struct wl_client *client)
+{
+	return client->congested;
+}
+
+/** Add a listener for the congestion of the client
+ *
+ * \param client The client object
+ * \param listener The listener to be added
+ *
+ * The listener is notified with the client as data argument whenever the
+ * client becomes congested or stops being congested, see
+ * wl_client_is_congested().
+ *
+ * \sa wl_client_set_backpressure()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_add_congestion_listener(struct wl_client *client,
+				  struct wl_listener *listener)
+{
+	wl_priv_signal_add(&client->congestion_signal, listener);
+}
+
+/** Get output statistics for the client
+ *
+ * \param client The client object
+ * \param stats Returns the statistics
+ *
+ * Reports the size of the events queued for the client and for how long,
+ * in nanoseconds, its queue has not been empty, along with how many
+ * times it became congested and the events dropped as a result.
+ *
+ * \sa wl_client_set_backpressure()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_get_output_stats(struct wl_client *client,
+			   struct wl_client_output_stats *stats)
+{
+	*stats = client->output_stats;
+	stats->queued_bytes = wl_connection_pending_output(client->connection);
+	stats->queued_nsec = 0;
+	if (stats->queued_bytes > 0 && client->queued_since > 0)
+		stats->queued_nsec = wl_monotonic_nsec() - client->queued_since;
+}
+
+/** Get the request profile of the client
+ *
+ * \param client The client object
+ * \param profile Returns the profile
+ *
+ * Reports the time spent in the handlers of the requests of the client
+ * dispatched while request profiling was enabled, see
+ * wl_display_for_each_request_profile() for the buckets.
+ *
+ * \sa wl_display_set_request_profiling()
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_client_get_request_profile(struct wl_client *client,
+			      struct wl_request_profile *profile)
+{
+	*profile = client->request_profile;
+}
+
+/* Called by wl_shm_pool as pools are created, resized and destroyed */
+void
+wl_client_account_shm_pool(struct wl_client *client,
+			   int32_t pools, ssize_t bytes)
+{
+	client->shm_pools += pools;
+	client->shm_pool_bytes += bytes;
+}
+
+/** Get the display object for the given client
+ *
+ * \param client The client object
+ * \return The display object the client is associated with.
+ *
+ * \memberof wl_client
+ */
+WL_EXPORT struct wl_display *
+wl_client_get_display(struct wl_client *client)
+{
+	return client->display;
+}
+
+/** Get the event loop dispatching the client
+ *
+ * \param client The client object
+ * \return The display loop, or the loop added with
+ * wl_display_add_client_loop() the client was assigned to.
+ *
+ * \memberof wl_client
+ * \since 1.23.90
+ */
+WL_EXPORT struct wl_event_loop *
+wl_client_get_event_loop(struct wl_client *client)
+{
+	return client->shard->loop;
+}
+
+static int
+bind_display(struct wl_client *client, struct wl_display *display);
+
+static void
+shard_post_task(struct wl_shard *shard, struct wl_shard_task *task)
+{
+	uint64_t wakeup = 1;
+
+	pthread_mutex_lock(&shard->task_mutex);
+	wl_list_insert(shard->tasks.prev, &task->link);
+	pthread_mutex_unlock(&shard->task_mutex);
+
+	if (write(shard->task_fd, &wakeup, sizeof wakeup) < 0 &&
+	    errno != EAGAIN)
+		wl_log("failed to wake up client loop: %s\n", strerror(errno));
+}
+
+static int
+shard_task_data(int fd, uint32_t mask, void *data);
+
+/* Sets up the wakeup of the shard's loop for the tasks handed over by
+ * other threads. */
+static int
+shard_init_tasks(struct wl_shard *shard)
+{
+	wl_list_init(&shard->tasks);
+
+	shard->task_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (shard->task_fd < 0)
+		return -1;
+
+	shard->task_source = wl_event_loop_add_fd(shard->loop, shard->task_fd,
+						  WL_EVENT_READABLE,
+						  shard_task_data, shard);
+	if (shard->task_source == NULL) {
+		close(shard->task_fd);
+		return -1;
+	}
+
+	pthread_mutex_init(&shard->task_mutex, NULL);
+
+	return 0;
+}
+
+static void
+shard_fini_tasks(struct wl_shard *shard)
+{
+	wl_event_source_remove(shard->task_source);
+	close(shard->task_fd);
+	pthread_mutex_destroy(&shard->task_mutex);
+}
+
+static struct wl_shard_task *
+shard_take_task(struct wl_shard *shard)
+{
+	struct wl_shard_task *task = NULL;
+
+	pthread_mutex_lock(&shard->task_mutex);
+	if (!wl_list_empty(&shard->tasks)) {
+		task = wl_container_of(shard->tasks.next, task, link);
+		wl_list_remove(&task->link);
+		wl_list_init(&task->link);
+	}
+	pthread_mutex_unlock(&shard->task_mutex);
+
+	return task;
+}
+
+static int
+shard_task_data(int fd, uint32_t mask, void *data)
+{
+	struct wl_shard *shard = data;
+	struct wl_shard_task *task;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		wl_log("failed to read client loop wakeup: %s\n",
+		       strerror(errno));
+
+	while ((task = shard_take_task(shard)))
+		task->run(task);
+
+	return 1;
+}
+
+/* Appends the events posted to the client to its pending events, in
+ * posting order. */
+static void
+client_take_posted(struct wl_client *client)
+{
+	struct wl_posted_event *event, *next, *last, *list = NULL;
 
-	/*
-	 * When a client aborts, its resources are destroyed in id order,
-	 * which means the display resource is destroyed first. If destruction
-	 * of any later resources results in a protocol error, we end up here
-	 * with a NULL display_resource. Do not try to send errors to an
-	 * already dead client.
-	 */
-	if (client->error || !client->display_resource)
+	event = __atomic_exchange_n(&client->posted, NULL, __ATOMIC_ACQUIRE);
+	if (event == NULL)
 		return;
 
-	wl_resource_post_event(client->display_resource,
-			       WL_DISPLAY_ERROR, resource, code, buffer);
-	client->error = true;
+	last = event;
+	for (; event; event = next) {
+		next = event->next;
+		event->next = list;
+		list = event;
+	}
+
+	*client->posted_tail = list;
+	client->posted_tail = &last->next;
 }
 
-/** Post a protocol error
- *
- * \param resource The resource object
- * \param code The error code
- * \param msg The error message format string
- * \param ... The format string arguments
- *
- * \memberof wl_resource
- */
-WL_EXPORT void
-wl_resource_post_error(struct wl_resource *resource,
-		       uint32_t code, const char *msg, ...)
+/* Removes the oldest pending event of the client */
+static struct wl_posted_event *
+client_next_posted(struct wl_client *client)
 {
-	va_list ap;
+	struct wl_posted_event *event = client->posted_pending;
 
-	va_start(ap, msg);
-	wl_resource_post_error_vargs(resource, code, msg, ap);
-	va_end(ap);
+	if (event) {
+		client->posted_pending = event->next;
+		if (client->posted_pending == NULL)
+			client->posted_tail = &client->posted_pending;
+	}
+
+	return event;
 }
 
 static void
-destroy_client_with_error(struct wl_client *client, const char *reason)
+posted_event_destroy(struct wl_posted_event *event)
 {
-	wl_log("%s (pid %u)\n", reason, client->pid);
-	wl_client_destroy(client);
+	wl_closure_destroy(event->closure);
+	free(event);
 }
 
-static int
-wl_client_connection_data(int fd, uint32_t mask, void *data)
+/* Points the object arguments back to the resources with their ids,
+ * which are still theirs, see client_drop_posted(). */
+static bool
+posted_event_lookup_objects(struct wl_posted_event *event,
+			    struct wl_client *client)
 {
-	struct wl_client *client = data;
-	struct wl_connection *connection = client->connection;
+	struct wl_closure *closure = event->closure;
+	const struct wl_message_desc *desc = closure->desc;
 	struct wl_resource *resource;
-	struct wl_object *object;
-	struct wl_closure *closure;
-	const struct wl_message *message;
-	uint32_t p[2];
-	uint32_t resource_flags;
-	int opcode, size, since;
-	int len;
+	uint32_t id;
+	int i;
 
-	if (mask & WL_EVENT_HANGUP) {
-		wl_client_destroy(client);
-		return 1;
-	}
+	if (desc->num_objects == 0)
+		return true;
 
-	if (mask & WL_EVENT_ERROR) {
-		destroy_client_with_error(client, "socket error");
-		return 1;
+	for (i = 0; i < closure->count; i++) {
+		if (desc->types[i] != WL_ARG_OBJECT)
+			continue;
+
+		id = closure->args[i].n;
+		resource = id ? wl_map_lookup(&client->objects, id) : NULL;
+		if (id && resource == NULL)
+			return false;
+		closure->args[i].o = resource ? &resource->object : NULL;
 	}
 
-	if (mask & WL_EVENT_WRITABLE) {
-		len = wl_connection_flush(connection);
-		if (len < 0 && errno != EAGAIN) {
-			destroy_client_with_error(
-			    client, "failed to flush client connection");
-			return 1;
-		} else if (len >= 0) {
-			wl_event_source_fd_update(client->source,
-						  WL_EVENT_READABLE);
+	return true;
+}
+
+/* Forgets the pending events of the resource and the ones taking it as
+ * an object argument, before its id and its memory are reused. The
+ * events still to be taken were posted while the resource was alive,
+ * so they are taken first. */
+static void
+client_drop_posted(struct wl_client *client, struct wl_resource *resource)
+{
+	struct wl_posted_event *event;
+	const struct wl_message_desc *desc;
+	uint32_t id = resource->object.id;
+	int i;
+
+	client_take_posted(client);
+	for (event = client->posted_pending; event; event = event->next) {
+		if (event->resource == resource) {
+			event->resource = NULL;
+			continue;
 		}
-	}
 
-	len = 0;
-	if (mask & WL_EVENT_READABLE) {
-		len = wl_connection_read(connection);
-		if (len == 0 || (len < 0 && errno != EAGAIN)) {
-			destroy_client_with_error(
-			    client, "failed to read client connection");
-			return 1;
+		desc = event->closure->desc;
+		for (i = 0; desc->num_objects && i < event->closure->count; i++) {
+			if (desc->types[i] == WL_ARG_OBJECT &&
+			    event->closure->args[i].n == id) {
+				event->resource = NULL;
+				break;
+			}
 		}
 	}
+}
 
-	while (len >= 0 && (size_t) len >= sizeof p) {
-		wl_connection_copy(connection, p, sizeof p);
-		opcode = p[1] & 0xffff;
-		size = p[1] >> 16;
-		if (len < size)
-			break;
+/* Moves the events posted by other threads to the connection. Events
+ * whose resource, or one of its object arguments, was destroyed in the
+ * meantime are dropped. */
+static void
+client_splice_posted(struct wl_shard_task *task)
+{
+	struct wl_client *client;
+	struct wl_posted_event *event;
+	struct wl_resource *resource;
 
-		resource = wl_map_lookup(&client->objects, p[0]);
-		resource_flags = wl_map_lookup_flags(&client->objects, p[0]);
-		if (resource == NULL) {
-			wl_resource_post_error(client->display_resource,
-					       WL_DISPLAY_ERROR_INVALID_OBJECT,
-					       "invalid object %u", p[0]);
-			break;
+	client = wl_container_of(task, client, posted_task);
+	client_take_posted(client);
+	while ((event = client_next_posted(client))) {
+		resource = event->resource;
+		if (!client->error && resource &&
+		    posted_event_lookup_objects(event, client)) {
+			log_closure(resource, event->closure, true);
+			resource_end_coalescing(resource);
+			if (wl_closure_send_serialized(event->closure,
+						       client->connection,
+						       event->message,
+						       event->size,
+						       event->id, true))
+				client->error = true;
+			else
+				client_mark_dirty(client);
 		}
+		posted_event_destroy(event);
+	}
 
-		object = &resource->object;
-		if (opcode >= object->interface->method_count) {
-			wl_resource_post_error(client->display_resource,
-					       WL_DISPLAY_ERROR_INVALID_METHOD,
-					       "invalid method %d, object %s#%u",
-					       opcode,
-					       object->interface->name,
-					       object->id);
-			break;
-		}
+	arm_flush_timer(client);
+	client_check_output(client);
+}
 
-		message = &object->interface->methods[opcode];
-		since = wl_message_get_since(message);
-		if (!(resource_flags & WL_MAP_ENTRY_LEGACY) &&
-		    resource->version > 0 && resource->version < since) {
-			wl_resource_post_error(client->display_resource,
-					       WL_DISPLAY_ERROR_INVALID_METHOD,
-					       "invalid method %d (since %d < %d)"
-					       ", object %s#%u",
-					       opcode, resource->version, since,
-					       object->interface->name,
-					       object->id);
-			break;
-		}
+/** Post an event from any thread
+ *
+ * \param resource The resource object
+ * \param opcode The event opcode
+ * \param args The event arguments
+ * \return 0 on success, -1 on failure with errno set
+ *
+ * Unlike wl_resource_post_event_array(), which must be called from the
+ * thread dispatching the client, this may be called from any thread.
+ * The event is marshalled and serialized by the calling thread and
+ * pushed to a lock-free queue of the client. The thread of the client,
+ * see wl_client_get_event_loop(), is woken up when the queue was empty
+ * and moves the queued events to the connection in posting order,
+ * after the events posted from that thread in the meantime. They are
+ * flushed with the other events of the client.
+ *
+ * The resource and the resources passed as arguments must stay alive
+ * for the duration of the call. An event whose resource or object
+ * arguments are destroyed before it reaches the connection is dropped.
+ * Events creating objects can't be posted this way and fail with
+ * EINVAL.
+ *
+ * Protocol loggers see the event when it is moved to the connection.
+ *
+ * \memberof wl_resource
+ * \since 1.23.90
+ */
+WL_EXPORT int
+wl_resource_post_event_threadsafe_array(struct wl_resource *resource,
+					uint32_t opcode,
+					union wl_argument *args)
+{
+	struct wl_object *object = &resource->object;
+	const struct wl_message *message = &object->interface->events[opcode];
+	struct wl_client *client = resource->client;
+	struct wl_posted_event *event, *head;
+	struct wl_closure *closure;
+	const struct wl_message_desc *desc;
+	struct wl_object *arg;
+	size_t size;
+	int i, len;
 
+	desc = wl_message_get_desc(message);
+	if (desc == NULL)
+		return -1;
 
-		closure = wl_connection_demarshal(client->connection, size,
-						  &client->objects, message);
+	if (message_desc_has_new_id(desc) ||
+	    !verify_objects(resource, opcode, args)) {
+		errno = EINVAL;
+		return -1;
+	}
 
-		if (closure == NULL && errno == ENOMEM) {
-			wl_resource_post_no_memory(resource);
-			break;
-		} else if (closure == NULL ||
-			   wl_closure_lookup_objects(closure, &client->objects) < 0) {
-			wl_resource_post_error(client->display_resource,
-					       WL_DISPLAY_ERROR_INVALID_METHOD,
-					       "invalid arguments for %s#%u.%s",
-					       object->interface->name,
-					       object->id,
-					       message->name);
-			wl_closure_destroy(closure);
-			break;
-		}
+	closure = wl_closure_marshal(object, opcode, args, message);
+	if (closure == NULL)
+		return -1;
 
-		log_closure(resource, closure, false);
+	size = wl_closure_get_size(closure);
+	event = malloc(sizeof *event + size);
+	if (event == NULL)
+		goto err_closure;
 
-		if ((resource_flags & WL_MAP_ENTRY_LEGACY) ||
-		    resource->dispatcher == NULL) {
-			wl_closure_invoke(closure, WL_CLOSURE_INVOKE_SERVER,
-					  object, opcode, client);
-		} else {
-			wl_closure_dispatch(closure, resource->dispatcher,
-					    object, opcode);
-		}
+	len = wl_closure_serialize(closure, event->message, size);
+	if (len < 0)
+		goto err_event;
 
-		wl_closure_destroy(closure);
+	for (i = 0; desc->num_objects && i < closure->count; i++) {
+		if (desc->types[i] != WL_ARG_OBJECT)
+			continue;
+		arg = closure->args[i].o;
+		closure->args[i].n = arg ? arg->id : 0;
+	}
 
-		if (client->error)
-			break;
+	event->resource = resource;
+	event->id = object->id;
+	event->closure = closure;
+	event->size = len;
 
-		len = wl_connection_pending_input(connection);
-	}
+	head = __atomic_load_n(&client->posted, __ATOMIC_RELAXED);
+	do {
+		event->next = head;
+	} while (!__atomic_compare_exchange_n(&client->posted, &head, event,
+					      true, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
 
-	if (client->error) {
-		destroy_client_with_error(client,
-					  "error in client communication");
-	}
+	/* Only the first event of a batch wakes the client's thread */
+	if (head == NULL)
+		shard_post_task(client->shard, &client->posted_task);
 
-	return 1;
+	return 0;
+
+err_event:
+	free(event);
+err_closure:
+	wl_closure_destroy(closure);
+	return -1;
 }
 
-/** Flush pending events to the client
+/** Post an event from any thread
  *
- * \param client The client object
+ * \param resource The resource object
+ * \param opcode The event opcode
+ * \param ... The event arguments
+ * \return 0 on success, -1 on failure with errno set
  *
- * Events sent to clients are queued in a buffer and written to the
- * socket later - typically when the compositor has handled all
- * requests and goes back to block in the event loop.  This function
- * flushes all queued up events for a client immediately.
+ * \sa wl_resource_post_event_threadsafe_array()
  *
- * \memberof wl_client
+ * \memberof wl_resource
+ * \since 1.23.90
  */
-WL_EXPORT void
-wl_client_flush(struct wl_client *client)
+WL_EXPORT int
+wl_resource_post_event_threadsafe(struct wl_resource *resource,
+				  uint32_t opcode, ...)
 {
-	wl_connection_flush(client->connection);
+	union wl_argument args[WL_CLOSURE_MAX_ARGS];
+	struct wl_object *object = &resource->object;
+	va_list ap;
+
+	va_start(ap, opcode);
+	if (wl_argument_from_va_list(&object->interface->events[opcode],
+				     args, WL_CLOSURE_MAX_ARGS, ap) < 0) {
+		va_end(ap);
+		return -1;
+	}
+	va_end(ap);
+
+	return wl_resource_post_event_threadsafe_array(resource, opcode, args);
 }
 
-/** Get the display object for the given client
- *
- * \param client The client object
- * \return The display object the client is associated with.
- *
- * \memberof wl_client
- */
-WL_EXPORT struct wl_display *
-wl_client_get_display(struct wl_client *client)
+/* Starts dispatching a client created for a worker shard. */
+static void
+client_start(struct wl_shard_task *task)
 {
-	return client->display;
+	struct wl_client *client;
+
+	client = wl_container_of(task, client, start_task);
+	client->source =
+		wl_event_loop_add_fd(client->shard->loop,
+				     wl_connection_get_fd(client->connection),
+				     WL_EVENT_READABLE,
+				     wl_client_connection_data, client);
+	if (!client->source) {
+		destroy_client_with_error(client,
+					  "failed to add client to its loop");
+		return;
+	}
+
+	wl_list_insert(client->shard->clients.prev, &client->shard_link);
+	client_mark_dirty(client);
+
+	if (client->flush_deadline > 0 &&
+	    wl_client_set_flush_deadline(client, client->flush_deadline) < 0)
+		wl_log("failed to set flush deadline (pid %u)\n", client->pid);
 }
 
-static int
-bind_display(struct wl_client *client, struct wl_display *display);
+static struct wl_shard *
+display_pick_shard(struct wl_display *display)
+{
+	struct wl_shard *shard, *best = &display->main_shard;
+
+	pthread_mutex_lock(&display->mutex);
+	wl_list_for_each(shard, &display->shards, link) {
+		if (best == &display->main_shard ||
+		    shard->client_count < best->client_count)
+			best = shard;
+	}
+	best->client_count++;
+	pthread_mutex_unlock(&display->mutex);
+
+	return best;
+}
+
+struct client_create_guard {
+	struct wl_listener listener;
+	bool destroyed;
+};
+
+static void
+client_create_guard_notify(struct wl_listener *listener, void *data)
+{
+	struct client_create_guard *guard;
+
+	guard = wl_container_of(listener, guard, listener);
+	guard->destroyed = true;
+}
 
 /** Create a client for the given file descriptor
  *
@@ -534,6 +2676,10 @@ bind_display(struct wl_client *client, struct wl_display *display);
  * Listeners added with wl_display_add_client_created_listener() will
  * be notified by this function after the client is fully constructed.
  *
+ * If loops were added with wl_display_add_client_loop(), the client is
+ * then handed over to one of them, and must only be used from the
+ * thread dispatching that loop once this function returns.
+ *
  * On failure this function sets errno accordingly and returns NULL.
  *
  * On success, the new client object takes the ownership of the file
@@ -547,19 +2693,40 @@ WL_EXPORT struct wl_client *
 wl_client_create(struct wl_display *display, int fd)
 {
 	struct wl_client *client;
+	struct client_create_guard guard;
 
 	client = zalloc(sizeof *client);
 	if (client == NULL)
 		return NULL;
 
 	wl_priv_signal_init(&client->resource_created_signal);
+	wl_priv_signal_init(&client->congestion_signal);
+	wl_list_init(&client->backlog_link);
+	wl_list_init(&client->shard_link);
+	wl_list_init(&client->dirty_link);
+	wl_list_init(&client->start_task.link);
+	client->start_task.run = client_start;
+	wl_list_init(&client->posted_task.link);
+	client->posted_task.run = client_splice_posted;
+	client->posted_tail = &client->posted_pending;
+	wl_array_init(&client->visibility);
+	wl_array_init(&client->resource_counts);
+	wl_array_init(&client->coalesce);
+	wl_slab_init(&client->resource_slab, sizeof(struct wl_resource));
 	client->display = display;
-	client->source = wl_event_loop_add_fd(display->loop, fd,
-					      WL_EVENT_READABLE,
-					      wl_client_connection_data, client);
-
-	if (!client->source)
-		goto err_client;
+	client->shard = display_pick_shard(display);
+
+	/* Clients of worker shards are only added to their loop once
+	 * handed over, see client_start(). */
+	if (client->shard == &display->main_shard) {
+		client->source =
+			wl_event_loop_add_fd(display->loop, fd,
+					     WL_EVENT_READABLE,
+					     wl_client_connection_data,
+					     client);
+		if (!client->source)
+			goto err_client;
+	}
 
 	if (wl_os_socket_peercred(fd, &client->uid, &client->gid,
 				  &client->pid) != 0)
@@ -580,18 +2747,44 @@ wl_client_create(struct wl_display *display, int fd)
 	if (bind_display(client, display) < 0)
 		goto err_map;
 
+	pthread_mutex_lock(&display->mutex);
 	wl_list_insert(display->client_list.prev, &client->link);
+	pthread_mutex_unlock(&display->mutex);
+
+	if (client->shard == &display->main_shard) {
+		wl_list_insert(client->shard->clients.prev,
+			       &client->shard_link);
+		wl_priv_signal_emit(&display->create_client_signal, client);
+		return client;
+	}
+
+	guard.destroyed = false;
+	guard.listener.notify = client_create_guard_notify;
+	wl_client_add_destroy_listener(client, &guard.listener);
 
 	wl_priv_signal_emit(&display->create_client_signal, client);
 
+	/* Destroyed by a listener, nothing left to hand over */
+	if (guard.destroyed)
+		return client;
+
+	wl_list_remove(&guard.listener.link);
+	shard_post_task(client->shard, &client->start_task);
+
 	return client;
 
 err_map:
 	wl_map_release(&client->objects);
+	wl_slab_release(&client->resource_slab);
+	wl_array_release(&client->resource_counts);
 	wl_connection_destroy(client->connection);
 err_source:
-	wl_event_source_remove(client->source);
+	if (client->source)
+		wl_event_source_remove(client->source);
 err_client:
+	pthread_mutex_lock(&display->mutex);
+	client->shard->client_count--;
+	pthread_mutex_unlock(&display->mutex);
 	free(client);
 	return NULL;
 }
@@ -742,7 +2935,46 @@ resource_is_deprecated(struct wl_resource *resource)
 	if (wl_map_lookup_flags(map, id) & WL_MAP_ENTRY_LEGACY)
 		return true;
 
-	return false;
+	return false;
+}
+
+static int
+resource_count_add(struct wl_client *client, struct wl_resource *resource)
+{
+	struct resource_count *counts = client->resource_counts.data;
+	size_t n = client->resource_counts.size / sizeof *counts;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (counts[i].interface == resource->object.interface)
+			break;
+	}
+
+	if (i == n) {
+		counts = wl_array_add(&client->resource_counts,
+				      sizeof *counts);
+		if (counts == NULL)
+			return -1;
+
+		counts->interface = resource->object.interface;
+		counts->count = 0;
+		counts = client->resource_counts.data;
+	}
+
+	counts[i].count++;
+	resource->count_slot = i;
+	client->resource_count++;
+
+	return 0;
+}
+
+static void
+resource_count_remove(struct wl_client *client, struct wl_resource *resource)
+{
+	struct resource_count *counts = client->resource_counts.data;
+
+	counts[resource->count_slot].count--;
+	client->resource_count--;
 }
 
 /** Removes the wl_resource from the client's object map and deletes it.
@@ -783,8 +3015,17 @@ remove_and_destroy_resource(void *element, void *data, uint32_t flags)
 		wl_map_remove(&client->objects, id);
 	}
 
-	if (!(flags & WL_MAP_ENTRY_LEGACY))
-		free(resource);
+	if (client->coalesce.size > 0)
+		client_drop_coalesce_entries(client, resource);
+
+	if (client->posted_pending ||
+	    __atomic_load_n(&client->posted, __ATOMIC_RELAXED))
+		client_drop_posted(client, resource);
+
+	if (!(flags & WL_MAP_ENTRY_LEGACY)) {
+		resource_count_remove(client, resource);
+		wl_slab_free(&client->resource_slab, resource);
+	}
 
 	return WL_ITERATOR_CONTINUE;
 }
@@ -959,9 +3200,15 @@ wl_client_get_destroy_late_listener(struct wl_client *client,
 WL_EXPORT void
 wl_client_destroy(struct wl_client *client)
 {
+	struct wl_display *display = client->display;
+	struct wl_shard *shard = client->shard;
+	struct wl_posted_event *event;
+
+	pthread_mutex_lock(&display->mutex);
 
 	/* wl_client_destroy() should not be called twice for the same client. */
 	if (wl_list_empty(&client->link)) {
+		pthread_mutex_unlock(&display->mutex);
 		client->error = 1;
 		wl_log("wl_client_destroy: encountered re-entrant client destruction.\n");
 		return;
@@ -970,18 +3217,51 @@ wl_client_destroy(struct wl_client *client)
 	wl_list_remove(&client->link);
 	/* Keep the client link safe to inspect. */
 	wl_list_init(&client->link);
+	shard->client_count--;
+	pthread_mutex_unlock(&display->mutex);
+
+	pthread_mutex_lock(&shard->task_mutex);
+	wl_list_remove(&client->start_task.link);
+	wl_list_init(&client->start_task.link);
+	pthread_mutex_unlock(&shard->task_mutex);
+
+	wl_list_remove(&client->shard_link);
+	wl_list_init(&client->shard_link);
+	wl_list_remove(&client->dirty_link);
+	wl_list_init(&client->dirty_link);
+	wl_list_remove(&client->backlog_link);
+	wl_list_init(&client->backlog_link);
 
 	wl_priv_signal_final_emit(&client->destroy_signal, client);
 
-	wl_client_flush(client);
+	wl_connection_flush(client->connection);
 	wl_map_for_each(&client->objects, remove_and_destroy_resource, NULL);
 	wl_map_release(&client->objects);
-	wl_event_source_remove(client->source);
+
+	/* No event can be posted to the resources anymore */
+	pthread_mutex_lock(&shard->task_mutex);
+	wl_list_remove(&client->posted_task.link);
+	wl_list_init(&client->posted_task.link);
+	pthread_mutex_unlock(&shard->task_mutex);
+	client_take_posted(client);
+	while ((event = client_next_posted(client)))
+		posted_event_destroy(event);
+
+	/* All the resources are gone, drop their memory at once */
+	wl_slab_release(&client->resource_slab);
+	if (client->flush_timer)
+		wl_event_source_remove(client->flush_timer);
+	if (client->source)
+		wl_event_source_remove(client->source);
 	close(wl_connection_destroy(client->connection));
 
 	wl_priv_signal_final_emit(&client->destroy_late_signal, client);
 
 	wl_list_remove(&client->resource_created_signal.listener_list);
+	wl_list_remove(&client->congestion_signal.listener_list);
+	wl_array_release(&client->visibility);
+	wl_array_release(&client->resource_counts);
+	wl_array_release(&client->coalesce);
 
 	if (client->data_dtor)
 		client->data_dtor(client->data);
@@ -989,19 +3269,81 @@ wl_client_destroy(struct wl_client *client)
 	free(client);
 }
 
+enum global_visibility {
+	GLOBAL_VISIBILITY_UNKNOWN = 0,
+	GLOBAL_VISIBILITY_VISIBLE,
+	GLOBAL_VISIBILITY_HIDDEN,
+};
+
 /* Check if a global filter is registered and use it if any.
  *
  * If no wl_global filter has been registered, this function will
  * return true, allowing the wl_global to be visible to the wl_client
+ *
+ * The filter has to take the same decision for a client and a global
+ * until it is replaced, and global names are never reused, so its
+ * results are cached in the client.
  */
 static bool
 wl_global_is_visible(const struct wl_client *client,
 	      const struct wl_global *global)
 {
 	struct wl_display *display = client->display;
+	/* The cache is no observable state of the client */
+	struct wl_client *cached = (struct wl_client *) client;
+	uint8_t *visibility;
+	size_t size;
+	bool visible;
+
+	if (display->global_filter == NULL)
+		return true;
+
+	if (cached->visibility_generation != display->filter_generation) {
+		cached->visibility.size = 0;
+		cached->visibility_generation = display->filter_generation;
+	}
+
+	visibility = cached->visibility.data;
+	if (global->name < cached->visibility.size &&
+	    visibility[global->name] != GLOBAL_VISIBILITY_UNKNOWN)
+		return visibility[global->name] == GLOBAL_VISIBILITY_VISIBLE;
+
+	visible = display->global_filter(client, global,
+					 display->global_filter_data);
+
+	if (global->name >= cached->visibility.size) {
+		size = global->name + 1 - cached->visibility.size;
+		visibility = wl_array_add(&cached->visibility, size);
+		if (visibility == NULL)
+			return visible;
+		memset(visibility, GLOBAL_VISIBILITY_UNKNOWN, size);
+	}
+
+	visibility = cached->visibility.data;
+	visibility[global->name] = visible ? GLOBAL_VISIBILITY_VISIBLE :
+					     GLOBAL_VISIBILITY_HIDDEN;
+
+	return visible;
+}
 
-	return (display->global_filter == NULL ||
-		display->global_filter(client, global, display->global_filter_data));
+/* Called with the display mutex held */
+static struct wl_global *
+display_find_global(struct wl_display *display, uint32_t name)
+{
+	struct wl_global **table = display->global_table.data;
+
+	if (name >= display->global_table.size / sizeof *table)
+		return NULL;
+
+	return table[name];
+}
+
+/* Called with the display mutex held */
+static void
+global_unref(struct wl_global *global)
+{
+	if (--global->refs == 0 && global->destroyed)
+		free(global);
 }
 
 static void
@@ -1010,13 +3352,24 @@ registry_bind(struct wl_client *client,
 	      const char *interface, uint32_t version, uint32_t id)
 {
 	struct wl_global *global;
-	struct wl_display *display = resource->data;
-
-	wl_list_for_each(global, &display->global_list, link)
-		if (global->name == name)
-			break;
+	struct wl_registry_state *registry = resource->data;
+	struct wl_display *display = registry->display;
+	bool worker = client->shard != &display->main_shard;
+
+	/* The global may be destroyed by the display loop meanwhile, keep
+	 * it around until bound. On a worker shard, wl_global_destroy()
+	 * also waits for the bind, so that the user data of the global
+	 * can be freed right after it returns. */
+	pthread_mutex_lock(&display->mutex);
+	global = display_find_global(display, name);
+	if (global) {
+		global->refs++;
+		if (worker)
+			global->worker_binds++;
+	}
+	pthread_mutex_unlock(&display->mutex);
 
-	if (&global->link == &display->global_list)
+	if (global == NULL)
 		wl_resource_post_error(resource,
 				       WL_DISPLAY_ERROR_INVALID_OBJECT,
 				       "invalid global %s (%d)", interface, name);
@@ -1042,6 +3395,14 @@ registry_bind(struct wl_client *client,
 				       "invalid global %s (%d)", interface, name);
 	else
 		global->bind(client, global->data, version, id);
+
+	if (global) {
+		pthread_mutex_lock(&display->mutex);
+		if (worker && --global->worker_binds == 0)
+			pthread_cond_broadcast(&display->bind_cond);
+		global_unref(global);
+		pthread_mutex_unlock(&display->mutex);
+	}
 }
 
 static const struct wl_registry_interface registry_interface = {
@@ -1069,7 +3430,13 @@ display_sync(struct wl_client *client,
 static void
 unbind_resource(struct wl_resource *resource)
 {
+	struct wl_registry_state *registry = resource->data;
+
+	pthread_mutex_lock(&registry->display->mutex);
 	wl_list_remove(&resource->link);
+	pthread_mutex_unlock(&registry->display->mutex);
+
+	free(registry);
 }
 
 static void
@@ -1077,20 +3444,34 @@ display_get_registry(struct wl_client *client,
 		     struct wl_resource *resource, uint32_t id)
 {
 	struct wl_display *display = resource->data;
+	struct wl_registry_state *registry;
 	struct wl_resource *registry_resource;
 	struct wl_global *global;
 
+	registry = malloc(sizeof *registry);
+	if (registry == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
 	registry_resource =
 		wl_resource_create(client, &wl_registry_interface, 1, id);
 	if (registry_resource == NULL) {
+		free(registry);
 		wl_client_post_no_memory(client);
 		return;
 	}
 
+	registry->display = display;
 	wl_resource_set_implementation(registry_resource,
 				       &registry_interface,
-				       display, unbind_resource);
+				       registry, unbind_resource);
+
+	pthread_mutex_lock(&display->mutex);
 
+	/* Registry updates still queued for the client's shard skip the
+	 * globals announced here. */
+	registry->seq = display->global_seq;
 	wl_list_insert(&display->registry_resource_list,
 		       &registry_resource->link);
 
@@ -1101,6 +3482,8 @@ display_get_registry(struct wl_client *client,
 					       global->name,
 					       global->interface->name,
 					       global->version);
+
+	pthread_mutex_unlock(&display->mutex);
 }
 
 static const struct wl_display_interface display_interface = {
@@ -1187,6 +3570,17 @@ wl_display_create(void)
 	wl_list_init(&display->client_list);
 	wl_list_init(&display->registry_resource_list);
 	wl_list_init(&display->protocol_loggers);
+	wl_list_init(&display->shards);
+
+	pthread_mutex_init(&display->mutex, NULL);
+	pthread_cond_init(&display->bind_cond, NULL);
+	display->main_shard.display = display;
+	display->main_shard.loop = display->loop;
+	wl_list_init(&display->main_shard.clients);
+	wl_list_init(&display->main_shard.dirty);
+	wl_list_init(&display->main_shard.backlog);
+	if (shard_init_tasks(&display->main_shard) < 0)
+		goto err_tasks;
 
 	wl_priv_signal_init(&display->destroy_signal);
 	wl_priv_signal_init(&display->create_client_signal);
@@ -1197,11 +3591,17 @@ wl_display_create(void)
 	display->global_filter = NULL;
 	display->global_filter_data = NULL;
 	display->max_buffer_size = WL_BUFFER_DEFAULT_MAX_SIZE;
+	display->accept_limit = DEFAULT_ACCEPT_LIMIT;
 
 	wl_array_init(&display->additional_shm_formats);
+	wl_array_init(&display->global_table);
 
 	return display;
 
+err_tasks:
+	pthread_cond_destroy(&display->bind_cond);
+	pthread_mutex_destroy(&display->mutex);
+	wl_event_source_remove(display->term_source);
 err_term_source:
 	close(display->terminate_efd);
 err_eventfd:
@@ -1242,6 +3642,22 @@ wl_socket_alloc(void)
 	return s;
 }
 
+static void
+shard_destroy(struct wl_shard *shard)
+{
+	struct wl_shard_task *task;
+
+	/* Release what is left of the registry updates */
+	while ((task = shard_take_task(shard)))
+		task->run(task);
+
+	wl_event_source_remove(shard->check_source);
+	shard_fini_tasks(shard);
+	shard_release_request_profiles(shard);
+	wl_list_remove(&shard->link);
+	free(shard);
+}
+
 /** Destroy Wayland display object.
  *
  * \param display The Wayland display object which should be destroyed.
@@ -1260,6 +3676,7 @@ wl_display_destroy(struct wl_display *display)
 {
 	struct wl_socket *s, *next;
 	struct wl_global *global, *gnext;
+	struct wl_shard *shard, *snext;
 
 	wl_priv_signal_final_emit(&display->destroy_signal, display);
 
@@ -1269,13 +3686,27 @@ wl_display_destroy(struct wl_display *display)
 
 	close(display->terminate_efd);
 	wl_event_source_remove(display->term_source);
+	if (display->main_shard.check_source)
+		wl_event_source_remove(display->main_shard.check_source);
+	shard_fini_tasks(&display->main_shard);
+	shard_release_request_profiles(&display->main_shard);
+	if (display->flush_pool)
+		flush_pool_destroy(display->flush_pool,
+				   display->flush_pool->thread_count);
+
+	wl_list_for_each_safe(shard, snext, &display->shards, link)
+		shard_destroy(shard);
 
 	wl_event_loop_destroy(display->loop);
 
 	wl_list_for_each_safe(global, gnext, &display->global_list, link)
 		free(global);
 
+	pthread_cond_destroy(&display->bind_cond);
+	pthread_mutex_destroy(&display->mutex);
+
 	wl_array_release(&display->additional_shm_formats);
+	wl_array_release(&display->global_table);
 
 	wl_list_remove(&display->protocol_loggers);
 
@@ -1305,6 +3736,9 @@ wl_display_destroy(struct wl_display *display)
  * take the same decision given a client and a global. Not doing so will result
  * in inconsistent filtering and broken wl_registry event sequences.
  *
+ * The decisions are cached for each client and global until the filter is
+ * set again.
+ *
  * \memberof wl_display
  */
 WL_EXPORT void
@@ -1314,6 +3748,100 @@ wl_display_set_global_filter(struct wl_display *display,
 {
 	display->global_filter = filter;
 	display->global_filter_data = data;
+	display->filter_generation++;
+}
+
+struct registry_update {
+	struct wl_shard_task base;
+	struct wl_shard *shard;
+	struct wl_global *global;
+	uint32_t event;
+	/* The registries which didn't see the change yet, if set */
+	uint64_t seq;
+};
+
+static bool
+registry_update_filter(struct wl_resource *resource, void *data)
+{
+	struct registry_update *update = data;
+	struct wl_registry_state *registry = resource->data;
+
+	return resource->client->shard == update->shard &&
+		(update->seq == 0 || registry->seq < update->seq) &&
+		wl_global_is_visible(resource->client, update->global);
+}
+
+/* Sends the registry event to the registries of the shard. Called with
+ * the display mutex held. */
+static void
+registry_update_send(struct registry_update *update)
+{
+	struct wl_global *global = update->global;
+	union wl_argument args[3];
+
+	args[0].u = global->name;
+	args[1].s = global->interface->name;
+	args[2].u = global->version;
+	broadcast_event(&global->display->registry_resource_list,
+			update->event, args, registry_update_filter, update);
+}
+
+static void
+registry_update_run(struct wl_shard_task *task)
+{
+	struct registry_update *update;
+	struct wl_global *global;
+	struct wl_display *display;
+
+	update = wl_container_of(task, update, base);
+	global = update->global;
+	display = global->display;
+
+	pthread_mutex_lock(&display->mutex);
+	update->seq = update->event == WL_REGISTRY_GLOBAL ?
+		global->added_seq : global->removed_seq;
+	registry_update_send(update);
+	global_unref(global);
+	pthread_mutex_unlock(&display->mutex);
+
+	free(update);
+}
+
+/* Sends a registry event for a global to the clients of the main shard,
+ * and hands it over to the worker shards. Called with the display mutex
+ * held. */
+static void
+registry_broadcast(struct wl_global *global, uint32_t event)
+{
+	struct wl_display *display = global->display;
+	struct wl_shard *shard;
+	struct registry_update *update, direct = {
+		.shard = &display->main_shard,
+		.global = global,
+		.event = event,
+	};
+
+	registry_update_send(&direct);
+
+	wl_list_for_each(shard, &display->shards, link) {
+		if (shard->client_count == 0)
+			continue;
+
+		update = zalloc(sizeof *update);
+		if (update == NULL) {
+			wl_log("failed to queue registry update for "
+			       "global '%s#%"PRIu32"'\n",
+			       global->interface->name, global->name);
+			continue;
+		}
+
+		update->base.run = registry_update_run;
+		update->shard = shard;
+		update->global = global;
+		update->event = event;
+		global->refs++;
+		shard_post_task(shard, &update->base);
+	}
 }
 
 WL_EXPORT struct wl_global *
@@ -1321,8 +3849,7 @@ wl_global_create(struct wl_display *display,
 		 const struct wl_interface *interface, int version,
 		 void *data, wl_global_bind_func_t bind)
 {
-	struct wl_global *global;
-	struct wl_resource *resource;
+	struct wl_global *global, **entry = NULL;
 
 	if (version < 1) {
 		wl_log("wl_global_create: failing to create interface "
@@ -1338,14 +3865,32 @@ wl_global_create(struct wl_display *display,
 		return NULL;
 	}
 
+	global = zalloc(sizeof *global);
+	if (global == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&display->mutex);
+
 	if (display->next_global_name >= UINT32_MAX) {
+		pthread_mutex_unlock(&display->mutex);
+		free(global);
 		wl_log("wl_global_create: ran out of global names\n");
 		return NULL;
 	}
 
-	global = zalloc(sizeof *global);
-	if (global == NULL)
-		return NULL;
+	/* Names are handed out in order, the table grows one at a time */
+	while (display->global_table.size / sizeof global <=
+	       display->next_global_name) {
+		entry = wl_array_add(&display->global_table, sizeof global);
+		if (entry == NULL) {
+			pthread_mutex_unlock(&display->mutex);
+			free(global);
+			return NULL;
+		}
+		*entry = NULL;
+	}
+	entry = (struct wl_global **) display->global_table.data +
+		display->next_global_name;
 
 	global->display = display;
 	global->name = display->next_global_name++;
@@ -1354,15 +3899,13 @@ wl_global_create(struct wl_display *display,
 	global->data = data;
 	global->bind = bind;
 	global->removed = false;
+	global->added_seq = ++display->global_seq;
 	wl_list_insert(display->global_list.prev, &global->link);
+	*entry = global;
 
-	wl_list_for_each(resource, &display->registry_resource_list, link)
-		if (wl_global_is_visible(resource->client, global))
-			wl_resource_post_event(resource,
-					       WL_REGISTRY_GLOBAL,
-					       global->name,
-					       global->interface->name,
-					       global->version);
+	registry_broadcast(global, WL_REGISTRY_GLOBAL);
+
+	pthread_mutex_unlock(&display->mutex);
 
 	return global;
 }
@@ -1392,28 +3935,42 @@ WL_EXPORT void
 wl_global_remove(struct wl_global *global)
 {
 	struct wl_display *display = global->display;
-	struct wl_resource *resource;
 
 	if (global->removed)
 		wl_abort("wl_global_remove: called twice on the same "
 			 "global '%s#%"PRIu32"'", global->interface->name,
 			 global->name);
 
-	wl_list_for_each(resource, &display->registry_resource_list, link)
-		if (wl_global_is_visible(resource->client, global))
-			wl_resource_post_event(resource, WL_REGISTRY_GLOBAL_REMOVE,
-					       global->name);
-
+	pthread_mutex_lock(&display->mutex);
 	global->removed = true;
+	global->removed_seq = ++display->global_seq;
+	registry_broadcast(global, WL_REGISTRY_GLOBAL_REMOVE);
+	pthread_mutex_unlock(&display->mutex);
 }
 
 WL_EXPORT void
 wl_global_destroy(struct wl_global *global)
 {
+	struct wl_display *display = global->display;
+
 	if (!global->removed)
 		wl_global_remove(global);
+
+	pthread_mutex_lock(&display->mutex);
 	wl_list_remove(&global->link);
-	free(global);
+	((struct wl_global **) display->global_table.data)[global->name] = NULL;
+
+	/* No new bind can find the global, wait for the ones in progress on
+	 * other loops. Binds on the display loop can only be in progress if
+	 * called from their own bind handler. */
+	while (global->worker_binds > 0)
+		pthread_cond_wait(&display->bind_cond, &display->mutex);
+
+	if (global->refs == 0)
+		free(global);
+	else
+		global->destroyed = true;
+	pthread_mutex_unlock(&display->mutex);
 }
 
 WL_EXPORT const struct wl_interface *
@@ -1498,7 +4055,7 @@ wl_global_set_user_data(struct wl_global *global, void *data)
 WL_EXPORT uint32_t
 wl_display_get_serial(struct wl_display *display)
 {
-	return display->serial;
+	return __atomic_load_n(&display->serial, __ATOMIC_RELAXED);
 }
 
 /** Get the next serial number
@@ -1513,9 +4070,7 @@ wl_display_get_serial(struct wl_display *display)
 WL_EXPORT uint32_t
 wl_display_next_serial(struct wl_display *display)
 {
-	display->serial++;
-
-	return display->serial;
+	return __atomic_add_fetch(&display->serial, 1, __ATOMIC_RELAXED);
 }
 
 WL_EXPORT struct wl_event_loop *
@@ -1524,6 +4079,82 @@ wl_display_get_event_loop(struct wl_display *display)
 	return display->loop;
 }
 
+/** Dispatch clients from another event loop
+ *
+ * \param display The display object
+ * \param loop The event loop, to be dispatched by another thread
+ * \return 0 on success, -1 on failure
+ *
+ * Once a loop is added, the clients created by wl_client_create(),
+ * including the ones connecting to the display sockets, are no longer
+ * dispatched from the display loop but spread over the added loops,
+ * each new client going to the loop with the fewest clients. Each loop
+ * reads, dispatches and flushes its own clients, so that the loops can
+ * be run by separate threads. Clients created before stay on the
+ * display loop.
+ *
+ * The display loop keeps ownership of the globals: wl_global_create(),
+ * wl_global_remove() and wl_global_destroy() must be called from its
+ * thread, and the registry events are handed over to the other loops.
+ * Serials may be allocated from any thread. A client and its resources
+ * must only be used from the thread of its loop, see
+ * wl_client_get_event_loop(), or from the client created listeners,
+ * which run before the client is handed over. Events can be posted
+ * from other threads with wl_resource_post_event_threadsafe(). The
+ * global filter, the bind handlers and the client destroy listeners are
+ * called from the client's loop. wl_global_destroy() waits for the binds
+ * of the global in progress on other loops, so the user data of a global
+ * can be freed as soon as it returns. Bind handlers must hence not wait
+ * for the display loop.
+ *
+ * The loop must be added before it is dispatched, and must outlive the
+ * display. Protocol loggers and the global filter must be set before
+ * the loops are dispatched. The loops must no longer be dispatched when
+ * wl_display_destroy_clients() or wl_display_destroy() is called.
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT int
+wl_display_add_client_loop(struct wl_display *display,
+			   struct wl_event_loop *loop)
+{
+	struct wl_shard *shard;
+
+	shard = zalloc(sizeof *shard);
+	if (shard == NULL)
+		return -1;
+
+	shard->display = display;
+	shard->loop = loop;
+	wl_list_init(&shard->clients);
+	wl_list_init(&shard->dirty);
+	wl_list_init(&shard->backlog);
+
+	if (shard_init_tasks(shard) < 0)
+		goto err_shard;
+
+	shard->check_source = wl_event_loop_add_timer(loop,
+						      shard_post_dispatch,
+						      shard);
+	if (shard->check_source == NULL)
+		goto err_tasks;
+
+	wl_event_source_check(shard->check_source);
+
+	pthread_mutex_lock(&display->mutex);
+	wl_list_insert(display->shards.prev, &shard->link);
+	pthread_mutex_unlock(&display->mutex);
+
+	return 0;
+
+err_tasks:
+	shard_fini_tasks(shard);
+err_shard:
+	free(shard);
+	return -1;
+}
+
 WL_EXPORT void
 wl_display_terminate(struct wl_display *display)
 {
@@ -1550,24 +4181,233 @@ wl_display_run(struct wl_display *display)
 	}
 }
 
+/** Flush events to the clients of the display loop
+ *
+ * \param display The display object
+ *
+ * Only the clients events were posted to since the last call are
+ * flushed, the cost doesn't grow with the number of idle clients.
+ *
+ * Clients dispatched from loops added with wl_display_add_client_loop()
+ * are flushed by their own loop.
+ *
+ * \sa wl_display_get_flush_stats()
+ *
+ * \memberof wl_display
+ */
 WL_EXPORT void
 wl_display_flush_clients(struct wl_display *display)
 {
-	struct wl_client *client, *next;
-	int ret;
+	flush_shard_clients(&display->main_shard);
+}
 
-	wl_list_for_each_safe(client, next, &display->client_list, link) {
-		ret = wl_connection_flush(client->connection);
-		if (ret < 0 && errno == EAGAIN) {
-			wl_event_source_fd_update(client->source,
-						  WL_EVENT_WRITABLE |
-						  WL_EVENT_READABLE);
-		} else if (ret < 0) {
-			wl_client_destroy(client);
+/** Flush clients from several threads
+ *
+ * \param display The display object
+ * \param threads The number of threads helping the display thread, or 0
+ * \return 0 on success, -1 on failure
+ *
+ * By default, wl_display_flush_clients() writes the events of each
+ * client to its socket in turn. With flush threads, the connections of
+ * the clients to flush are handed over to \a threads threads created for
+ * the purpose, which write them in parallel with the display thread.
+ * wl_display_flush_clients() returns once they are all written, and
+ * the clients found full or dead are then handled from the display
+ * thread as usual. Flushes of fewer than 16 clients don't wake the
+ * threads up.
+ *
+ * This only pays off when many clients get events at once and the
+ * threads have cores to run on. Clients of loops added with
+ * wl_display_add_client_loop() are still flushed by their own loop.
+ *
+ * Setting 0 threads stops the ones created before.
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT int
+wl_display_set_flush_threads(struct wl_display *display, uint32_t threads)
+{
+	struct wl_flush_pool *pool = NULL;
+
+	if (threads > 0) {
+		pool = flush_pool_create(threads);
+		if (pool == NULL)
+			return -1;
+	}
+
+	if (display->flush_pool)
+		flush_pool_destroy(display->flush_pool,
+				   display->flush_pool->thread_count);
+	display->flush_pool = pool;
+
+	return 0;
+}
+
+static void
+add_flush_stats(struct wl_display_flush_stats *stats, struct wl_shard *shard)
+{
+	stats->flushes += __atomic_load_n(&shard->flush_stats.flushes,
+					  __ATOMIC_RELAXED);
+	stats->clients_flushed +=
+		__atomic_load_n(&shard->flush_stats.clients_flushed,
+				__ATOMIC_RELAXED);
+}
+
+/** Get flush statistics of the display
+ *
+ * \param display The display object
+ * \param stats Returns the statistics
+ *
+ * Reports how many times the clients were flushed, by
+ * wl_display_flush_clients() or by the loops added with
+ * wl_display_add_client_loop(), and the total number of client
+ * connections flushed then.
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_display_get_flush_stats(struct wl_display *display,
+			   struct wl_display_flush_stats *stats)
+{
+	struct wl_shard *shard;
+
+	stats->flushes = 0;
+	stats->clients_flushed = 0;
+	add_flush_stats(stats, &display->main_shard);
+
+	pthread_mutex_lock(&display->mutex);
+	wl_list_for_each(shard, &display->shards, link)
+		add_flush_stats(stats, shard);
+	pthread_mutex_unlock(&display->mutex);
+}
+
+/** Profile the request handlers
+ *
+ * \param display The display object
+ * \param enabled Whether to profile the requests
+ *
+ * While profiling is enabled, the time spent in the handler of each
+ * request dispatched is measured with the monotonic clock and accounted
+ * to its interface and opcode, see wl_display_for_each_request_profile(),
+ * and to its client, see wl_client_get_request_profile(). Profiling is
+ * disabled by default, and then only costs a branch per request.
+ *
+ * Loops added with wl_display_add_client_loop() start or stop profiling
+ * as they next dispatch a client. The profiles are kept when profiling
+ * is disabled.
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_display_set_request_profiling(struct wl_display *display, bool enabled)
+{
+	__atomic_store_n(&display->request_profiling, enabled,
+			 __ATOMIC_RELAXED);
+}
+
+struct request_profile_entry {
+	const struct wl_interface *interface;
+	uint32_t opcode;
+	struct wl_request_profile profile;
+};
+
+static struct request_profile_entry *
+request_profile_entry_get(struct wl_array *entries,
+			  const struct wl_interface *interface,
+			  uint32_t opcode)
+{
+	struct request_profile_entry *entry;
+
+	wl_array_for_each(entry, entries) {
+		if (entry->interface == interface && entry->opcode == opcode)
+			return entry;
+	}
+
+	entry = wl_array_add(entries, sizeof *entry);
+	if (entry == NULL)
+		return NULL;
+
+	memset(entry, 0, sizeof *entry);
+	entry->interface = interface;
+	entry->opcode = opcode;
+
+	return entry;
+}
+
+/* Adds the profiles of the shard to the entries, merging those of the
+ * same request */
+static void
+collect_request_profiles(struct wl_array *entries, struct wl_shard *shard)
+{
+	struct request_profiles *profiles;
+	struct request_profile_entry *entry;
+	int i, opcode;
+
+	for (i = 0; i < REQUEST_PROFILE_HASH_SIZE; i++) {
+		profiles = __atomic_load_n(&shard->request_profiles[i],
+					   __ATOMIC_ACQUIRE);
+		for (; profiles; profiles = profiles->next) {
+			for (opcode = 0;
+			     opcode < profiles->interface->method_count;
+			     opcode++) {
+				if (__atomic_load_n(&profiles->requests[opcode].count,
+						    __ATOMIC_RELAXED) == 0)
+					continue;
+				entry = request_profile_entry_get(entries,
+					profiles->interface, opcode);
+				if (entry == NULL)
+					return;
+				request_profile_merge(&entry->profile,
+						      &profiles->requests[opcode]);
+			}
 		}
 	}
 }
 
+/** Iterate over the request profiles of the display
+ *
+ * \param display The display object
+ * \param func The function called for each profile
+ * \param user_data The user data pointer
+ *
+ * Calls \a func with the profile of each request of an interface that
+ * was dispatched while profiling was enabled, summed over the loops
+ * dispatching clients. In a profile, the handler durations are counted
+ * in buckets growing by powers of two: bucket i counts the requests
+ * whose handler took less than 2^i nanoseconds and at least 2^(i-1),
+ * bucket 0 those measured as instant and the last one all the longer
+ * ones.
+ *
+ * \sa wl_display_set_request_profiling()
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_display_for_each_request_profile(struct wl_display *display,
+				    wl_display_request_profile_func_t func,
+				    void *user_data)
+{
+	struct request_profile_entry *entry;
+	struct wl_shard *shard;
+	struct wl_array entries;
+
+	wl_array_init(&entries);
+	collect_request_profiles(&entries, &display->main_shard);
+	pthread_mutex_lock(&display->mutex);
+	wl_list_for_each(shard, &display->shards, link)
+		collect_request_profiles(&entries, shard);
+	pthread_mutex_unlock(&display->mutex);
+
+	wl_array_for_each(entry, &entries)
+		func(entry->interface, entry->opcode, &entry->profile,
+		     user_data);
+	wl_array_release(&entries);
+}
+
 /** Destroy all clients connected to the display
  *
  * \param display The display object
@@ -1637,26 +4477,69 @@ wl_display_set_default_max_buffer_size(struct wl_display *display,
 	display->max_buffer_size = max_buffer_size;
 }
 
+/** Set the number of connections accepted at once
+ *
+ * \param display The display object
+ * \param limit The number of connections, or 0 for no limit
+ *
+ * When a listening socket of the display becomes readable, the pending
+ * connections are accepted until none is left or \a limit of them were,
+ * so that many clients connecting at once only take a few event loop
+ * iterations. Any left over are accepted on the next iteration. The
+ * default limit is 16.
+ *
+ * \memberof wl_display
+ * \since 1.23.90
+ */
+WL_EXPORT void
+wl_display_set_accept_limit(struct wl_display *display, uint32_t limit)
+{
+	display->accept_limit = limit;
+}
+
 static int
 socket_data(int fd, uint32_t mask, void *data)
 {
 	struct wl_display *display = data;
 	struct sockaddr_un name;
 	socklen_t length;
+	uint32_t accepted;
 	int client_fd;
 
-	length = sizeof name;
-	client_fd = wl_os_accept_cloexec(fd, (struct sockaddr *) &name,
-					 &length);
-	if (client_fd < 0)
-		wl_log("failed to accept: %s\n", strerror(errno));
-	else
+	/* The listening socket is non-blocking, accept until it is empty */
+	for (accepted = 0; display->accept_limit == 0 ||
+	     accepted < display->accept_limit; accepted++) {
+		length = sizeof name;
+		client_fd = wl_os_accept_cloexec(fd, (struct sockaddr *) &name,
+						 &length);
+		if (client_fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			wl_log("failed to accept: %s\n", strerror(errno));
+			break;
+		}
+
 		if (!wl_client_create(display, client_fd))
 			close(client_fd);
+	}
 
 	return 1;
 }
 
+static int
+set_nonblocking(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 static int
 wl_socket_lock(struct wl_socket *socket)
 {
@@ -1769,6 +4652,12 @@ _wl_display_add_socket(struct wl_display *display, struct wl_socket *s)
 		return -1;
 	}
 
+	if (set_nonblocking(s->fd) < 0) {
+		wl_log("failed to make socket non-blocking: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+
 	s->source = wl_event_loop_add_fd(display->loop, s->fd,
 					 WL_EVENT_READABLE,
 					 socket_data, display);
@@ -1830,7 +4719,8 @@ wl_display_add_socket_auto(struct wl_display *display)
  * with both bind() and listen() already called.
  *
  * On success, the socket fd ownership is transferred to libwayland:
- * libwayland will close the socket when the display is destroyed.
+ * libwayland will close the socket when the display is destroyed. The fd
+ * is made non-blocking.
  *
  * \memberof wl_display
  */
@@ -1845,6 +4735,9 @@ wl_display_add_socket_fd(struct wl_display *display, int sock_fd)
 		return -1;
 	}
 
+	if (set_nonblocking(sock_fd) < 0)
+		return -1;
+
 	s = wl_socket_alloc();
 	if (s == NULL)
 		return -1;
@@ -1999,14 +4892,14 @@ wl_resource_create(struct wl_client *client,
 {
 	struct wl_resource *resource;
 
-	resource = zalloc(sizeof *resource);
+	resource = wl_slab_alloc(&client->resource_slab);
 	if (resource == NULL)
 		return NULL;
 
 	if (id == 0) {
 		id = wl_map_insert_new(&client->objects, 0, NULL);
 		if (id == 0) {
-			free(resource);
+			wl_slab_free(&client->resource_slab, resource);
 			return NULL;
 		}
 	}
@@ -2024,13 +4917,19 @@ wl_resource_create(struct wl_client *client,
 	resource->version = version;
 	resource->dispatcher = NULL;
 
+	if (resource_count_add(client, resource) < 0) {
+		wl_slab_free(&client->resource_slab, resource);
+		return NULL;
+	}
+
 	if (wl_map_insert_at(&client->objects, 0, id, resource) < 0) {
 		if (errno == EINVAL) {
 			wl_resource_post_error(client->display_resource,
 					       WL_DISPLAY_ERROR_INVALID_OBJECT,
 					       "invalid new id %d", id);
 		}
-		free(resource);
+		resource_count_remove(client, resource);
+		wl_slab_free(&client->resource_slab, resource);
 		return NULL;
 	}
 
@@ -49,6 +49,7 @@
 #include "wayland-util.h"
 #include "wayland-private.h"
 #include "wayland-server.h"
+#include "wayland-server-private.h"
 
 /* This once_t is used to synchronize installing the SIGBUS handler
  * and creating the TLS key. This will be done in the first call
@@ -134,6 +135,10 @@ shm_pool_finish_resize(struct wl_shm_pool *pool)
 		return;
 	}
 
+	if (pool->resource != NULL)
+		wl_client_account_shm_pool(wl_resource_get_client(pool->resource),
+					   0, pool->new_size - pool->size);
+
 	pool->data = data;
 	pool->size = pool->new_size;
 }
@@ -265,6 +270,8 @@ destroy_pool(struct wl_resource *resource)
 {
 	struct wl_shm_pool *pool = wl_resource_get_user_data(resource);
 
+	wl_client_account_shm_pool(wl_resource_get_client(resource),
+				   -1, -pool->size);
 	pool->resource = NULL;
 	shm_pool_unref(pool, false);
 }
@@ -377,6 +384,7 @@ shm_create_pool(struct wl_client *client, struct wl_resource *resource,
 	wl_resource_set_implementation(pool->resource,
 				       &shm_pool_interface,
 				       pool, destroy_pool);
+	wl_client_account_shm_pool(client, 1, pool->size);
 
 	return;
 
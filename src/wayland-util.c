@@ -446,6 +446,111 @@ wl_map_for_each(struct wl_map *map, wl_iterator_func_t func, void *data)
 		for_each_helper(&map->server_entries, func, data);
 }
 
+/* GCC defines __SANITIZE_ADDRESS__, clang has __has_feature() */
+#if defined(__SANITIZE_ADDRESS__)
+#define WL_HAVE_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define WL_HAVE_ASAN 1
+#endif
+#endif
+
+/* Let AddressSanitizer catch uses of freed slab objects */
+#ifdef WL_HAVE_ASAN
+#include <sanitizer/asan_interface.h>
+#define slab_poison(object, size) ASAN_POISON_MEMORY_REGION(object, size)
+#define slab_unpoison(object, size) ASAN_UNPOISON_MEMORY_REGION(object, size)
+#else
+#define slab_poison(object, size) ((void) (object), (void) (size))
+#define slab_unpoison(object, size) ((void) (object), (void) (size))
+#endif
+
+/* Objects of the first chunk of a slab, doubling for each new chunk up
+ * to the maximum */
+#define SLAB_MIN_CHUNK_OBJECTS 8
+#define SLAB_MAX_CHUNK_OBJECTS 512
+#define SLAB_ALIGN 16
+
+struct wl_slab_chunk {
+	struct wl_slab_chunk *next;
+	/* Keeps the objects following the header aligned */
+	char padding[SLAB_ALIGN - sizeof(struct wl_slab_chunk *)];
+	char objects[];
+};
+
+void
+wl_slab_init(struct wl_slab *slab, size_t object_size)
+{
+	if (object_size < sizeof(void *))
+		object_size = sizeof(void *);
+
+	slab->object_size = (object_size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	slab->chunks = NULL;
+	slab->chunk_objects = SLAB_MIN_CHUNK_OBJECTS;
+	slab->free_list = NULL;
+	slab->next = NULL;
+	slab->end = NULL;
+	slab->size = 0;
+}
+
+void *
+wl_slab_alloc(struct wl_slab *slab)
+{
+	struct wl_slab_chunk *chunk;
+	void *object;
+
+	if (slab->free_list) {
+		object = slab->free_list;
+		slab_unpoison(object, slab->object_size);
+		slab->free_list = *(void **) object;
+	} else {
+		if (slab->next == slab->end) {
+			chunk = malloc(sizeof *chunk +
+				       slab->chunk_objects * slab->object_size);
+			if (chunk == NULL)
+				return NULL;
+
+			chunk->next = slab->chunks;
+			slab->chunks = chunk;
+			slab->size += sizeof *chunk +
+				slab->chunk_objects * slab->object_size;
+			slab->next = chunk->objects;
+			slab->end = chunk->objects +
+				slab->chunk_objects * slab->object_size;
+			if (slab->chunk_objects < SLAB_MAX_CHUNK_OBJECTS)
+				slab->chunk_objects *= 2;
+		}
+
+		object = slab->next;
+		slab->next += slab->object_size;
+	}
+
+	memset(object, 0, slab->object_size);
+
+	return object;
+}
+
+void
+wl_slab_free(struct wl_slab *slab, void *object)
+{
+	*(void **) object = slab->free_list;
+	slab->free_list = object;
+	slab_poison(object, slab->object_size);
+}
+
+void
+wl_slab_release(struct wl_slab *slab)
+{
+	struct wl_slab_chunk *chunk, *next;
+
+	for (chunk = slab->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	wl_slab_init(slab, slab->object_size);
+}
+
 static void
 wl_log_stderr_handler(const char *fmt, va_list arg)
 {
@@ -0,0 +1,220 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Timing loops for the closure and connection code. These are not part of the unit
+ * suite; run them with "meson test --benchmark". */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "wayland-private.h"
+#include "test-runner.h"
+
+static uint64_t
+timespec_to_nsec(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void
+count_uu_handler(void *data, struct wl_object *object,
+		 uint32_t u1, uint32_t u2)
+{
+	uint64_t *sum = data;
+
+	*sum += u1 + u2;
+}
+
+static void
+count_ou_handler(void *data, struct wl_object *object,
+		 struct wl_object *o, uint32_t u)
+{
+	uint64_t *sum = data;
+
+	*sum += o->id + u;
+}
+
+static void
+count_uuuuu_handler(void *data, struct wl_object *object, uint32_t u1,
+		    uint32_t u2, uint32_t u3, uint32_t u4, uint32_t u5)
+{
+	uint64_t *sum = data;
+
+	*sum += u1 + u2 + u3 + u4 + u5;
+}
+
+static void
+count_ouuuu_handler(void *data, struct wl_object *object, struct wl_object *o,
+		    uint32_t u1, uint32_t u2, uint32_t u3, uint32_t u4)
+{
+	uint64_t *sum = data;
+
+	*sum += o->id + u1 + u2 + u3 + u4;
+}
+
+static void
+count_uff_handler(void *data, struct wl_object *object,
+		  uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+	uint64_t *sum = data;
+
+	*sum += time + (int64_t) x + y;
+}
+
+static void
+invoke_many(const char *format, void *handler, union wl_argument *args,
+	    uint64_t per_event)
+{
+	struct wl_closure *closure;
+	static struct wl_object sender = { NULL, NULL, 1234 };
+	struct wl_object object = { NULL, &handler, 0 };
+	struct wl_message message = { "test", format, NULL };
+	const int events = 100000;
+	struct timespec start, end;
+	uint64_t sum = 0;
+	int i;
+
+	closure = wl_closure_marshal(&sender, 0, args, &message);
+	assert(closure);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < events; i++)
+		wl_closure_invoke(closure, WL_CLOSURE_INVOKE_SERVER,
+				  &object, 0, &sum);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	assert(sum == per_event * events);
+
+	fprintf(stderr, "invoked %d \"%s\" events, %.1f ns per event\n",
+		events, format,
+		(double) (timespec_to_nsec(&end) - timespec_to_nsec(&start)) /
+		events);
+
+	wl_closure_destroy(closure);
+}
+
+TEST(invoke_closure_cost)
+{
+	struct wl_object object = { NULL, NULL, 7 };
+
+	invoke_many("uu", count_uu_handler,
+		    (union wl_argument[]) { { .u = 1 }, { .u = 2 } }, 3);
+	invoke_many("ou", count_ou_handler,
+		    (union wl_argument[]) { { .o = &object }, { .u = 2 } }, 9);
+	invoke_many("uuuuu", count_uuuuu_handler,
+		    (union wl_argument[]) {
+			{ .u = 1 }, { .u = 2 }, { .u = 3 }, { .u = 4 }, { .u = 5 }
+		    }, 15);
+	invoke_many("uff", count_uff_handler,
+		    (union wl_argument[]) {
+			{ .u = 1 }, { .f = wl_fixed_from_int(-1) },
+			{ .f = wl_fixed_from_int(-2) }
+		    }, 1 - 3 * 256);
+	/* No trampoline for this one, it goes through libffi */
+	invoke_many("ouuuu", count_ouuuu_handler,
+		    (union wl_argument[]) {
+			{ .o = &object }, { .u = 2 }, { .u = 3 }, { .u = 4 },
+			{ .u = 5 }
+		    }, 21);
+}
+
+/* Sends bursts of 2 KiB messages through the same pair of connections,
+ * once the buffers have grown to the size of a burst */
+static void
+burst_many(int messages, int rounds)
+{
+	struct wl_connection *read_connection, *write_connection;
+	struct wl_message message = { "test", "a", NULL };
+	static struct wl_object sender = { NULL, NULL, 400200 };
+	static uint8_t payload[2048 - 12];
+	struct wl_array array = { sizeof payload, 0, payload };
+	const int size = 12 + sizeof payload;
+	struct wl_closure *closure, *received;
+	struct wl_map objects;
+	struct timespec start, end;
+	uint64_t elapsed = 0;
+	int round, i, len, s[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	read_connection = wl_connection_create(s[0], 1 << 20);
+	assert(read_connection);
+	write_connection = wl_connection_create(s[1], 1 << 20);
+	assert(write_connection);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+
+	closure = wl_closure_marshal(&sender, 0, (union wl_argument[]) {
+					{ .a = &array }
+				     }, &message);
+	assert(closure);
+
+	/* The first round only grows the buffers */
+	for (round = 0; round <= rounds; round++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < messages; i++)
+			assert(wl_closure_send(closure,
+					       write_connection) == 0);
+		for (len = 0; len < messages * size; ) {
+			assert(wl_connection_flush(write_connection) >= 0 ||
+			       errno == EAGAIN);
+			len = wl_connection_read(read_connection);
+			assert(len >= 0 || errno == EAGAIN);
+		}
+		for (i = 0; i < messages; i++) {
+			received = wl_connection_demarshal(read_connection,
+							   size, &objects,
+							   &message);
+			assert(received);
+			wl_closure_destroy(received);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (round > 0)
+			elapsed += timespec_to_nsec(&end) -
+				   timespec_to_nsec(&start);
+	}
+
+	fprintf(stderr, "bursts of %d KiB: %.0f ns per burst, "
+		"%zu bytes of buffers\n", messages * size / 1024,
+		(double) elapsed / rounds,
+		wl_connection_get_buffer_bytes(read_connection) +
+		wl_connection_get_buffer_bytes(write_connection));
+
+	wl_closure_destroy(closure);
+	wl_map_release(&objects);
+	close(wl_connection_destroy(read_connection));
+	close(wl_connection_destroy(write_connection));
+}
+
+TEST(connection_burst_bench)
+{
+	/* Heap allocated buffers, then mirrored ones */
+	burst_many(8, 2000);
+	burst_many(64, 500);
+}
@@ -23,6 +23,9 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,14 +36,19 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <poll.h>
+#include <time.h>
 
 #include "wayland-private.h"
 #include "test-runner.h"
 #include "test-compositor.h"
 
+extern ssize_t (*wl_sendmsg)(int socket, const struct msghdr *message,
+			     int flags);
+
 static const char message[] = "Hello, world";
 
 static struct wl_connection *
@@ -133,9 +141,10 @@ TEST(connection_queue)
 static void
 va_list_wrapper(const char *signature, union wl_argument *args, int count, ...)
 {
+	struct wl_message message = { "test", signature, NULL };
 	va_list ap;
 	va_start(ap, count);
-	wl_argument_from_va_list(signature, args, count, ap);
+	assert(wl_argument_from_va_list(&message, args, count, ap) == 0);
 	va_end(ap);
 }
 
@@ -543,6 +552,294 @@ TEST(connection_marshal_demarshal)
 	release_marshal_data(&data);
 }
 
+TEST(connection_demarshal_closure_pool)
+{
+	struct marshal_data data;
+	struct wl_message message = { "test", "usu", NULL };
+	struct wl_closure_pool_stats stats;
+	struct wl_closure *closure;
+	struct wl_map objects;
+	static const char text[] = "recycled";
+	uint32_t msg[8];
+	int size = sizeof msg, i;
+
+	setup_marshal_data(&data);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+
+	msg[0] = 400200;	/* object id */
+	msg[1] = size << 16;	/* size = 32, opcode = 0 */
+	msg[2] = 1;
+	msg[3] = sizeof text;
+	memset(&msg[4], 0, 12);
+	memcpy(&msg[4], text, sizeof text);
+	msg[7] = 2;
+
+	for (i = 0; i < 100; i++) {
+		assert(write(data.s[1], msg, size) == size);
+		assert(wl_connection_read(data.read_connection) == size);
+		closure = wl_connection_demarshal(data.read_connection,
+						  size, &objects, &message);
+		assert(closure);
+		assert(closure->count == 3);
+		assert(closure->args[0].u == 1);
+		assert(strcmp(closure->args[1].s, text) == 0);
+		assert(closure->args[2].u == 2);
+		wl_closure_destroy(closure);
+	}
+
+	wl_connection_get_closure_pool_stats(data.read_connection, &stats);
+	assert(stats.allocated == 100);
+	assert(stats.recycled == 99);
+	assert(stats.cached == 1);
+
+	wl_map_release(&objects);
+	release_marshal_data(&data);
+}
+
+static void
+write_array_message(int fd, uint32_t *msg, int size, uint8_t seed)
+{
+	uint8_t *data = (uint8_t *) &msg[3];
+	int i;
+
+	msg[0] = 400200;	/* object id */
+	msg[1] = size << 16;	/* opcode = 0 */
+	msg[2] = size - 12;
+	for (i = 0; i < size - 12; i++)
+		data[i] = seed + i;
+
+	assert(write(fd, msg, size) == size);
+}
+
+/* Whether the array of a closure demarshalled from an "a" message points
+ * into the payload copied after the closure. */
+static bool
+array_is_copied(struct wl_closure *closure)
+{
+	/* The payload follows the argument and array headers and the array
+	 * data follows the message header and the array length. */
+	char *payload = (char *) (closure->args + 1) + sizeof(struct wl_array);
+
+	return closure->args[0].a->data == payload + 3 * sizeof(uint32_t);
+}
+
+static bool
+array_matches(struct wl_array *array, int size, uint8_t seed)
+{
+	uint8_t *data = array->data;
+	int i;
+
+	if ((int) array->size != size)
+		return false;
+
+	for (i = 0; i < size; i++)
+		if (data[i] != (uint8_t) (seed + i))
+			return false;
+
+	return true;
+}
+
+TEST(connection_demarshal_in_place)
+{
+	struct marshal_data data;
+	struct wl_message message = { "test", "a", NULL };
+	struct wl_closure *first, *second;
+	struct wl_map objects;
+	/* Two of these don't fit in the input buffer at once */
+	const int size = 3004;
+	uint32_t msg[3004 / 4];
+
+	setup_marshal_data(&data);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+
+	write_array_message(data.s[1], msg, size, 1);
+	assert(wl_connection_read(data.read_connection) == size);
+	first = wl_connection_demarshal_in_place(data.read_connection, size,
+						 &objects, &message);
+	assert(first);
+	assert(array_matches(first->args[0].a, size - 12, 1));
+
+	assert(!array_is_copied(first));
+
+	/* Only the space not referenced by the first closure is filled */
+	write_array_message(data.s[1], msg, size, 2);
+	assert(wl_connection_read(data.read_connection) == 4096 - size);
+	assert(array_matches(first->args[0].a, size - 12, 1));
+	wl_closure_destroy(first);
+
+	/* The rest is read once the first closure is gone. The second
+	 * message wraps around the end of the buffer and is copied. */
+	assert(wl_connection_read(data.read_connection) == size);
+	second = wl_connection_demarshal_in_place(data.read_connection, size,
+						  &objects, &message);
+	assert(second);
+	assert(array_matches(second->args[0].a, size - 12, 2));
+	assert(array_is_copied(second));
+	wl_closure_destroy(second);
+
+	wl_map_release(&objects);
+	release_marshal_data(&data);
+}
+
+TEST(connection_buffers_drained)
+{
+	struct marshal_data data;
+	struct wl_message array_message = { "test", "a", NULL };
+	struct wl_message fd_message = { "test", "h", NULL };
+	static struct wl_object sender = { NULL, NULL, 400200 };
+	struct wl_closure *closure;
+	struct wl_map objects;
+	uint32_t msg[20000 / 4];
+	size_t grown, bytes;
+	int fds[2], i;
+
+	assert(socketpair(AF_UNIX,
+			  SOCK_STREAM | SOCK_CLOEXEC, 0, data.s) == 0);
+	data.read_connection = wl_connection_create(data.s[0], 1 << 16);
+	assert(data.read_connection);
+	data.write_connection = wl_connection_create(data.s[1], 1 << 16);
+	assert(data.write_connection);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+
+	/* Buffers are only allocated once used, and kept once drained */
+	assert(wl_connection_get_buffer_bytes(data.read_connection) == 0);
+	assert(wl_connection_get_buffer_bytes(data.write_connection) == 0);
+
+	assert(wl_connection_write(data.write_connection, message,
+				   sizeof message) == 0);
+	assert(wl_connection_get_buffer_bytes(data.write_connection) ==
+	       WL_BUFFER_DEFAULT_MAX_SIZE);
+	assert(wl_connection_flush(data.write_connection) == sizeof message);
+	assert(wl_connection_get_buffer_bytes(data.write_connection) ==
+	       WL_BUFFER_DEFAULT_MAX_SIZE);
+
+	assert(wl_connection_read(data.read_connection) == sizeof message);
+	assert(wl_connection_get_buffer_bytes(data.read_connection) ==
+	       WL_BUFFER_DEFAULT_MAX_SIZE);
+	wl_connection_consume(data.read_connection, sizeof message);
+	assert(wl_connection_get_buffer_bytes(data.read_connection) ==
+	       WL_BUFFER_DEFAULT_MAX_SIZE);
+
+	/* Buffers grown by a burst keep their size for the next one */
+	write_array_message(data.s[1], msg, sizeof msg, 1);
+	assert(wl_connection_read(data.read_connection) == sizeof msg);
+	grown = wl_connection_get_buffer_bytes(data.read_connection);
+	assert(grown >= sizeof msg);
+	closure = wl_connection_demarshal(data.read_connection, sizeof msg,
+					  &objects, &array_message);
+	assert(closure);
+	wl_closure_destroy(closure);
+	assert(wl_connection_get_buffer_bytes(data.read_connection) == grown);
+
+	/* Until they are drained enough times in a row without needing
+	 * it. Data referenced by closures demarshalled in place is kept
+	 * until they are destroyed. */
+	for (i = 0; i < WL_BUFFER_SHRINK_DRAINS; i++) {
+		write_array_message(data.s[1], msg, 1024, 2 + i);
+		assert(wl_connection_read(data.read_connection) == 1024);
+		closure = wl_connection_demarshal_in_place(data.read_connection,
+							   1024, &objects,
+							   &array_message);
+		assert(closure);
+		assert(!array_is_copied(closure));
+		assert(wl_connection_get_buffer_bytes(data.read_connection) ==
+		       grown);
+		assert(array_matches(closure->args[0].a, 1024 - 12, 2 + i));
+		wl_closure_destroy(closure);
+	}
+	assert(wl_connection_get_buffer_bytes(data.read_connection) ==
+	       WL_BUFFER_DEFAULT_MAX_SIZE);
+
+	/* Along with the buffers of fds */
+	assert(pipe(fds) == 0);
+	closure = wl_closure_marshal(&sender, 0, (union wl_argument[]) {
+					{ .h = fds[0] }
+				     }, &fd_message);
+	assert(closure);
+	assert(wl_closure_send(closure, data.write_connection) == 0);
+	wl_closure_destroy(closure);
+	bytes = wl_connection_get_buffer_bytes(data.write_connection);
+	assert(bytes > WL_BUFFER_DEFAULT_MAX_SIZE);
+	assert(wl_connection_flush(data.write_connection) == 8);
+	assert(wl_connection_get_buffer_bytes(data.write_connection) == bytes);
+
+	assert(wl_connection_read(data.read_connection) == 8);
+	closure = wl_connection_demarshal(data.read_connection, 8,
+					  &objects, &fd_message);
+	assert(closure);
+	assert(wl_connection_get_buffer_bytes(data.read_connection) ==
+	       2 * WL_BUFFER_DEFAULT_MAX_SIZE);
+	wl_closure_destroy(closure);
+	close(fds[0]);
+	close(fds[1]);
+
+	wl_map_release(&objects);
+	release_marshal_data(&data);
+}
+
+TEST(connection_mirrored_buffers)
+{
+	struct marshal_data data;
+	struct wl_message message = { "test", "a", NULL };
+	static struct wl_object sender = { NULL, NULL, 400200 };
+	static uint8_t payload[11992];
+	struct wl_array array = { sizeof payload, 0, payload };
+	struct wl_closure *closure;
+	struct wl_map objects;
+	const int size = 12 + sizeof payload;
+	int pending = 0, round, i;
+	uint8_t seed_out = 0, seed_in = 0;
+
+	assert(socketpair(AF_UNIX,
+			  SOCK_STREAM | SOCK_CLOEXEC, 0, data.s) == 0);
+	data.read_connection = wl_connection_create(data.s[0], 1 << 20);
+	assert(data.read_connection);
+	data.write_connection = wl_connection_create(data.s[1], 1 << 20);
+	assert(data.write_connection);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+
+	/* Between three and five messages are pending, so the input buffer
+	 * keeps its size of 64 KiB and messages regularly wrap around its
+	 * end. They can only all be demarshalled in place if the buffer is
+	 * mirrored. */
+	for (round = 0; round < 20; round++) {
+		for (i = 0; i < (round == 0 ? 5 : 2); i++) {
+			for (size_t j = 0; j < sizeof payload; j++)
+				payload[j] = seed_out + j;
+			seed_out++;
+
+			closure = wl_closure_marshal(&sender, 0,
+						     (union wl_argument[]) {
+							{ .a = &array }
+						     }, &message);
+			assert(closure);
+			assert(wl_closure_send(closure,
+					       data.write_connection) == 0);
+			wl_closure_destroy(closure);
+		}
+		assert(wl_connection_flush(data.write_connection) >= 0);
+		pending += i;
+
+		assert(wl_connection_read(data.read_connection) ==
+		       pending * size);
+
+		for (i = 0; i < 2; i++) {
+			closure = wl_connection_demarshal_in_place(
+				data.read_connection, size, &objects, &message);
+			assert(closure);
+			assert(array_matches(closure->args[0].a,
+					     sizeof payload, seed_in++));
+			assert(!array_is_copied(closure));
+
+			wl_closure_destroy(closure);
+			pending--;
+		}
+	}
+
+	wl_map_release(&objects);
+	release_marshal_data(&data);
+}
+
 static void
 expected_fail_demarshal(struct marshal_data *data, const char *format,
                         const uint32_t *msg, int expected_error)
@@ -705,26 +1002,322 @@ TEST(connection_marshal_unbounded_boundary_size)
 	free(big_string);
 }
 
+/* Count the allocations made by the code linked into the test, which
+ * includes connection.c. The symbols are hidden, so allocations made
+ * inside the C library and other shared objects are not counted. */
+static int alloc_count;
+
+void *
+malloc(size_t size)
+{
+	static void *(*sys_malloc)(size_t);
+
+	if (!sys_malloc)
+		sys_malloc = dlsym(RTLD_NEXT, "malloc");
+	alloc_count++;
+
+	return sys_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	static void *(*sys_calloc)(size_t, size_t);
+
+	if (!sys_calloc)
+		sys_calloc = dlsym(RTLD_NEXT, "calloc");
+	alloc_count++;
+
+	return sys_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	static void *(*sys_realloc)(void *, size_t);
+
+	if (!sys_realloc)
+		sys_realloc = dlsym(RTLD_NEXT, "realloc");
+	alloc_count++;
+
+	return sys_realloc(ptr, size);
+}
+
+TEST(connection_queue_closure_in_place)
+{
+	struct marshal_data data;
+	struct wl_closure *closure;
+	static const uint32_t opcode = 42;
+	static struct wl_object sender = { NULL, NULL, 1234 };
+	struct wl_message message = { "test", "usu", NULL };
+	static const char text[] = "inplace";
+	/* 7 words per message, so messages regularly wrap around the end
+	 * of the ring buffer. */
+	const int size = 28, batch = 100, rounds = 20;
+	uint32_t buffer[28 / 4 * 100];
+	int i, j, allocs;
+
+	setup_marshal_data(&data);
+
+	closure = wl_closure_marshal(&sender, opcode,
+				     (union wl_argument[]) {
+					{ .u = 1 }, { .s = text }, { .u = 2 }
+				     }, &message);
+	assert(closure);
+
+	allocs = alloc_count;
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < batch; j++)
+			assert(wl_closure_queue(closure,
+						data.write_connection) == 0);
+
+		assert(wl_connection_write(data.write_connection, NULL, 0) == 0);
+		assert(wl_connection_flush(data.write_connection) ==
+		       size * batch);
+		assert(read(data.s[0], buffer, sizeof buffer) == size * batch);
+
+		for (j = 0; j < batch; j++) {
+			uint32_t *msg = buffer + j * size / 4;
+
+			assert(msg[0] == sender.id);
+			assert(msg[1] == (opcode | (size << 16)));
+			assert(msg[2] == 1);
+			assert(msg[3] == sizeof text);
+			assert(memcmp(&msg[4], text, sizeof text) == 0);
+			assert(msg[6] == 2);
+		}
+	}
+	allocs = alloc_count - allocs;
+
+	/* Queueing does not allocate, whether a message wraps or not */
+	assert(allocs < rounds);
+
+	wl_closure_destroy(closure);
+	release_marshal_data(&data);
+}
+
+TEST(connection_queue_closure_clears_padding)
+{
+	struct marshal_data data;
+	struct wl_closure *closure;
+	static struct wl_object sender = { NULL, NULL, 1234 };
+	struct wl_message message = { "test", "as", NULL };
+	char stale[8], text[6];
+	struct wl_array array;
+	uint32_t buffer[8];
+	unsigned char *p;
+	int i;
+
+	setup_marshal_data(&data);
+
+	/* Fill the whole out buffer with non-zero bytes, 32 bytes at a time
+	 * so that the last message lands over stale data. */
+	memset(stale, 0xff, sizeof stale);
+	stale[sizeof stale - 1] = '\0';
+	array.data = stale;
+	array.size = sizeof stale;
+	closure = wl_closure_marshal(&sender, 1,
+				     (union wl_argument[]) {
+					{ .a = &array }, { .s = stale }
+				     }, &message);
+	assert(closure);
+	for (i = 0; i < 2 * 4096 / (int) sizeof buffer; i++) {
+		assert(wl_closure_send(closure, data.write_connection) == 0);
+		assert(wl_connection_flush(data.write_connection) ==
+		       sizeof buffer);
+		assert(read(data.s[0], buffer, sizeof buffer) == sizeof buffer);
+	}
+	wl_closure_destroy(closure);
+
+	/* A 5 byte array and a 6 byte string, 3 and 2 bytes of padding */
+	memcpy(text, "hello", sizeof text);
+	array.data = text;
+	array.size = 5;
+	closure = wl_closure_marshal(&sender, 2,
+				     (union wl_argument[]) {
+					{ .a = &array }, { .s = text }
+				     }, &message);
+	assert(closure);
+	assert(wl_closure_send(closure, data.write_connection) == 0);
+	assert(wl_connection_flush(data.write_connection) == sizeof buffer);
+	assert(read(data.s[0], buffer, sizeof buffer) == sizeof buffer);
+	wl_closure_destroy(closure);
+
+	assert(buffer[2] == 5);
+	p = (unsigned char *) &buffer[3];
+	assert(memcmp(p, "hello", 5) == 0);
+	assert(p[5] == 0 && p[6] == 0 && p[7] == 0);
+	assert(buffer[5] == sizeof text);
+	p = (unsigned char *) &buffer[6];
+	assert(memcmp(p, "hello", sizeof text) == 0);
+	assert(p[6] == 0 && p[7] == 0);
+
+	release_marshal_data(&data);
+}
+
+static int sendmsg_calls;
+
+static ssize_t
+counting_sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+	sendmsg_calls++;
+
+	return sendmsg(sockfd, msg, flags);
+}
+
+TEST(connection_send_fds_syscalls)
+{
+	struct marshal_data data;
+	struct wl_closure *closure;
+	static struct wl_object sender = { NULL, NULL, 1234 };
+	/* Three fds per message, so batches of fds end mid-message */
+	struct wl_message message = { "test", "uhhh", NULL };
+	const int count = 100, size = 12;
+	struct wl_map objects;
+	struct stat buf1, buf2;
+	int fd, i, j;
+
+	setup_marshal_data(&data);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+	fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	assert(fd >= 0);
+	assert(fstat(fd, &buf1) == 0);
+
+	sendmsg_calls = 0;
+	wl_sendmsg = counting_sendmsg;
+	for (i = 0; i < count; i++) {
+		closure = wl_closure_marshal(&sender, 0,
+					     (union wl_argument[]) {
+						{ .u = i },
+						{ .h = fd }, { .h = fd }, { .h = fd }
+					     }, &message);
+		assert(closure);
+		assert(wl_closure_send(closure, data.write_connection) == 0);
+		wl_closure_destroy(closure);
+	}
+	assert(wl_connection_flush(data.write_connection) >= 0);
+	wl_sendmsg = sendmsg;
+
+	fprintf(stderr, "sent %d messages with %d fds in %d sendmsg calls\n",
+		count, 3 * count, sendmsg_calls);
+
+	/* One call per batch of 28 fds */
+	assert(sendmsg_calls <= (3 * count + 27) / 28);
+
+	/* Every message arrives along with its fds */
+	assert(wl_connection_read(data.read_connection) == count * size);
+	for (i = 0; i < count; i++) {
+		closure = wl_connection_demarshal(data.read_connection, size,
+						  &objects, &message);
+		assert(closure);
+		assert(closure->args[0].u == (uint32_t) i);
+		for (j = 1; j < 4; j++) {
+			assert(fstat(closure->args[j].h, &buf2) == 0);
+			assert(buf1.st_dev == buf2.st_dev);
+			assert(buf1.st_ino == buf2.st_ino);
+		}
+		wl_closure_destroy(closure);
+	}
+
+	close(fd);
+	wl_map_release(&objects);
+	release_marshal_data(&data);
+}
+
+TEST(connection_cork)
+{
+	struct marshal_data data;
+	uint32_t msg[4] = { 1, 16 << 16, 0, 0 };
+	struct timespec delay = { 0, 2000000 };
+	char buffer[4096];
+	int i, total = 0, len;
+
+	setup_marshal_data(&data);
+	wl_connection_set_flush_threshold(data.write_connection, 64);
+
+	sendmsg_calls = 0;
+	wl_sendmsg = counting_sendmsg;
+
+	/* The fifth message goes over the threshold */
+	for (i = 0; i < 8; i++)
+		assert(wl_connection_write(data.write_connection,
+					   msg, sizeof msg) == 0);
+	total += 8;
+	assert(sendmsg_calls == 1);
+
+	/* Corked data is held back until explicitly flushed */
+	wl_connection_cork(data.write_connection);
+	for (i = 0; i < 100; i++)
+		assert(wl_connection_write(data.write_connection,
+					   msg, sizeof msg) == 0);
+	total += 100;
+	assert(sendmsg_calls == 1);
+	assert(wl_connection_uncork(data.write_connection) == 0);
+	assert(wl_connection_flush(data.write_connection) == 104 * sizeof msg);
+	assert(sendmsg_calls == 2);
+
+	/* ... or until it no longer fits in the buffer */
+	wl_connection_cork(data.write_connection);
+	for (i = 0; i < 300; i++)
+		assert(wl_connection_write(data.write_connection,
+					   msg, sizeof msg) == 0);
+	total += 300;
+	assert(sendmsg_calls == 3);
+
+	/* ... or until the deadline expires */
+	wl_connection_set_flush_deadline(data.write_connection, 1000000);
+	assert(wl_connection_write(data.write_connection,
+				   msg, sizeof msg) == 0);
+	assert(sendmsg_calls == 3);
+	nanosleep(&delay, NULL);
+	assert(wl_connection_write(data.write_connection,
+				   msg, sizeof msg) == 0);
+	total += 2;
+	assert(sendmsg_calls == 4);
+
+	assert(wl_connection_uncork(data.write_connection) == 0);
+	assert(wl_connection_flush(data.write_connection) >= 0);
+	wl_sendmsg = sendmsg;
+
+	total *= sizeof msg;
+	while (total > 0) {
+		len = read(data.s[0], buffer, sizeof buffer);
+		assert(len > 0);
+		total -= len;
+	}
+	assert(total == 0);
+
+	release_marshal_data(&data);
+}
+
 static void
 marshal_helper(const char *format, void *handler, ...)
 {
+	static const uint32_t sides[] = {
+		WL_CLOSURE_INVOKE_CLIENT, WL_CLOSURE_INVOKE_SERVER
+	};
 	struct wl_closure *closure;
 	static struct wl_object sender = { NULL, NULL, 1234 };
 	struct wl_object object = { NULL, &handler, 0 };
 	static const int opcode = 4444;
 	struct wl_message message = { "test", format, NULL };
-	va_list ap;
+	va_list ap, aq;
+	unsigned int i;
 	int done;
 
 	va_start(ap, handler);
-	closure = wl_closure_vmarshal(&sender, opcode, ap, &message);
+	for (i = 0; i < ARRAY_LENGTH(sides); i++) {
+		va_copy(aq, ap);
+		closure = wl_closure_vmarshal(&sender, opcode, aq, &message);
+		va_end(aq);
+
+		assert(closure);
+		done = 0;
+		wl_closure_invoke(closure, sides[i], &object, 0, &done);
+		wl_closure_destroy(closure);
+		assert(done);
+	}
 	va_end(ap);
-
-	assert(closure);
-	done = 0;
-	wl_closure_invoke(closure, WL_CLOSURE_INVOKE_SERVER, &object, 0, &done);
-	wl_closure_destroy(closure);
-	assert(done);
 }
 
 static void
@@ -739,11 +1332,97 @@ suu_handler(void *data, struct wl_object *object,
 	*done = 1;
 }
 
+static void
+i_handler(void *data, struct wl_object *object, int32_t i)
+{
+	int *done = data;
+
+	assert(i == -5);
+	assert((int64_t) i < 0);
+	*done = 1;
+}
+
+static void
+uff_handler(void *data, struct wl_object *object,
+	    uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+	int *done = data;
+
+	assert(time == 0xfffffff0);
+	assert(x == wl_fixed_from_double(-1.5));
+	assert(wl_fixed_to_double(y) == -2048.25);
+	*done = 1;
+}
+
+static void
+iiii_handler(void *data, struct wl_object *object,
+	     int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	int *done = data;
+
+	assert(x == -1 && y == INT32_MIN);
+	assert(width == INT32_MAX && height == -100000);
+	*done = 1;
+}
+
+static void
+uoi_handler(void *data, struct wl_object *object,
+	    uint32_t serial, struct wl_object *o, int32_t i)
+{
+	int *done = data;
+
+	assert(serial == 7);
+	assert(o == NULL);
+	assert(i == -7);
+	*done = 1;
+}
+
+static void
+ih_handler(void *data, struct wl_object *object, int32_t i, int32_t fd)
+{
+	int *done = data;
+
+	assert(i == -3);
+	assert(fd >= 0);
+	close(fd);
+	*done = 1;
+}
+
+static void
+iiiii_handler(void *data, struct wl_object *object, int32_t i1,
+	      int32_t i2, int32_t i3, int32_t i4, int32_t i5)
+{
+	int *done = data;
+
+	assert(i1 == -1 && i2 == -2 && i3 == -3 && i4 == -4 && i5 == -5);
+	*done = 1;
+}
+
 TEST(invoke_closure)
 {
 	marshal_helper("suu", suu_handler, "foo", 500, 404040);
 }
 
+TEST(invoke_closure_signed)
+{
+	int fd;
+
+	marshal_helper("i", i_handler, -5);
+	marshal_helper("uff", uff_handler, 0xfffffff0,
+		       wl_fixed_from_double(-1.5),
+		       wl_fixed_from_double(-2048.25));
+	marshal_helper("iiii", iiii_handler, -1, INT32_MIN, INT32_MAX,
+		       -100000);
+	marshal_helper("u?oi", uoi_handler, 7, NULL, -7);
+	/* Not covered by the trampolines, goes through libffi */
+	marshal_helper("iiiii", iiiii_handler, -1, -2, -3, -4, -5);
+
+	fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	assert(fd >= 0);
+	marshal_helper("ih", ih_handler, -3, fd);
+	close(fd);
+}
+
 static void
 leak_closure(void)
 {
@@ -907,3 +1586,81 @@ TEST(request_bogus_size)
 		wl_display_destroy(display);
 	}
 }
+
+/* Sends bursts of 2 KiB messages through the same pair of connections.
+ * Once the buffers have grown to the size of a burst, the next ones go
+ * through without any allocation. */
+static void
+burst_many(int messages, int rounds)
+{
+	struct marshal_data data;
+	struct wl_message message = { "test", "a", NULL };
+	static struct wl_object sender = { NULL, NULL, 400200 };
+	static uint8_t payload[2048 - 12];
+	struct wl_array array = { sizeof payload, 0, payload };
+	const int size = 12 + sizeof payload;
+	struct wl_closure *closure, *received;
+	struct wl_map objects;
+	size_t bytes = 0;
+	int allocs = 0, before, round, i, len;
+
+	assert(socketpair(AF_UNIX,
+			  SOCK_STREAM | SOCK_CLOEXEC, 0, data.s) == 0);
+	data.read_connection = wl_connection_create(data.s[0], 1 << 20);
+	assert(data.read_connection);
+	data.write_connection = wl_connection_create(data.s[1], 1 << 20);
+	assert(data.write_connection);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+
+	closure = wl_closure_marshal(&sender, 0, (union wl_argument[]) {
+					{ .a = &array }
+				     }, &message);
+	assert(closure);
+
+	/* The first round only grows the buffers */
+	for (round = 0; round <= rounds; round++) {
+		before = alloc_count;
+		for (i = 0; i < messages; i++)
+			assert(wl_closure_send(closure,
+					       data.write_connection) == 0);
+		for (len = 0; len < messages * size; ) {
+			assert(wl_connection_flush(data.write_connection) >= 0 ||
+			       errno == EAGAIN);
+			len = wl_connection_read(data.read_connection);
+			assert(len >= 0 || errno == EAGAIN);
+		}
+		for (i = 0; i < messages; i++) {
+			received = wl_connection_demarshal(data.read_connection,
+							   size, &objects,
+							   &message);
+			assert(received);
+			wl_closure_destroy(received);
+		}
+
+		if (round == 0) {
+			bytes = wl_connection_get_buffer_bytes(
+					data.read_connection) +
+				wl_connection_get_buffer_bytes(
+					data.write_connection);
+			continue;
+		}
+
+		allocs += alloc_count - before;
+		assert(wl_connection_get_buffer_bytes(data.read_connection) +
+		       wl_connection_get_buffer_bytes(data.write_connection) ==
+		       bytes);
+	}
+
+	assert(allocs == 0);
+
+	wl_closure_destroy(closure);
+	wl_map_release(&objects);
+	release_marshal_data(&data);
+}
+
+TEST(connection_burst_reuses_buffers)
+{
+	/* Heap allocated buffers, then mirrored ones */
+	burst_many(8, 4);
+	burst_many(64, 4);
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ * Copyright © 2013 Jason Ekstrand
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Timing loops for the display and its client loops. These are not
+ * part of the unit suite; run them with "meson test --benchmark". */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+#include "wayland-private.h"
+#include "wayland-server.h"
+#include "wayland-client.h"
+#include "test-runner.h"
+
+struct loop_thread {
+	struct wl_event_loop *loop;
+	/* Flushes the clients like wl_display_run() if set */
+	struct wl_display *display;
+	pthread_t thread;
+	bool stop;
+};
+
+static void *
+loop_thread_run(void *data)
+{
+	struct loop_thread *lt = data;
+
+	while (!__atomic_load_n(&lt->stop, __ATOMIC_ACQUIRE)) {
+		if (lt->display)
+			wl_display_flush_clients(lt->display);
+		assert(wl_event_loop_dispatch(lt->loop, 10) == 0);
+	}
+
+	return NULL;
+}
+
+static void
+loop_thread_start(struct loop_thread *lt)
+{
+	lt->stop = false;
+	assert(pthread_create(&lt->thread, NULL, loop_thread_run, lt) == 0);
+}
+
+static void
+loop_thread_stop(struct loop_thread *lt)
+{
+	__atomic_store_n(&lt->stop, true, __ATOMIC_RELEASE);
+	assert(pthread_join(lt->thread, NULL) == 0);
+}
+
+#define SCALING_BATCH 64
+#define SCALING_REQUESTS 32768
+
+static double
+client_loop_scaling_run(int nclients, int nloops)
+{
+	struct wl_display *display;
+	struct loop_thread lt[4] = { 0 }, display_lt = { 0 };
+	struct pollfd pfd[64];
+	uint32_t request[SCALING_BATCH * 3];
+	char events[SCALING_BATCH * 24];
+	size_t pending[64], len;
+	int i, j, round, rounds, ready, s[2];
+	struct timespec start, end;
+	ssize_t ret;
+
+	assert(nclients <= 64 && nloops <= 4);
+	display = wl_display_create();
+	assert(display);
+	for (i = 0; i < nloops; i++) {
+		lt[i].loop = wl_event_loop_create();
+		assert(lt[i].loop);
+		assert(wl_display_add_client_loop(display, lt[i].loop) == 0);
+		loop_thread_start(&lt[i]);
+	}
+
+	/* Clients of the display loop are created before its thread runs,
+	 * the ones of the client loops are handed over */
+	for (i = 0; i < nclients; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+				  s) == 0);
+		assert(wl_client_create(display, s[0]));
+		pfd[i].fd = s[1];
+		pfd[i].events = POLLIN;
+	}
+
+	if (nloops == 0) {
+		display_lt.loop = wl_display_get_event_loop(display);
+		display_lt.display = display;
+		loop_thread_start(&display_lt);
+	}
+
+	/* Batches of wl_display.sync, each answered with
+	 * wl_callback.done and wl_display.delete_id */
+	for (i = 0; i < SCALING_BATCH; i++) {
+		request[i * 3] = 1;
+		request[i * 3 + 1] = WL_DISPLAY_SYNC | (12 << 16);
+		request[i * 3 + 2] = 2 + i;
+	}
+
+	rounds = SCALING_REQUESTS / (nclients * SCALING_BATCH);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < nclients; i++) {
+			for (len = 0; len < sizeof request; len += ret) {
+				ret = write(pfd[i].fd, (char *) request + len,
+					    sizeof request - len);
+				assert(ret > 0);
+			}
+			pending[i] = sizeof events;
+		}
+
+		for (ready = 0; ready < nclients; ) {
+			assert(poll(pfd, nclients, 5000) > 0);
+			for (j = 0; j < nclients; j++) {
+				if (!(pfd[j].revents & POLLIN) ||
+				    pending[j] == 0)
+					continue;
+				ret = read(pfd[j].fd, events, pending[j]);
+				assert(ret > 0);
+				pending[j] -= ret;
+				if (pending[j] == 0)
+					ready++;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < nloops; i++)
+		loop_thread_stop(&lt[i]);
+	if (nloops == 0)
+		loop_thread_stop(&display_lt);
+
+	for (i = 0; i < nclients; i++)
+		close(pfd[i].fd);
+	wl_display_destroy_clients(display);
+	wl_display_destroy(display);
+	for (i = 0; i < nloops; i++)
+		wl_event_loop_destroy(lt[i].loop);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 +
+		(end.tv_nsec - start.tv_nsec)) /
+		(rounds * nclients * SCALING_BATCH);
+}
+
+TEST(client_loop_scaling)
+{
+	static const int nclients[] = { 1, 4, 16, 64 };
+	double single, sharded;
+	unsigned int i;
+
+	fprintf(stderr, "%ld CPUs online\n", sysconf(_SC_NPROCESSORS_ONLN));
+	for (i = 0; i < ARRAY_LENGTH(nclients); i++) {
+		single = client_loop_scaling_run(nclients[i], 0);
+		sharded = client_loop_scaling_run(nclients[i], 4);
+		fprintf(stderr, "%2d clients: %6.0f ns per request on the "
+			"display loop, %6.0f ns on 4 client loops\n",
+			nclients[i], single, sharded);
+	}
+}
+
+static double
+flush_clients_run(int nclients, int nactive, int iterations, int threads)
+{
+	struct wl_display *display;
+	struct wl_client *client[256];
+	struct timespec start, end;
+	char buffer[64];
+	double nsec = 0;
+	int i, j, fd[256], s[2];
+
+	assert(nclients <= (int) ARRAY_LENGTH(client));
+	display = wl_display_create();
+	assert(display);
+	assert(wl_display_set_flush_threads(display, threads) == 0);
+	for (i = 0; i < nclients; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+				  s) == 0);
+		client[i] = wl_client_create(display, s[0]);
+		assert(client[i]);
+		fd[i] = s[1];
+	}
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < nactive; j++)
+			wl_resource_post_event(wl_client_get_object(client[j], 1),
+					       WL_DISPLAY_DELETE_ID, i);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		wl_display_flush_clients(display);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		nsec += (end.tv_sec - start.tv_sec) * 1e9 +
+			(end.tv_nsec - start.tv_nsec);
+
+		for (j = 0; j < nactive; j++)
+			assert(read(fd[j], buffer, sizeof buffer) == 12);
+	}
+
+	for (i = 0; i < nclients; i++) {
+		wl_client_destroy(client[i]);
+		close(fd[i]);
+	}
+	wl_display_destroy(display);
+
+	return nsec / iterations;
+}
+
+TEST(flush_clients_dirty)
+{
+	static const int nclients[] = { 4, 16, 64, 256 };
+	const int nactive = 4;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(nclients); i++)
+		fprintf(stderr, "%3d clients, %d active: %6.0f ns per "
+			"wl_display_flush_clients()\n", nclients[i], nactive,
+			flush_clients_run(nclients[i], nactive, 2000, 0));
+}
+
+TEST(flush_clients_parallel)
+{
+	static const int threads[] = { 0, 1, 2, 4 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(threads); i++)
+		fprintf(stderr, "256 clients, all active, %d flush threads: "
+			"%6.0f ns per wl_display_flush_clients()\n",
+			threads[i], flush_clients_run(256, 256, 500,
+						      threads[i]));
+}
@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <assert.h>
 #include <sys/socket.h>
@@ -41,6 +42,7 @@
 
 #include <pthread.h>
 #include <poll.h>
+#include <time.h>
 
 #include "wayland-private.h"
 #include "wayland-server.h"
@@ -1715,3 +1717,599 @@ TEST(no_source_terminate)
 	display_run(d);
 	display_destroy(d);
 }
+
+static bool
+client_has_data(int fd)
+{
+	char c;
+
+	return recv(fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) == 1;
+}
+
+TEST(client_cork)
+{
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct wl_client *client;
+	struct wl_resource *display_resource;
+	char buffer[4096];
+	int s[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_create();
+	assert(display);
+	loop = wl_display_get_event_loop(display);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+	display_resource = wl_client_get_object(client, 1);
+	assert(display_resource);
+
+	/* Corked clients are skipped by wl_display_flush_clients() */
+	wl_client_cork(client);
+	wl_client_cork(client);
+	wl_resource_post_event(display_resource,
+			       WL_DISPLAY_DELETE_ID, 1);
+	wl_display_flush_clients(display);
+	assert(!client_has_data(s[1]));
+
+	/* Until the last cork is removed */
+	wl_client_uncork(client);
+	assert(!client_has_data(s[1]));
+	wl_client_uncork(client);
+	assert(client_has_data(s[1]));
+	assert(read(s[1], buffer, sizeof buffer) == 12);
+
+	/* The flush deadline overrides the cork */
+	assert(wl_client_set_flush_deadline(client, 1) == 0);
+	wl_client_cork(client);
+	wl_resource_post_event(display_resource,
+			       WL_DISPLAY_DELETE_ID, 2);
+	wl_display_flush_clients(display);
+	assert(!client_has_data(s[1]));
+	while (!client_has_data(s[1]))
+		assert(wl_event_loop_dispatch(loop, 1000) == 0);
+	assert(read(s[1], buffer, sizeof buffer) == 12);
+	wl_client_uncork(client);
+
+	wl_client_destroy(client);
+	wl_display_destroy(display);
+	close(s[1]);
+}
+
+struct quantum_client {
+	struct wl_client *client;
+	int s[2];
+	int count;
+	int other_count;
+	struct quantum_client *other;
+};
+
+static void
+quantum_region_add(struct wl_client *client, struct wl_resource *resource,
+		   int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct quantum_client *qc = wl_resource_get_user_data(resource);
+
+	qc->count++;
+	if (qc->other)
+		qc->other_count = qc->other->count;
+}
+
+static const struct wl_region_interface quantum_region_interface = {
+	.add = quantum_region_add,
+};
+
+static void
+quantum_client_init(struct quantum_client *qc, struct wl_display *display)
+{
+	struct wl_resource *resource;
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, qc->s) == 0);
+	qc->client = wl_client_create(display, qc->s[0]);
+	assert(qc->client);
+	resource = wl_resource_create(qc->client, &wl_region_interface, 1, 2);
+	assert(resource);
+	wl_resource_set_implementation(resource, &quantum_region_interface,
+				       qc, NULL);
+}
+
+static void
+quantum_client_send(struct quantum_client *qc, int count)
+{
+	static uint32_t buffer[6 * 4096];
+	size_t len, size = count * 6 * sizeof buffer[0];
+	uint32_t *msg;
+	int i;
+
+	assert(size <= sizeof buffer);
+	for (i = 0; i < count; i++) {
+		msg = buffer + i * 6;
+		msg[0] = 2;
+		msg[1] = WL_REGION_ADD | (24 << 16);
+		msg[2] = msg[3] = msg[4] = msg[5] = 0;
+	}
+
+	for (len = 0; len < size; )
+		len += write(qc->s[1], (char *) buffer + len, size - len);
+}
+
+TEST(client_dispatch_quantum)
+{
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct quantum_client flood = { 0 }, other = { 0 };
+	struct wl_client_dispatch_stats stats;
+	const int count = 4096, quantum = 64;
+
+	display = wl_display_create();
+	assert(display);
+	loop = wl_display_get_event_loop(display);
+
+	quantum_client_init(&flood, display);
+	quantum_client_init(&other, display);
+	other.other = &flood;
+	wl_client_set_max_buffer_size(flood.client, 128 * 1024);
+	assert(wl_client_set_dispatch_quantum(flood.client,
+					      quantum, 0, 0) == 0);
+
+	quantum_client_send(&flood, count);
+	quantum_client_send(&other, 1);
+
+	/* The other client doesn't wait for the whole flood, which still
+	 * gets dispatched within the same iteration */
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(other.count == 1);
+	assert(other.other_count <= quantum);
+	assert(flood.count == count);
+
+	wl_client_get_dispatch_stats(flood.client, &stats);
+	fprintf(stderr, "other client dispatched after %d flooding requests, "
+		"flooding client preempted %"PRIu64" times, "
+		"waited %"PRIu64" ns at most\n",
+		other.other_count, stats.preemptions, stats.wait_max_nsec);
+	assert(stats.requests == (uint64_t) count);
+	assert(stats.preemptions == count / quantum - 1);
+	assert(stats.wait_total_nsec >= stats.wait_max_nsec);
+
+	wl_client_destroy(flood.client);
+	wl_client_destroy(other.client);
+	wl_display_destroy(display);
+	close(flood.s[1]);
+	close(other.s[1]);
+}
+
+struct loop_thread {
+	struct wl_event_loop *loop;
+	/* Flushes the clients like wl_display_run() if set */
+	struct wl_display *display;
+	pthread_t thread;
+	bool stop;
+};
+
+static void *
+loop_thread_run(void *data)
+{
+	struct loop_thread *lt = data;
+
+	while (!__atomic_load_n(&lt->stop, __ATOMIC_ACQUIRE)) {
+		if (lt->display)
+			wl_display_flush_clients(lt->display);
+		assert(wl_event_loop_dispatch(lt->loop, 10) == 0);
+	}
+
+	return NULL;
+}
+
+static void
+loop_thread_start(struct loop_thread *lt)
+{
+	lt->stop = false;
+	assert(pthread_create(&lt->thread, NULL, loop_thread_run, lt) == 0);
+}
+
+static void
+loop_thread_stop(struct loop_thread *lt)
+{
+	__atomic_store_n(&lt->stop, true, __ATOMIC_RELEASE);
+	assert(pthread_join(lt->thread, NULL) == 0);
+}
+
+struct client_loop_test {
+	pthread_t main_thread;
+	bool bound_off_main;
+	uint32_t output_name;
+	bool output_removed;
+	struct wl_output *output;
+};
+
+static void
+client_loop_bind_output(struct wl_client *client, void *data,
+			uint32_t version, uint32_t id)
+{
+	struct client_loop_test *test = data;
+
+	test->bound_off_main = !pthread_equal(pthread_self(),
+					      test->main_thread);
+	assert(wl_resource_create(client, &wl_output_interface, version, id));
+}
+
+static void
+client_loop_registry_global(void *data, struct wl_registry *registry,
+			    uint32_t name, const char *interface,
+			    uint32_t version)
+{
+	struct client_loop_test *test = data;
+
+	if (strcmp(interface, "wl_output") == 0) {
+		assert(test->output_name == 0);
+		test->output_name = name;
+		test->output = wl_registry_bind(registry, name,
+						&wl_output_interface, 1);
+	}
+}
+
+static void
+client_loop_registry_global_remove(void *data, struct wl_registry *registry,
+				   uint32_t name)
+{
+	struct client_loop_test *test = data;
+
+	assert(name == test->output_name);
+	test->output_removed = true;
+}
+
+static const struct wl_registry_listener client_loop_registry_listener = {
+	client_loop_registry_global,
+	client_loop_registry_global_remove
+};
+
+TEST(client_loop_registry)
+{
+	struct wl_display *display;
+	struct wl_display *client_display;
+	struct wl_client *client;
+	struct wl_registry *registry;
+	struct wl_global *global;
+	struct loop_thread lt = { 0 };
+	struct client_loop_test test = { 0 };
+	int s[2];
+
+	display = wl_display_create();
+	assert(display);
+	lt.loop = wl_event_loop_create();
+	assert(lt.loop);
+	assert(wl_display_add_client_loop(display, lt.loop) == 0);
+	test.main_thread = pthread_self();
+	loop_thread_start(&lt);
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+	assert(wl_client_get_event_loop(client) == lt.loop);
+
+	client_display = wl_display_connect_to_fd(s[1]);
+	assert(client_display);
+	registry = wl_display_get_registry(client_display);
+	wl_registry_add_listener(registry, &client_loop_registry_listener,
+				 &test);
+	assert(wl_display_roundtrip(client_display) >= 0);
+	assert(test.output_name == 0);
+
+	/* Registry events are handed over to the client loop, and bind
+	 * handlers run there */
+	global = wl_global_create(display, &wl_output_interface, 1, &test,
+				  client_loop_bind_output);
+	assert(global);
+	while (test.output_name == 0 || !test.bound_off_main)
+		assert(wl_display_roundtrip(client_display) >= 0);
+	assert(test.output_name == wl_global_get_name(global, client));
+
+	wl_global_remove(global);
+	while (!test.output_removed)
+		assert(wl_display_roundtrip(client_display) >= 0);
+	wl_global_destroy(global);
+
+	loop_thread_stop(&lt);
+
+	wl_output_destroy(test.output);
+	wl_registry_destroy(registry);
+	wl_display_disconnect(client_display);
+	wl_display_destroy_clients(display);
+	wl_display_destroy(display);
+	wl_event_loop_destroy(lt.loop);
+}
+
+struct slow_bind {
+	bool entered;
+	bool done;
+};
+
+static void
+client_loop_slow_bind(struct wl_client *client, void *data,
+		      uint32_t version, uint32_t id)
+{
+	struct slow_bind *bind = data;
+	struct timespec delay = { 0, 50 * 1000 * 1000 };
+
+	__atomic_store_n(&bind->entered, true, __ATOMIC_RELEASE);
+	nanosleep(&delay, NULL);
+	assert(wl_resource_create(client, &wl_output_interface, version, id));
+	__atomic_store_n(&bind->done, true, __ATOMIC_RELEASE);
+}
+
+TEST(client_loop_global_destroy_waits_for_bind)
+{
+	struct wl_display *display;
+	struct wl_display *client_display;
+	struct wl_client *client;
+	struct wl_registry *registry;
+	struct wl_output *output;
+	struct wl_global *global;
+	struct loop_thread lt = { 0 };
+	struct slow_bind *bind;
+	struct timespec delay = { 0, 1000 * 1000 };
+	int s[2];
+
+	display = wl_display_create();
+	assert(display);
+	lt.loop = wl_event_loop_create();
+	assert(lt.loop);
+	assert(wl_display_add_client_loop(display, lt.loop) == 0);
+	loop_thread_start(&lt);
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+	client_display = wl_display_connect_to_fd(s[1]);
+	assert(client_display);
+
+	bind = zalloc(sizeof *bind);
+	assert(bind);
+	global = wl_global_create(display, &wl_output_interface, 1, bind,
+				  client_loop_slow_bind);
+	assert(global);
+
+	registry = wl_display_get_registry(client_display);
+	output = wl_registry_bind(registry, wl_global_get_name(global, client),
+				  &wl_output_interface, 1);
+	assert(wl_display_flush(client_display) >= 0);
+	while (!__atomic_load_n(&bind->entered, __ATOMIC_ACQUIRE))
+		nanosleep(&delay, NULL);
+
+	/* The user data of the global can be freed once destroyed */
+	wl_global_destroy(global);
+	assert(__atomic_load_n(&bind->done, __ATOMIC_ACQUIRE));
+	free(bind);
+
+	loop_thread_stop(&lt);
+
+	wl_output_destroy(output);
+	wl_registry_destroy(registry);
+	wl_display_disconnect(client_display);
+	wl_display_destroy_clients(display);
+	wl_display_destroy(display);
+	wl_event_loop_destroy(lt.loop);
+}
+
+static int global_filter_calls;
+
+static bool
+counting_global_filter(const struct wl_client *client,
+		       const struct wl_global *global, void *data)
+{
+	__atomic_fetch_add(&global_filter_calls, 1, __ATOMIC_RELAXED);
+
+	return wl_global_get_interface(global) != &wl_data_offer_interface;
+}
+
+static void
+count_registry_global(void *data, struct wl_registry *registry,
+		      uint32_t name, const char *interface, uint32_t version)
+{
+	int *count = data;
+
+	(*count)++;
+}
+
+static void
+count_registry_global_remove(void *data, struct wl_registry *registry,
+			     uint32_t name)
+{
+}
+
+static const struct wl_registry_listener count_registry_listener = {
+	count_registry_global,
+	count_registry_global_remove
+};
+
+TEST(global_filter_cached)
+{
+	struct wl_display *display, *client_display;
+	struct wl_client *client;
+	struct wl_registry *registry[3];
+	struct wl_global *global[64];
+	struct loop_thread lt = { 0 };
+	const int nglobals = ARRAY_LENGTH(global);
+	int i, count = 0, s[2];
+
+	display = wl_display_create();
+	assert(display);
+	wl_display_set_global_filter(display, counting_global_filter, NULL);
+	for (i = 0; i < nglobals; i++) {
+		global[i] = wl_global_create(display, i % 8 ?
+					     &wl_output_interface :
+					     &wl_data_offer_interface,
+					     1, NULL, NULL);
+		assert(global[i]);
+	}
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+	lt.loop = wl_display_get_event_loop(display);
+	lt.display = display;
+	loop_thread_start(&lt);
+
+	/* Each global goes through the filter once for the client, however
+	 * many registries it has */
+	client_display = wl_display_connect_to_fd(s[1]);
+	assert(client_display);
+	for (i = 0; i < (int) ARRAY_LENGTH(registry); i++) {
+		registry[i] = wl_display_get_registry(client_display);
+		wl_registry_add_listener(registry[i],
+					 &count_registry_listener, &count);
+		assert(wl_display_roundtrip(client_display) >= 0);
+	}
+	assert(count == (int) ARRAY_LENGTH(registry) * nglobals * 7 / 8);
+	fprintf(stderr, "%d globals announced to %d registries with %d "
+		"filter calls\n", nglobals, (int) ARRAY_LENGTH(registry),
+		global_filter_calls);
+	assert(global_filter_calls == nglobals);
+
+	loop_thread_stop(&lt);
+
+	/* Setting the filter again drops the cached decisions */
+	wl_display_set_global_filter(display, counting_global_filter, NULL);
+	assert(wl_global_get_name(global[1], client) ==
+	       wl_global_get_name(global[1], client));
+	assert(wl_global_get_name(global[0], client) == 0);
+	assert(global_filter_calls == nglobals + 2);
+
+	for (i = 0; i < (int) ARRAY_LENGTH(registry); i++)
+		wl_registry_destroy(registry[i]);
+	wl_display_disconnect(client_display);
+	wl_client_destroy(client);
+	for (i = 0; i < nglobals; i++)
+		wl_global_destroy(global[i]);
+	wl_display_destroy(display);
+}
+
+static void
+flush_clients_run(int nclients, int nactive, int iterations, int threads)
+{
+	struct wl_display *display;
+	struct wl_client *client[256];
+	struct wl_display_flush_stats before, after;
+	char buffer[64];
+	int i, j, fd[256], s[2];
+
+	assert(nclients <= (int) ARRAY_LENGTH(client));
+	display = wl_display_create();
+	assert(display);
+	assert(wl_display_set_flush_threads(display, threads) == 0);
+	for (i = 0; i < nclients; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+				  s) == 0);
+		client[i] = wl_client_create(display, s[0]);
+		assert(client[i]);
+		fd[i] = s[1];
+	}
+
+	wl_display_get_flush_stats(display, &before);
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < nactive; j++)
+			wl_resource_post_event(wl_client_get_object(client[j], 1),
+					       WL_DISPLAY_DELETE_ID, i);
+
+		wl_display_flush_clients(display);
+		for (j = 0; j < nactive; j++)
+			assert(read(fd[j], buffer, sizeof buffer) == 12);
+	}
+	wl_display_get_flush_stats(display, &after);
+
+	/* Only the clients with events were flushed */
+	assert(after.flushes - before.flushes == (uint64_t) iterations);
+	assert(after.clients_flushed - before.clients_flushed ==
+	       (uint64_t) iterations * nactive);
+
+	for (i = 0; i < nclients; i++) {
+		wl_client_destroy(client[i]);
+		close(fd[i]);
+	}
+	wl_display_destroy(display);
+}
+
+TEST(flush_clients_dirty)
+{
+	flush_clients_run(16, 4, 10, 0);
+}
+
+TEST(flush_clients_parallel)
+{
+	/* Enough clients with events for the flush threads to be used */
+	flush_clients_run(32, 32, 10, 2);
+}
+
+static void
+flush_client_destroyed(struct wl_listener *listener, void *data)
+{
+	wl_list_remove(&listener->link);
+	wl_list_init(&listener->link);
+	listener->notify = NULL;
+}
+
+TEST(flush_clients_parallel_errors)
+{
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct wl_client *client[32];
+	struct wl_listener destroyed[32];
+	char buffer[4096];
+	int i, n, fd[32], s[2], size = 4096;
+	ssize_t len, total = 0, posted = 0;
+
+	display = wl_display_create();
+	assert(display);
+	loop = wl_display_get_event_loop(display);
+	assert(wl_display_set_flush_threads(display, 2) == 0);
+	for (i = 0; i < 32; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+				  s) == 0);
+		client[i] = wl_client_create(display, s[0]);
+		assert(client[i]);
+		wl_client_set_max_buffer_size(client[i], 1 << 20);
+		destroyed[i].notify = NULL;
+		wl_list_init(&destroyed[i].link);
+		fd[i] = s[1];
+	}
+
+	/* Half the clients are gone, the first one has a small socket
+	 * buffer */
+	for (i = 16; i < 32; i++) {
+		destroyed[i].notify = flush_client_destroyed;
+		wl_client_add_destroy_listener(client[i], &destroyed[i]);
+		close(fd[i]);
+	}
+	assert(setsockopt(wl_client_get_fd(client[0]), SOL_SOCKET,
+			  SO_SNDBUF, &size, sizeof size) == 0);
+	for (n = 0; n < 1000; n++) {
+		for (i = 0; i < (n == 0 ? 32 : 16); i++)
+			wl_resource_post_event(wl_client_get_object(client[i],
+								    1),
+					       WL_DISPLAY_DELETE_ID, n);
+		posted += 12;
+		wl_display_flush_clients(display);
+	}
+	for (i = 16; i < 32; i++)
+		assert(destroyed[i].notify == NULL);
+
+	/* Events left over when the sockets were full follow as the
+	 * clients read */
+	for (i = 0; i < 16; i++) {
+		total = 0;
+		while (total < posted) {
+			len = recv(fd[i], buffer, sizeof buffer, MSG_DONTWAIT);
+			assert(len > 0 || errno == EAGAIN);
+			if (len > 0)
+				total += len;
+			wl_event_loop_dispatch(loop, 0);
+		}
+		assert(total == posted);
+	}
+
+	for (i = 0; i < 16; i++) {
+		wl_client_destroy(client[i]);
+		close(fd[i]);
+	}
+	wl_display_destroy(display);
+}
@@ -24,6 +24,8 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "wayland-client.h"
 #include "wayland-private.h"
@@ -88,3 +90,84 @@ TEST(message_count_arrays)
 		       messages[i].expected_array_count);
 	}
 }
+
+TEST(message_desc)
+{
+	unsigned int i;
+	struct wl_message fake_messages[] = {
+		{ "empty", "", NULL },
+		{ "fixed", "3iu?ofh", NULL },
+		{ "variable", "?sa?oh", NULL },
+	};
+	const struct {
+		const struct wl_message *message;
+		const char *types;
+		uint32_t nullable;
+		int since, num_fds, num_arrays, num_objects;
+		uint32_t fixed_size;
+	} messages[] = {
+		{ &wl_pointer_interface.events[WL_POINTER_ENTER],
+		  "uoff", 0, 1, 0, 0, 1, 24 },
+		{ &wl_keyboard_interface.events[WL_KEYBOARD_ENTER],
+		  "uoa", 0, 1, 0, 1, 1, 0 },
+		{ &wl_pointer_interface.methods[WL_POINTER_SET_CURSOR],
+		  "uoii", 1 << 1, 1, 0, 0, 1, 24 },
+		{ &wl_surface_interface.methods[WL_SURFACE_SET_BUFFER_SCALE],
+		  "i", 0, 3, 0, 0, 0, 12 },
+		{ &fake_messages[0], "", 0, 1, 0, 0, 0, 8 },
+		{ &fake_messages[1], "iuofh", 1 << 2, 3, 1, 0, 1, 24 },
+		{ &fake_messages[2], "saoh", (1 << 0) | (1 << 2), 1, 1, 1, 1, 0 },
+	};
+	const struct wl_message_desc *desc;
+	int j;
+
+	for (i = 0; i < ARRAY_LENGTH(messages); ++i) {
+		desc = wl_message_get_desc(messages[i].message);
+		assert(desc);
+		assert(strcmp(desc->signature,
+			      messages[i].message->signature) == 0);
+		assert(desc->count == (int) strlen(messages[i].types));
+		for (j = 0; j < desc->count; j++)
+			assert(desc->types[j] == messages[i].types[j]);
+		assert(desc->nullable == messages[i].nullable);
+		assert(desc->since == messages[i].since);
+		assert(desc->num_fds == messages[i].num_fds);
+		assert(desc->num_arrays == messages[i].num_arrays);
+		assert(desc->num_objects == messages[i].num_objects);
+		assert(desc->fixed_size == messages[i].fixed_size);
+
+		/* The descriptor is built once and then reused */
+		assert(wl_message_get_desc(messages[i].message) == desc);
+	}
+}
+
+TEST(message_desc_by_signature)
+{
+	const struct wl_message_desc *desc, *other;
+	struct wl_message message;
+	char *signature;
+
+	/* Messages with the same signature share their descriptor */
+	desc = wl_message_get_desc(
+		&wl_pointer_interface.events[WL_POINTER_ENTER]);
+	signature = strdup("uoff");
+	assert(signature);
+	message = (struct wl_message) { "enter", signature, NULL };
+	assert(wl_message_get_desc(&message) == desc);
+
+	/* Metadata allocated at runtime can be freed and its memory reused
+	 * for a different signature. */
+	strcpy(signature, "ush");
+	other = wl_message_get_desc(&message);
+	assert(other && other != desc);
+	assert(other->count == 3);
+	assert(other->types[2] == WL_ARG_FD);
+	assert(strcmp(desc->signature, "uoff") == 0);
+	free(signature);
+
+	signature = strdup("uoff");
+	assert(signature);
+	message.signature = signature;
+	assert(wl_message_get_desc(&message) == desc);
+	free(signature);
+}
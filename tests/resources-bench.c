@@ -0,0 +1,264 @@
+/*
+ * Copyright © 2013 Marek Chalupa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Timing loops for event posting. These are not part of the unit
+ * suite; run them with "meson test --benchmark". */
+
+#include <assert.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "wayland-server.h"
+#include "test-runner.h"
+
+#define BROADCAST_CLIENTS 4
+
+struct broadcast_test {
+	struct wl_display *display;
+	struct wl_client *client[BROADCAST_CLIENTS];
+	int fd[BROADCAST_CLIENTS];
+	struct wl_list resources;
+};
+
+static void
+broadcast_resource_destroy(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+broadcast_test_init(struct broadcast_test *test, int resources_per_client)
+{
+	struct wl_resource *resource;
+	int i, j, s[2];
+
+	test->display = wl_display_create();
+	assert(test->display);
+	wl_list_init(&test->resources);
+
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+				  0, s) == 0);
+		assert(fcntl(s[1], F_SETFL, O_NONBLOCK) == 0);
+		test->client[i] = wl_client_create(test->display, s[0]);
+		assert(test->client[i]);
+		test->fd[i] = s[1];
+
+		for (j = 0; j < resources_per_client; j++) {
+			resource = wl_resource_create(test->client[i],
+						      &wl_keyboard_interface,
+						      1, 0);
+			assert(resource);
+			wl_resource_set_destructor(resource,
+						   broadcast_resource_destroy);
+			wl_list_insert(test->resources.prev,
+				       wl_resource_get_link(resource));
+		}
+	}
+}
+
+static void
+broadcast_test_release(struct broadcast_test *test)
+{
+	int i;
+
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		wl_client_destroy(test->client[i]);
+		close(test->fd[i]);
+	}
+	assert(wl_list_empty(&test->resources));
+	wl_display_destroy(test->display);
+}
+
+/* Flushes the clients and throws away what they were sent */
+static void
+broadcast_test_drain(struct broadcast_test *test)
+{
+	char data[4096];
+	ssize_t len;
+	int i;
+
+	wl_display_flush_clients(test->display);
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		do {
+			len = read(test->fd[i], data, sizeof data);
+		} while (len > 0);
+		assert(len < 0 && errno == EAGAIN);
+	}
+}
+
+static double
+broadcast_test_nsec(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+TEST(resource_broadcast_event_bench)
+{
+	const int per_client = 256, iterations = 100;
+	struct broadcast_test test;
+	struct wl_resource *resource;
+	struct timespec start, end;
+	double post = 0, broadcast = 0;
+	int i;
+
+	broadcast_test_init(&test, per_client);
+
+	/* One event to 1024 resources, with the flushes in between */
+	for (i = 0; i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		wl_resource_for_each(resource, &test.resources)
+			wl_resource_post_event(resource, WL_KEYBOARD_KEY,
+					       i, 2, 3, 1);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		post += broadcast_test_nsec(&start, &end);
+		broadcast_test_drain(&test);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		wl_resource_broadcast_event(&test.resources, WL_KEYBOARD_KEY,
+					    i, 2, 3, 1);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		broadcast += broadcast_test_nsec(&start, &end);
+		broadcast_test_drain(&test);
+	}
+
+	fprintf(stderr, "%d resources: %.0f ns per resource posting, "
+		"%.0f ns broadcasting\n", BROADCAST_CLIENTS * per_client,
+		post / (iterations * BROADCAST_CLIENTS * per_client),
+		broadcast / (iterations * BROADCAST_CLIENTS * per_client));
+
+	broadcast_test_release(&test);
+}
+
+static double
+resource_bench_nsec(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start->tv_sec) * 1e9 +
+		(end.tv_nsec - start->tv_nsec);
+}
+
+TEST(resource_create_destroy_bench)
+{
+	const int count = 1000000, live = 100000;
+	struct wl_display *display;
+	struct wl_client *client;
+	struct wl_resource *resource;
+	struct timespec start;
+	double churn, teardown;
+	int i, s[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_create();
+	assert(display);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+
+	/* Short-lived objects */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		resource = wl_resource_create(client, &wl_callback_interface,
+					      1, 0);
+		assert(resource);
+		wl_resource_destroy(resource);
+	}
+	churn = resource_bench_nsec(&start);
+
+	/* Objects left for the client teardown */
+	for (i = 0; i < live; i++)
+		assert(wl_resource_create(client, &wl_callback_interface,
+					  1, 0));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wl_client_destroy(client);
+	teardown = resource_bench_nsec(&start);
+
+	fprintf(stderr, "%d wl_callback created and destroyed: %.1f ns "
+		"each, client teardown with %d left: %.1f ns each\n",
+		count, churn / count, live, teardown / live);
+
+	wl_display_destroy(display);
+	close(s[1]);
+}
+
+TEST(prepared_event_bench)
+{
+	const int batch = 100, iterations = 2000;
+	struct broadcast_test test;
+	struct wl_resource *pointer, *callback;
+	struct wl_prepared_event *motion, *done;
+	struct timespec start, end;
+	double post = 0, prepared = 0;
+	int i, j;
+
+	broadcast_test_init(&test, 0);
+	pointer = wl_resource_create(test.client[0], &wl_pointer_interface,
+				     1, 0);
+	callback = wl_resource_create(test.client[0], &wl_callback_interface,
+				      1, 0);
+	assert(pointer && callback);
+	motion = wl_resource_prepare_event(pointer, WL_POINTER_MOTION);
+	done = wl_resource_prepare_event(callback, WL_CALLBACK_DONE);
+	assert(motion && done);
+
+	/* A motion and a frame callback per iteration, drained in between */
+	for (i = 0; i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < batch; j++) {
+			wl_resource_post_event(pointer, WL_POINTER_MOTION, j,
+					       j << 8, j << 8);
+			wl_resource_post_event(callback, WL_CALLBACK_DONE, j);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		post += broadcast_test_nsec(&start, &end);
+		broadcast_test_drain(&test);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < batch; j++) {
+			wl_prepared_event_post(motion, j, j << 8, j << 8);
+			wl_prepared_event_post(done, j);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		prepared += broadcast_test_nsec(&start, &end);
+		broadcast_test_drain(&test);
+	}
+
+	fprintf(stderr, "wl_resource_post_event(): %.1f M events/s, "
+		"wl_prepared_event_post(): %.1f M events/s\n",
+		2e3 * batch * iterations / post,
+		2e3 * batch * iterations / prepared);
+
+	wl_prepared_event_destroy(motion);
+	wl_prepared_event_destroy(done);
+	broadcast_test_release(&test);
+}
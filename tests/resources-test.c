@@ -26,9 +26,16 @@
 #include <assert.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "wayland-server.h"
+#include "wayland-client.h"
 #include "test-runner.h"
 
 TEST(create_resource_tst)
@@ -263,3 +270,957 @@ TEST(resource_destroy_iteration)
 
 	wl_display_destroy(display);
 }
+
+#define BROADCAST_CLIENTS 4
+
+struct broadcast_test {
+	struct wl_display *display;
+	struct wl_client *client[BROADCAST_CLIENTS];
+	int fd[BROADCAST_CLIENTS];
+	struct wl_list resources;
+};
+
+static void
+broadcast_resource_destroy(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+broadcast_test_init(struct broadcast_test *test, int resources_per_client)
+{
+	struct wl_resource *resource;
+	int i, j, s[2];
+
+	test->display = wl_display_create();
+	assert(test->display);
+	wl_list_init(&test->resources);
+
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+				  0, s) == 0);
+		assert(fcntl(s[1], F_SETFL, O_NONBLOCK) == 0);
+		test->client[i] = wl_client_create(test->display, s[0]);
+		assert(test->client[i]);
+		test->fd[i] = s[1];
+
+		for (j = 0; j < resources_per_client; j++) {
+			resource = wl_resource_create(test->client[i],
+						      &wl_keyboard_interface,
+						      1, 0);
+			assert(resource);
+			wl_resource_set_destructor(resource,
+						   broadcast_resource_destroy);
+			wl_list_insert(test->resources.prev,
+				       wl_resource_get_link(resource));
+		}
+	}
+}
+
+static void
+broadcast_test_release(struct broadcast_test *test)
+{
+	int i;
+
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		/* Unless disconnected by the test */
+		if (test->client[i])
+			wl_client_destroy(test->client[i]);
+		close(test->fd[i]);
+	}
+	assert(wl_list_empty(&test->resources));
+	wl_display_destroy(test->display);
+}
+
+/* Reads what was sent to a client, returning the number of fds */
+static int
+broadcast_test_read(struct broadcast_test *test, int i,
+		    uint32_t *data, size_t size, ssize_t *len)
+{
+	char control[CMSG_SPACE(sizeof(int) * 28)];
+	struct iovec iov = { data, size };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	int fds = 0, j, fd;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	*len = recvmsg(test->fd[i], &msg, 0);
+	if (*len <= 0)
+		return 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		assert(cmsg->cmsg_type == SCM_RIGHTS);
+		for (j = 0; CMSG_LEN((j + 1) * sizeof fd) <= cmsg->cmsg_len;
+		     j++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + j * sizeof fd,
+			       sizeof fd);
+			close(fd);
+			fds++;
+		}
+	}
+
+	return fds;
+}
+
+TEST(resource_broadcast_event)
+{
+	struct broadcast_test test;
+	struct wl_resource *resource;
+	uint32_t data[64];
+	ssize_t len;
+	int i, j, p[2];
+
+	broadcast_test_init(&test, 2);
+
+	/* Every resource gets the event with its own id */
+	wl_resource_broadcast_event(&test.resources, WL_KEYBOARD_KEY,
+				    1, 2, 3, 1);
+	wl_display_flush_clients(test.display);
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		assert(broadcast_test_read(&test, i, data, sizeof data,
+					   &len) == 0);
+		assert(len == 2 * 24);
+		j = 0;
+		wl_resource_for_each(resource, &test.resources) {
+			if (wl_resource_get_client(resource) !=
+			    test.client[i])
+				continue;
+			assert(data[j * 6] == wl_resource_get_id(resource));
+			assert(data[j * 6 + 1] == (24 << 16 | WL_KEYBOARD_KEY));
+			assert(data[j * 6 + 2] == 1 && data[j * 6 + 5] == 1);
+			j++;
+		}
+		assert(j == 2);
+	}
+
+	/* With a copy of the fd for each resource, the caller keeps the
+	 * original */
+	assert(pipe(p) == 0);
+	wl_resource_broadcast_event(&test.resources, WL_KEYBOARD_KEYMAP,
+				    WL_KEYBOARD_KEYMAP_FORMAT_NO_KEYMAP,
+				    p[0], 0);
+	wl_display_flush_clients(test.display);
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		assert(broadcast_test_read(&test, i, data, sizeof data,
+					   &len) == 2);
+		assert(len == 2 * 16);
+	}
+	assert(fcntl(p[0], F_GETFD) >= 0);
+	close(p[0]);
+	close(p[1]);
+
+	broadcast_test_release(&test);
+}
+
+TEST(resource_queue_event_coalesced)
+{
+	struct broadcast_test test;
+	struct wl_resource *pointer[3];
+	uint32_t id, data[64];
+	ssize_t len;
+	int i;
+
+	broadcast_test_init(&test, 0);
+	for (i = 0; i < 2; i++) {
+		pointer[i] = wl_resource_create(test.client[0],
+						&wl_pointer_interface, 1, 0);
+		assert(pointer[i]);
+	}
+
+	/* Pending motion is replaced per pointer, other events are kept.
+	 * Queued events go out with the next posted one. */
+	for (i = 0; i < 100; i++) {
+		wl_resource_queue_event_coalesced(pointer[0],
+						  WL_POINTER_MOTION, NULL, i,
+						  wl_fixed_from_int(i), 0);
+		wl_resource_queue_event_coalesced(pointer[1],
+						  WL_POINTER_MOTION, NULL, i,
+						  wl_fixed_from_int(-i), 0);
+	}
+	wl_resource_post_event(pointer[0], WL_POINTER_BUTTON, 1, 2, 3, 1);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 20 + 20 + 24);
+	assert(data[0] == wl_resource_get_id(pointer[0]));
+	assert(data[1] == (20 << 16 | WL_POINTER_MOTION));
+	assert(data[2] == 99 && data[3] == (uint32_t) wl_fixed_from_int(99));
+	assert(data[5] == wl_resource_get_id(pointer[1]));
+	assert(data[8] == (uint32_t) wl_fixed_from_int(-99));
+	assert(data[11] == (24 << 16 | WL_POINTER_BUTTON));
+
+	/* Events already sent are not replaced */
+	wl_resource_queue_event_coalesced(pointer[0], WL_POINTER_MOTION, NULL,
+					  1, 0, 0);
+	wl_resource_post_event(pointer[0], WL_POINTER_BUTTON, 1, 2, 3, 1);
+	wl_display_flush_clients(test.display);
+	wl_resource_queue_event_coalesced(pointer[0], WL_POINTER_MOTION, NULL,
+					  2, 0, 0);
+	wl_resource_post_event(pointer[0], WL_POINTER_BUTTON, 1, 2, 3, 1);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 2 * (20 + 24));
+	assert(data[2] == 1 && data[13] == 2);
+
+	/* Events sharing a key replace each other whatever their opcode */
+	wl_resource_queue_event_coalesced(pointer[0], WL_POINTER_MOTION,
+					  &test, 1, 0, 0);
+	wl_resource_queue_event_coalesced(pointer[0], WL_POINTER_AXIS,
+					  &test, 2, 0, 0);
+	wl_resource_post_event(pointer[0], WL_POINTER_BUTTON, 1, 2, 3, 1);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 20 + 24);
+	assert(data[1] == (20 << 16 | WL_POINTER_AXIS) && data[2] == 2);
+
+	/* The events of a destroyed resource are not replaced by those of
+	 * the next resource allocated in its place */
+	wl_resource_queue_event_coalesced(pointer[1], WL_POINTER_MOTION, NULL,
+					  1, 0, 0);
+	id = wl_resource_get_id(pointer[1]);
+	wl_resource_destroy(pointer[1]);
+	pointer[2] = wl_resource_create(test.client[0],
+					&wl_pointer_interface, 1, 0);
+	assert(pointer[2]);
+	wl_resource_queue_event_coalesced(pointer[2], WL_POINTER_MOTION, NULL,
+					  2, 0, 0);
+	wl_resource_post_event(pointer[0], WL_POINTER_BUTTON, 1, 2, 3, 1);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 2 * 20 + 24);
+	assert(data[0] == id && data[2] == 1);
+	assert(data[5] == wl_resource_get_id(pointer[2]) && data[7] == 2);
+
+	broadcast_test_release(&test);
+}
+
+TEST(resource_queue_event_coalesced_order)
+{
+	struct broadcast_test test;
+	struct wl_resource *pointer;
+	uint32_t data[64];
+	ssize_t len;
+
+	broadcast_test_init(&test, 0);
+	pointer = wl_resource_create(test.client[0], &wl_pointer_interface,
+				     5, 0);
+	assert(pointer);
+
+	/* A motion is not replaced across the frame queued after it */
+	wl_resource_queue_event_coalesced(pointer, WL_POINTER_MOTION, NULL,
+					  1, 0, 0);
+	wl_resource_queue_event(pointer, WL_POINTER_FRAME);
+	wl_resource_queue_event_coalesced(pointer, WL_POINTER_MOTION, NULL,
+					  2, 0, 0);
+	wl_resource_post_event(pointer, WL_POINTER_FRAME);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 2 * (20 + 8));
+	assert(data[1] == (20 << 16 | WL_POINTER_MOTION) && data[2] == 1);
+	assert(data[6] == (8 << 16 | WL_POINTER_FRAME));
+	assert(data[8] == (20 << 16 | WL_POINTER_MOTION) && data[9] == 2);
+	assert(data[13] == (8 << 16 | WL_POINTER_FRAME));
+
+	/* Nor across an event coalesced with another key */
+	wl_resource_queue_event_coalesced(pointer, WL_POINTER_MOTION, NULL,
+					  1, 0, 0);
+	wl_resource_queue_event_coalesced(pointer, WL_POINTER_AXIS, &test,
+					  2, 0, 0);
+	wl_resource_queue_event_coalesced(pointer, WL_POINTER_MOTION, NULL,
+					  3, 0, 0);
+	wl_resource_post_event(pointer, WL_POINTER_FRAME);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 3 * 20 + 8);
+	assert(data[1] == (20 << 16 | WL_POINTER_MOTION) && data[2] == 1);
+	assert(data[6] == (20 << 16 | WL_POINTER_AXIS) && data[7] == 2);
+	assert(data[11] == (20 << 16 | WL_POINTER_MOTION) && data[12] == 3);
+
+	/* The last event is still replaced */
+	wl_resource_queue_event(pointer, WL_POINTER_FRAME);
+	wl_resource_queue_event_coalesced(pointer, WL_POINTER_MOTION, NULL,
+					  1, 0, 0);
+	wl_resource_queue_event_coalesced(pointer, WL_POINTER_MOTION, NULL,
+					  2, 0, 0);
+	wl_resource_post_event(pointer, WL_POINTER_FRAME);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 8 + 20 + 8);
+	assert(data[3] == (20 << 16 | WL_POINTER_MOTION) && data[4] == 2);
+
+	broadcast_test_release(&test);
+}
+
+#define POSTING_THREADS 4
+#define POSTED_EVENTS 2000
+
+struct posting_thread {
+	pthread_t thread;
+	struct wl_resource *resource;
+	uint32_t index;
+};
+
+static void *
+posting_thread_run(void *data)
+{
+	struct posting_thread *thread = data;
+	uint32_t i;
+
+	for (i = 0; i < POSTED_EVENTS; i++)
+		assert(wl_resource_post_event_threadsafe(thread->resource,
+							 WL_KEYBOARD_KEY,
+							 thread->index, i,
+							 0, 1) == 0);
+
+	return NULL;
+}
+
+TEST(resource_post_event_threadsafe)
+{
+	struct broadcast_test test;
+	struct posting_thread threads[POSTING_THREADS];
+	struct wl_event_loop *loop;
+	struct wl_resource *keyboard, *device;
+	uint32_t data[6 * 256], next[POSTING_THREADS] = { 0 };
+	size_t have = 0, i;
+	ssize_t len;
+	int received = 0, t;
+
+	broadcast_test_init(&test, 1);
+	loop = wl_display_get_event_loop(test.display);
+	/* Room for all the events, which may be spliced at once */
+	wl_client_set_max_buffer_size(test.client[0],
+				      POSTING_THREADS * POSTED_EVENTS * 24);
+	keyboard = wl_resource_from_link(test.resources.next);
+	assert(wl_resource_get_client(keyboard) == test.client[0]);
+
+	for (t = 0; t < POSTING_THREADS; t++) {
+		threads[t].resource = keyboard;
+		threads[t].index = t;
+		assert(pthread_create(&threads[t].thread, NULL,
+				      posting_thread_run, &threads[t]) == 0);
+	}
+
+	/* Each thread's events arrive in the order it posted them */
+	while (received < POSTING_THREADS * POSTED_EVENTS) {
+		wl_event_loop_dispatch(loop, 10);
+		wl_display_flush_clients(test.display);
+		broadcast_test_read(&test, 0, (uint32_t *) ((char *) data + have),
+				    sizeof data - have, &len);
+		if (len <= 0)
+			continue;
+		have += len;
+		for (i = 0; i + 24 <= have; i += 24, received++) {
+			assert(data[i / 4] == wl_resource_get_id(keyboard));
+			assert(data[i / 4 + 1] == (24 << 16 | WL_KEYBOARD_KEY));
+			t = data[i / 4 + 2];
+			assert(t < POSTING_THREADS);
+			assert(data[i / 4 + 3] == next[t]++);
+		}
+		memmove(data, (char *) data + i, have - i);
+		have -= i;
+	}
+	for (t = 0; t < POSTING_THREADS; t++)
+		assert(pthread_join(threads[t].thread, NULL) == 0);
+
+	/* Events of a resource destroyed before they are spliced are
+	 * dropped, and those of a destroyed client freed */
+	assert(wl_resource_post_event_threadsafe(keyboard, WL_KEYBOARD_KEY,
+						 0, 0, 0, 1) == 0);
+	wl_resource_destroy(keyboard);
+	wl_event_loop_dispatch(loop, 0);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len < 0 && errno == EAGAIN);
+	keyboard = wl_resource_from_link(test.resources.next);
+	assert(wl_resource_post_event_threadsafe(keyboard, WL_KEYBOARD_KEY,
+						 0, 0, 0, 1) == 0);
+
+	/* Events creating objects are refused */
+	device = wl_resource_create(test.client[1], &wl_data_device_interface,
+				    1, 0);
+	assert(device);
+	errno = 0;
+	assert(wl_resource_post_event_threadsafe(device,
+						 WL_DATA_DEVICE_DATA_OFFER,
+						 device) < 0);
+	assert(errno == EINVAL);
+
+	broadcast_test_release(&test);
+}
+
+static void *
+post_callback_done(void *data)
+{
+	struct wl_resource *callback = data;
+
+	assert(wl_resource_post_event_threadsafe(callback, WL_CALLBACK_DONE,
+						 1) == 0);
+
+	return NULL;
+}
+
+static void *
+post_pointer_enter(void *data)
+{
+	struct wl_resource **resources = data;
+
+	assert(wl_resource_post_event_threadsafe(resources[0],
+						 WL_POINTER_ENTER, 1,
+						 resources[1], 0, 0) == 0);
+
+	return NULL;
+}
+
+TEST(resource_post_event_threadsafe_reused)
+{
+	struct broadcast_test test;
+	struct wl_event_loop *loop;
+	struct wl_resource *callback, *reused, *resources[2];
+	pthread_t thread;
+	uint32_t id, data[64];
+	ssize_t len;
+
+	broadcast_test_init(&test, 0);
+	loop = wl_display_get_event_loop(test.display);
+
+	/* The event of a destroyed callback doesn't reach the next one
+	 * allocated in its place with its id */
+	callback = wl_resource_create(test.client[0], &wl_callback_interface,
+				      1, 0);
+	assert(callback);
+	id = wl_resource_get_id(callback);
+	assert(pthread_create(&thread, NULL, post_callback_done,
+			      callback) == 0);
+	assert(pthread_join(thread, NULL) == 0);
+	wl_resource_destroy(callback);
+	reused = wl_resource_create(test.client[0], &wl_callback_interface,
+				    1, 0);
+	assert(reused == callback && wl_resource_get_id(reused) == id);
+
+	wl_event_loop_dispatch(loop, 0);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len < 0 && errno == EAGAIN);
+
+	/* Nor does an event whose object argument was replaced by an object
+	 * of another interface */
+	resources[0] = wl_resource_create(test.client[0], &wl_pointer_interface,
+					  1, 0);
+	resources[1] = wl_resource_create(test.client[0], &wl_surface_interface,
+					  1, 0);
+	assert(resources[0] && resources[1]);
+	id = wl_resource_get_id(resources[1]);
+	assert(pthread_create(&thread, NULL, post_pointer_enter,
+			      resources) == 0);
+	assert(pthread_join(thread, NULL) == 0);
+	wl_resource_destroy(resources[1]);
+	reused = wl_resource_create(test.client[0], &wl_region_interface,
+				    1, 0);
+	assert(reused && wl_resource_get_id(reused) == id);
+
+	wl_event_loop_dispatch(loop, 0);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len < 0 && errno == EAGAIN);
+
+	broadcast_test_release(&test);
+}
+
+struct congestion_listener {
+	struct wl_listener listener;
+	int changes;
+};
+
+static void
+congestion_notify(struct wl_listener *listener, void *data)
+{
+	struct congestion_listener *congestion =
+		wl_container_of(listener, congestion, listener);
+
+	congestion->changes++;
+}
+
+static void
+client_destroyed_notify(struct wl_listener *listener, void *data)
+{
+	wl_list_remove(&listener->link);
+	wl_list_init(&listener->link);
+}
+
+/* Sends events the client doesn't read until it is congested */
+static void
+backpressure_fill(struct broadcast_test *test, int i,
+		  struct wl_resource *keyboard)
+{
+	int n;
+
+	for (n = 0; n < 100000; n++) {
+		wl_resource_post_event(keyboard, WL_KEYBOARD_KEY, n, 0, 0, 1);
+		if (wl_client_is_congested(test->client[i]))
+			return;
+		wl_display_flush_clients(test->display);
+	}
+	assert(!"client never congested");
+}
+
+/* Reads events until the client is no longer congested */
+static void
+backpressure_drain(struct broadcast_test *test, int i)
+{
+	struct wl_event_loop *loop = wl_display_get_event_loop(test->display);
+	uint32_t data[1024];
+	ssize_t len;
+	int n;
+
+	for (n = 0; wl_client_is_congested(test->client[i]); n++) {
+		assert(n < 100000);
+		broadcast_test_read(test, i, data, sizeof data, &len);
+		wl_event_loop_dispatch(loop, 0);
+	}
+}
+
+TEST(client_backpressure)
+{
+	struct broadcast_test test;
+	struct wl_client_output_stats stats;
+	struct congestion_listener congestion = {
+		.listener.notify = congestion_notify,
+	};
+	struct wl_listener destroyed = { .notify = client_destroyed_notify };
+	struct wl_resource *keyboard[BROADCAST_CLIENTS], *pointer[2];
+	struct wl_event_loop *loop;
+	/* wl_display.get_registry with new id 2 */
+	uint32_t request[] = { 1, 12 << 16 | WL_DISPLAY_GET_REGISTRY, 2 };
+	int size = 4096, i;
+
+	broadcast_test_init(&test, 1);
+	loop = wl_display_get_event_loop(test.display);
+	keyboard[0] = wl_resource_from_link(test.resources.next);
+	keyboard[1] = wl_resource_from_link(test.resources.next->next);
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		assert(setsockopt(wl_client_get_fd(test.client[i]), SOL_SOCKET,
+				  SO_SNDBUF, &size, sizeof size) == 0);
+		wl_client_set_max_buffer_size(test.client[i], 65536);
+	}
+	for (i = 0; i < 2; i++) {
+		pointer[i] = wl_resource_create(test.client[0],
+						&wl_pointer_interface, 1, 0);
+		assert(pointer[i]);
+	}
+
+	assert(wl_client_set_backpressure(test.client[0], 1024, 4096,
+					  WL_CLIENT_BACKPRESSURE_NOTIFY) < 0);
+	assert(wl_client_set_backpressure(test.client[0], 8192, 1024,
+					  WL_CLIENT_BACKPRESSURE_NOTIFY) == 0);
+	wl_client_add_congestion_listener(test.client[0],
+					  &congestion.listener);
+
+	/* The listener hears about both changes, the queue depth and age
+	 * are reported meanwhile */
+	backpressure_fill(&test, 0, keyboard[0]);
+	assert(congestion.changes == 1);
+	wl_client_get_output_stats(test.client[0], &stats);
+	assert(stats.queued_bytes >= 8192);
+	assert(stats.queued_nsec > 0);
+	assert(stats.congestions == 1);
+	backpressure_drain(&test, 0);
+	assert(congestion.changes == 2);
+	wl_client_get_output_stats(test.client[0], &stats);
+	assert(stats.queued_bytes <= 1024);
+
+	/* Coalescable events only replace pending ones */
+	assert(wl_client_set_backpressure(test.client[0], 8192, 1024,
+					  WL_CLIENT_BACKPRESSURE_DROP_COALESCED) == 0);
+	wl_resource_queue_event_coalesced(pointer[0], WL_POINTER_MOTION, NULL,
+					  1, 0, 0);
+	backpressure_fill(&test, 0, keyboard[0]);
+	wl_resource_queue_event_coalesced(pointer[0], WL_POINTER_MOTION, NULL,
+					  2, 0, 0);
+	wl_resource_queue_event_coalesced(pointer[1], WL_POINTER_MOTION, NULL,
+					  2, 0, 0);
+	wl_client_get_output_stats(test.client[0], &stats);
+	assert(stats.dropped_events == 1);
+	backpressure_drain(&test, 0);
+
+	/* Requests of a paused client are left unread */
+	assert(wl_client_set_backpressure(test.client[0], 8192, 1024,
+					  WL_CLIENT_BACKPRESSURE_PAUSE) == 0);
+	backpressure_fill(&test, 0, keyboard[0]);
+	assert(write(test.fd[0], request, sizeof request) == sizeof request);
+	wl_event_loop_dispatch(loop, 10);
+	assert(wl_client_get_resource_count(test.client[0],
+					    &wl_registry_interface) == 0);
+	backpressure_drain(&test, 0);
+	wl_event_loop_dispatch(loop, 10);
+	assert(wl_client_get_resource_count(test.client[0],
+					    &wl_registry_interface) == 1);
+
+	/* A congested client is disconnected by the next flush */
+	assert(wl_client_set_backpressure(test.client[1], 8192, 1024,
+					  WL_CLIENT_BACKPRESSURE_DISCONNECT) == 0);
+	wl_client_add_destroy_listener(test.client[1], &destroyed);
+	backpressure_fill(&test, 1, keyboard[1]);
+	wl_display_flush_clients(test.display);
+	assert(wl_list_empty(&destroyed.link));
+	test.client[1] = NULL;
+
+	broadcast_test_release(&test);
+}
+
+static void
+count_protocol_logger(void *user_data, enum wl_protocol_logger_type type,
+		      const struct wl_protocol_logger_message *message)
+{
+	int *count = user_data;
+
+	(*count)++;
+}
+
+TEST(prepared_event)
+{
+	struct broadcast_test test;
+	struct wl_resource *pointer, *surface;
+	struct wl_prepared_event *motion;
+	struct wl_protocol_logger *logger;
+	uint32_t expected[64], data[64];
+	ssize_t len;
+	int logged = 0;
+
+	broadcast_test_init(&test, 0);
+	pointer = wl_resource_create(test.client[0], &wl_pointer_interface,
+				     1, 0);
+	assert(pointer);
+
+	/* Only events made of words can be prepared */
+	surface = wl_resource_create(test.client[0], &wl_surface_interface,
+				     1, 0);
+	assert(surface);
+	assert(wl_resource_prepare_event(surface, WL_SURFACE_ENTER) == NULL);
+	assert(errno == EINVAL);
+	assert(wl_resource_prepare_event(pointer, 42) == NULL);
+	assert(errno == EINVAL);
+
+	/* The same bytes go out as with wl_resource_post_event() */
+	motion = wl_resource_prepare_event(pointer, WL_POINTER_MOTION);
+	assert(motion);
+	wl_resource_post_event(pointer, WL_POINTER_MOTION, 7,
+			       wl_fixed_from_int(-3), wl_fixed_from_double(.5));
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, expected, sizeof expected, &len);
+	assert(len == 20);
+	wl_prepared_event_post(motion, 7, wl_fixed_from_int(-3),
+			       wl_fixed_from_double(.5));
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 20);
+	assert(memcmp(data, expected, len) == 0);
+
+	/* Protocol loggers still see the events */
+	logger = wl_display_add_protocol_logger(test.display,
+						count_protocol_logger,
+						&logged);
+	wl_prepared_event_post(motion, 8, 0, 0);
+	assert(logged == 1);
+	wl_protocol_logger_destroy(logger);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len == 20 && data[2] == 8);
+
+	/* Nothing is sent once the resource is gone */
+	wl_resource_destroy(pointer);
+	wl_prepared_event_post(motion, 9, 0, 0);
+	wl_display_flush_clients(test.display);
+	broadcast_test_read(&test, 0, data, sizeof data, &len);
+	assert(len < 0 && errno == EAGAIN);
+	wl_prepared_event_destroy(motion);
+
+	broadcast_test_release(&test);
+}
+
+TEST(resource_memory_reuse)
+{
+	struct wl_display *display;
+	struct wl_client *client;
+	struct wl_resource *resource[64], *again;
+	int i, s[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_create();
+	assert(display);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+
+	for (i = 0; i < 64; i++) {
+		resource[i] = wl_resource_create(client, &wl_callback_interface,
+						 1, 0);
+		assert(resource[i]);
+	}
+
+	/* Freed resources are recycled by the client, cleared */
+	wl_resource_set_user_data(resource[10], (void *) 0xbee);
+	wl_resource_destroy(resource[10]);
+	again = wl_resource_create(client, &wl_region_interface, 1, 0);
+	assert(again == resource[10]);
+	assert(wl_resource_get_user_data(again) == NULL);
+	assert(wl_resource_instance_of(again, &wl_region_interface, NULL));
+
+	/* The others go with the client */
+	wl_client_destroy(client);
+	wl_display_destroy(display);
+	close(s[1]);
+}
+
+static enum wl_iterator_result
+sum_resource_counts(const struct wl_interface *interface, uint32_t count,
+		    void *user_data)
+{
+	uint32_t *sum = user_data;
+
+	*sum += count;
+
+	return WL_ITERATOR_CONTINUE;
+}
+
+TEST(client_stats)
+{
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct wl_client *client;
+	struct wl_client_stats stats, before;
+	struct wl_resource *resource[16];
+	struct wl_display *client_display;
+	struct wl_registry *registry;
+	struct wl_shm *shm;
+	struct wl_shm_pool *pool;
+	FILE *file;
+	uint32_t sum = 0;
+	int i, s[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_create();
+	assert(display);
+	loop = wl_display_get_event_loop(display);
+	assert(wl_display_init_shm(display) == 0);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+
+	wl_client_get_stats(client, &before);
+	assert(before.resources == 1);
+	assert(before.buffer_bytes == 0);
+	assert(before.object_map_bytes > 0);
+	assert(before.resource_bytes > 0);
+	assert(before.shm_pools == 0 && before.shm_pool_bytes == 0);
+
+	for (i = 0; i < 16; i++) {
+		resource[i] = wl_resource_create(client, i % 4 ?
+						 &wl_callback_interface :
+						 &wl_region_interface, 1, 0);
+		assert(resource[i]);
+	}
+
+	wl_client_get_stats(client, &stats);
+	assert(stats.resources == 17);
+	assert(stats.resource_bytes > before.resource_bytes);
+	assert(wl_client_get_resource_count(client,
+					    &wl_callback_interface) == 12);
+	assert(wl_client_get_resource_count(client,
+					    &wl_region_interface) == 4);
+	assert(wl_client_get_resource_count(client,
+					    &wl_surface_interface) == 0);
+	wl_client_for_each_resource_count(client, sum_resource_counts, &sum);
+	assert(sum == 17);
+
+	for (i = 0; i < 16; i += 2)
+		wl_resource_destroy(resource[i]);
+	wl_client_get_stats(client, &stats);
+	assert(stats.resources == 9);
+	assert(wl_client_get_resource_count(client,
+					    &wl_callback_interface) == 8);
+	assert(wl_client_get_resource_count(client,
+					    &wl_region_interface) == 0);
+
+	/* Shm pools are accounted while their object lives */
+	client_display = wl_display_connect_to_fd(s[1]);
+	assert(client_display);
+	registry = wl_display_get_registry(client_display);
+	shm = wl_registry_bind(registry, 1, &wl_shm_interface, 1);
+	file = tmpfile();
+	assert(file);
+	assert(ftruncate(fileno(file), 8192) == 0);
+	pool = wl_shm_create_pool(shm, fileno(file), 4096);
+	assert(wl_display_flush(client_display) >= 0);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	wl_client_get_stats(client, &stats);
+	assert(stats.shm_pools == 1);
+	assert(stats.shm_pool_bytes == 4096);
+
+	wl_shm_pool_resize(pool, 8192);
+	assert(wl_display_flush(client_display) >= 0);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	wl_client_get_stats(client, &stats);
+	assert(stats.shm_pool_bytes == 8192);
+
+	wl_shm_pool_destroy(pool);
+	assert(wl_display_flush(client_display) >= 0);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	wl_client_get_stats(client, &stats);
+	assert(stats.shm_pools == 0 && stats.shm_pool_bytes == 0);
+
+	fclose(file);
+	wl_client_destroy(client);
+	wl_shm_destroy(shm);
+	wl_registry_destroy(registry);
+	wl_display_disconnect(client_display);
+	wl_display_destroy(display);
+}
+
+struct request_profile_sum {
+	uint64_t sync;
+	uint64_t get_registry;
+	uint64_t other;
+};
+
+static void
+sum_request_profiles(const struct wl_interface *interface, uint32_t opcode,
+		     const struct wl_request_profile *profile, void *data)
+{
+	struct request_profile_sum *sum = data;
+	uint64_t bucketed = 0;
+	int i;
+
+	for (i = 0; i < WL_REQUEST_PROFILE_BUCKETS; i++)
+		bucketed += profile->buckets[i];
+	assert(bucketed == profile->count);
+	assert(profile->max_nsec <= profile->total_nsec);
+
+	if (interface == &wl_display_interface &&
+	    opcode == WL_DISPLAY_SYNC)
+		sum->sync += profile->count;
+	else if (interface == &wl_display_interface &&
+		 opcode == WL_DISPLAY_GET_REGISTRY)
+		sum->get_registry += profile->count;
+	else
+		sum->other += profile->count;
+}
+
+static void
+send_syncs(struct wl_display *client_display, struct wl_event_loop *loop,
+	   int count)
+{
+	struct wl_callback *callback[64];
+	int i;
+
+	assert(count <= 64);
+	for (i = 0; i < count; i++)
+		callback[i] = wl_display_sync(client_display);
+	assert(wl_display_flush(client_display) >= 0);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	for (i = 0; i < count; i++)
+		wl_callback_destroy(callback[i]);
+}
+
+TEST(request_profiling)
+{
+	struct wl_display *display, *client_display;
+	struct wl_event_loop *loop;
+	struct wl_client *client;
+	struct wl_registry *registry;
+	struct wl_request_profile profile;
+	struct request_profile_sum sum = { 0 };
+	int s[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_create();
+	assert(display);
+	loop = wl_display_get_event_loop(display);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+	client_display = wl_display_connect_to_fd(s[1]);
+	assert(client_display);
+
+	/* Nothing is recorded until enabled */
+	send_syncs(client_display, loop, 10);
+	wl_display_for_each_request_profile(display, sum_request_profiles,
+					    &sum);
+	assert(sum.sync == 0 && sum.get_registry == 0 && sum.other == 0);
+
+	wl_display_set_request_profiling(display, true);
+	send_syncs(client_display, loop, 50);
+	registry = wl_display_get_registry(client_display);
+	send_syncs(client_display, loop, 50);
+	wl_display_for_each_request_profile(display, sum_request_profiles,
+					    &sum);
+	assert(sum.sync == 100 && sum.get_registry == 1 && sum.other == 0);
+	wl_client_get_request_profile(client, &profile);
+	assert(profile.count == 101);
+
+	/* The profiles are kept once disabled */
+	wl_display_set_request_profiling(display, false);
+	send_syncs(client_display, loop, 10);
+	memset(&sum, 0, sizeof sum);
+	wl_display_for_each_request_profile(display, sum_request_profiles,
+					    &sum);
+	assert(sum.sync == 100 && sum.get_registry == 1);
+
+	wl_registry_destroy(registry);
+	wl_client_destroy(client);
+	wl_display_disconnect(client_display);
+	wl_display_destroy(display);
+}
+
+TEST(client_buffers_idle)
+{
+	const int count = 1000;
+	uint32_t sync[3] = { 1, WL_DISPLAY_SYNC | (12 << 16), 2 };
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct wl_client_stats stats;
+	struct wl_client *client;
+	char events[24];
+	bool replied[1000] = { false };
+	size_t total = 0;
+	int i, done, fd[1000], s[2];
+
+	display = wl_display_create();
+	assert(display);
+	loop = wl_display_get_event_loop(display);
+
+	/* Clients idle after a roundtrip only keep their input and output
+	 * buffers, of the default size of 4 KiB */
+	for (i = 0; i < count; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+				  0, s) == 0);
+		assert(wl_client_create(display, s[0]));
+		fd[i] = s[1];
+		assert(write(fd[i], sync, sizeof sync) == sizeof sync);
+	}
+	for (done = 0; done < count; ) {
+		assert(wl_event_loop_dispatch(loop, 0) == 0);
+		wl_display_flush_clients(display);
+		for (i = 0; i < count; i++) {
+			if (!replied[i] &&
+			    recv(fd[i], events, sizeof events,
+				 MSG_DONTWAIT) == sizeof events) {
+				replied[i] = true;
+				done++;
+			}
+		}
+	}
+
+	wl_client_for_each(client, wl_display_get_client_list(display)) {
+		wl_client_get_stats(client, &stats);
+		total += stats.buffer_bytes;
+	}
+	fprintf(stderr, "%d idle clients: %zu bytes of connection buffers\n",
+		count, total);
+	assert(total == (size_t) count * 2 * 4096);
+
+	for (i = 0; i < count; i++)
+		close(fd[i]);
+	wl_display_destroy_clients(display);
+	wl_display_destroy(display);
+}
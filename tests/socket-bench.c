@@ -0,0 +1,165 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Timing loop for the accept path. It is not part of the unit suite;
+ * run it with "meson test --benchmark". */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "wayland-client.h"
+#include "wayland-os.h"
+#include "wayland-server.h"
+#include "test-runner.h"
+
+/* Ensure the connection doesn't fail due to lack of XDG_RUNTIME_DIR. */
+static const char *
+require_xdg_runtime_dir(void)
+{
+	char *val = getenv("XDG_RUNTIME_DIR");
+	assert(val && val[0] == '/' && "set $XDG_RUNTIME_DIR to run this test");
+
+	return val;
+}
+
+static int
+connect_to_socket(const char *name)
+{
+	struct sockaddr_un addr = { 0 };
+	socklen_t size;
+	int fd;
+
+	addr.sun_family = AF_LOCAL;
+	assert((size_t) snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%s",
+				 require_xdg_runtime_dir(), name) <
+	       sizeof addr.sun_path);
+	size = offsetof (struct sockaddr_un, sun_path) + strlen(addr.sun_path);
+
+	fd = wl_os_socket_cloexec(PF_LOCAL, SOCK_STREAM, 0);
+	assert(fd >= 0);
+	assert(connect(fd, (struct sockaddr *) &addr, size) == 0);
+
+	return fd;
+}
+
+#define STORM_CLIENTS 500
+
+struct storm_server {
+	struct wl_display *display;
+	pthread_t thread;
+	bool stop;
+	int iterations;
+};
+
+static void *
+storm_server_run(void *data)
+{
+	struct storm_server *server = data;
+	struct wl_event_loop *loop = wl_display_get_event_loop(server->display);
+
+	while (!__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE)) {
+		wl_display_flush_clients(server->display);
+		assert(wl_event_loop_dispatch(loop, 10) == 0);
+		server->iterations++;
+	}
+
+	return NULL;
+}
+
+TEST(connection_storm_bench)
+{
+	struct storm_server server = { 0 };
+	struct pollfd pfd[STORM_CLIENTS];
+	uint32_t sync[3] = { 1, WL_DISPLAY_SYNC | (12 << 16), 2 };
+	char events[24];
+	size_t pending[STORM_CLIENTS];
+	struct timespec start, end, connected[STORM_CLIENTS];
+	double total, first, first_max = 0, first_sum = 0;
+	int i, ready, iterations;
+	ssize_t ret;
+
+	server.display = wl_display_create();
+	assert(server.display);
+	assert(wl_display_add_socket(server.display, "wayland-storm-0") == 0);
+	assert(pthread_create(&server.thread, NULL, storm_server_run,
+			      &server) == 0);
+
+	/* All the clients connect and send a wl_display.sync at once, and
+	 * wait for its wl_callback.done and wl_display.delete_id */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < STORM_CLIENTS; i++) {
+		pfd[i].fd = connect_to_socket("wayland-storm-0");
+		clock_gettime(CLOCK_MONOTONIC, &connected[i]);
+		pfd[i].events = POLLIN;
+		assert(write(pfd[i].fd, sync, sizeof sync) == sizeof sync);
+		pending[i] = sizeof events;
+	}
+
+	for (ready = 0; ready < STORM_CLIENTS; ) {
+		assert(poll(pfd, STORM_CLIENTS, 5000) > 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		for (i = 0; i < STORM_CLIENTS; i++) {
+			if (!(pfd[i].revents & POLLIN) || pending[i] == 0)
+				continue;
+			ret = read(pfd[i].fd, events, pending[i]);
+			assert(ret > 0);
+			pending[i] -= ret;
+			if (pending[i] > 0)
+				continue;
+			ready++;
+			first = (end.tv_sec - connected[i].tv_sec) * 1e6 +
+				(end.tv_nsec - connected[i].tv_nsec) / 1e3;
+			first_sum += first;
+			if (first > first_max)
+				first_max = first;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	total = (end.tv_sec - start.tv_sec) * 1e3 +
+		(end.tv_nsec - start.tv_nsec) / 1e6;
+
+	__atomic_store_n(&server.stop, true, __ATOMIC_RELEASE);
+	assert(pthread_join(server.thread, NULL) == 0);
+	iterations = server.iterations;
+
+	fprintf(stderr, "%d clients connecting at once: %.1f ms in total, "
+		"first roundtrip after %.0f us on average and %.0f us at "
+		"most, %d loop iterations\n", STORM_CLIENTS, total,
+		first_sum / STORM_CLIENTS, first_max, iterations);
+
+	for (i = 0; i < STORM_CLIENTS; i++)
+		close(pfd[i].fd);
+	wl_display_destroy_clients(server.display);
+	wl_display_destroy(server.display);
+}
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -287,3 +288,56 @@ TEST(absolute_socket_path)
 	ret = unlink(addr.sun_path);
 	assert(ret == 0);
 }
+
+static int
+connect_to_socket(const char *name)
+{
+	struct sockaddr_un addr = { 0 };
+	socklen_t size;
+	int fd;
+
+	addr.sun_family = AF_LOCAL;
+	assert((size_t) snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%s",
+				 require_xdg_runtime_dir(), name) <
+	       sizeof addr.sun_path);
+	size = offsetof (struct sockaddr_un, sun_path) + strlen(addr.sun_path);
+
+	fd = wl_os_socket_cloexec(PF_LOCAL, SOCK_STREAM, 0);
+	assert(fd >= 0);
+	assert(connect(fd, (struct sockaddr *) &addr, size) == 0);
+
+	return fd;
+}
+
+TEST(accept_limit)
+{
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	int fd[5], i;
+
+	display = wl_display_create();
+	assert(display);
+	loop = wl_display_get_event_loop(display);
+	assert(wl_display_add_socket(display, "wayland-accept-0") == 0);
+	wl_display_set_accept_limit(display, 2);
+
+	for (i = 0; i < 5; i++)
+		fd[i] = connect_to_socket("wayland-accept-0");
+
+	/* Pending connections are accepted up to the limit per wakeup */
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(wl_list_length(wl_display_get_client_list(display)) == 2);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(wl_list_length(wl_display_get_client_list(display)) == 4);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(wl_list_length(wl_display_get_client_list(display)) == 5);
+
+	/* Without connections left, the handler returns rather than
+	 * block in accept() */
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+
+	for (i = 0; i < 5; i++)
+		close(fd[i]);
+	wl_display_destroy_clients(display);
+	wl_display_destroy(display);
+}